@@ -731,6 +731,7 @@ struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
     size_t work_size;
+    const int * cpus; // [jart]
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
@@ -776,6 +777,7 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
         }
     }
 
+    cpu_plan->cplan.cpus                = cpu_ctx->cpus; // [jart]
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
@@ -815,6 +817,7 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
     }
     cplan.work_data = cpu_ctx->work_data;
 
+    cplan.cpus                = cpu_ctx->cpus; // [jart]
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
@@ -881,6 +884,7 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->n_threads           = GGML_DEFAULT_N_THREADS;
     ctx->work_data           = NULL;
     ctx->work_size           = 0;
+    ctx->cpus                = NULL; // [jart]
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
 
@@ -917,6 +921,14 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+// [jart] pins thread i of each graph to cpus[i], or unpins if null
+void ggml_backend_cpu_set_cpus(ggml_backend_t backend_cpu, const int * cpus) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->cpus = cpus;
+}
+
 GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
@@ -1531,8 +1531,16 @@ struct ggml_context_container {
 
 struct ggml_phaser {
     alignas(64) atomic_uint i;
+    unsigned long long calls; // [jart] barriers this thread reached
+    long long waited; // [jart] rdtsc() ticks this thread spent spinning
 };
 
+struct ggml_chunker { // [jart]
+    alignas(CACHE_LINE_SIZE) atomic_int i;
+};
+
+struct ggml_sched_node;
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan * cplan;
@@ -1546,7 +1554,11 @@ struct ggml_compute_state_shared {
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
     void * abort_callback_data;
 
-    atomic_int current_chunk; // currently processing chunk during mul_mat, shared between all the threads
+    struct ggml_chunker * current_chunk; // currently processing chunk during mul_mat, shared between all the threads
+
+    const struct ggml_sched_node * sched; // [jart] where barriers go, or null for everywhere
+    size_t wsize; // [jart] scratch memory before the schedule
+    int n_skipped; // [jart] barriers thread 0 didn't have to wait on
 
     enum ggml_status ec;
 };
@@ -1807,13 +1819,32 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
+// [jart] barrier waits are timed with rdtsc(), which costs much less
+//        than clock_gettime(). ticks get converted to nanoseconds when
+//        stats are read, by comparing both clocks since the first graph
+static struct {
+    atomic_ullong barriers;
+    atomic_ullong skipped;
+    atomic_ullong wait_ticks;
+    atomic_llong epoch_ticks;
+    atomic_llong epoch_ns;
+} g_barrier_stats;
+
+static long long ggml_barrier_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 void ggml_barrier(const struct ggml_compute_params * params) {
     if (params->shared->n_threads == 1)
         return;
     int n = params->shared->n_threads;
+    struct ggml_phaser * self = &params->shared->n_barrier_passed[params->ith];
     atomic_int * count = &params->shared->n_barrier;
-    atomic_uint * phase = &params->shared->n_barrier_passed[params->ith].i;
+    atomic_uint * phase = &self->i;
     unsigned i = atomic_load_explicit(phase, memory_order_relaxed);
+    ++self->calls;
     if (atomic_fetch_add_explicit(count, 1, memory_order_acq_rel) == n - 1) {
         atomic_store_explicit(count, 0, memory_order_relaxed);
         for (int j = 0; j < n; ++j)
@@ -1821,10 +1852,27 @@ void ggml_barrier(const struct ggml_compute_params * params) {
                                   i + 1, memory_order_relaxed);
         atomic_thread_fence(memory_order_release);
     } else {
+        long long started = rdtsc();
         while (atomic_load_explicit(phase, memory_order_relaxed) == i)
             pthread_pause_np();
         atomic_thread_fence(memory_order_acquire);
+        self->waited += rdtsc() - started;
+    }
+}
+
+void ggml_get_barrier_stats(struct ggml_barrier_stats * stats) { // [jart]
+    stats->barriers = atomic_load_explicit(&g_barrier_stats.barriers, memory_order_relaxed);
+    stats->skipped = atomic_load_explicit(&g_barrier_stats.skipped, memory_order_relaxed);
+    double ns_per_tick = 0;
+    long long t0 = atomic_load_explicit(&g_barrier_stats.epoch_ticks, memory_order_acquire);
+    long long n0 = atomic_load_explicit(&g_barrier_stats.epoch_ns, memory_order_relaxed);
+    if (t0) {
+        long long dt = rdtsc() - t0;
+        long long dn = ggml_barrier_nanos() - n0;
+        if (dt > 0 && dn > 0)
+            ns_per_tick = (double)dn / dt;
     }
+    stats->wait_ns = atomic_load_explicit(&g_barrier_stats.wait_ticks, memory_order_relaxed) * ns_per_tick;
 }
 
 // TODO: make this somehow automatically executed
@@ -1932,6 +1980,44 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+bool ggml_numa_interleaved(void) { // [jart]
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_INTERLEAVE;
+}
+
+// [jart] rows of weights are split between numa nodes in multiples of
+//        this, so tinyBLAS tiles and repacked quant blocks never straddle
+#define GGML_NUMA_ROWS 64
+
+// [jart] returns true if matrix rows are owned by separate numa nodes
+static bool ggml_numa_splits(const struct ggml_tensor * t) {
+    return ggml_numa_interleaved() && t->ne[1] >= (int64_t)g_state.numa.n_nodes * GGML_NUMA_ROWS;
+}
+
+// [jart] returns slice of rows [r0,r1) whose memory lives on node
+static void ggml_numa_rows(int64_t nrows, int node, int64_t * r0, int64_t * r1) {
+    const int64_t n = g_state.numa.n_nodes;
+    const int64_t nblocks = (nrows + GGML_NUMA_ROWS - 1) / GGML_NUMA_ROWS;
+    *r0 = MIN(nrows, nblocks * node / n * GGML_NUMA_ROWS);
+    *r1 = MIN(nrows, nblocks * (node + 1) / n * GGML_NUMA_ROWS);
+}
+
+// [jart] puts thread on the team that multiplies its node's rows
+//
+// with --numa interleave, thread ith runs on node ith % n_nodes, so
+// each node's threads get a local ith and nth for its slice of src0
+static bool ggml_numa_team(const struct ggml_compute_params * params, const struct ggml_tensor * src0,
+                           int64_t * r0, int64_t * r1, int * ith, int * nth) {
+    const int n = g_state.numa.n_nodes;
+    if (!ggml_numa_splits(src0) || params->nth < n) {
+        return false;
+    }
+    const int node = params->ith % n;
+    *ith = params->ith / n;
+    *nth = (params->nth - node + n - 1) / n;
+    ggml_numa_rows(src0->ne[1], node, r0, r1);
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -11068,6 +11154,14 @@ static void ggml_compute_forward_mul_mat(
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
+    // [jart] with --numa interleave, threads only read src0 rows that
+    //        were placed in the memory of the node they're running on
+    int64_t row0 = 0;
+    int64_t row1 = ne01;
+    int tith = ith;
+    int tnth = nth;
+    const bool team = ggml_numa_team(params, src0, &row0, &row1, &tith, &tnth);
+
 #if GGML_USE_LLAMAFILE
     // broadcast factors
     const int64_t r2 = ne12 / ne02;
@@ -11078,14 +11172,14 @@ static void ggml_compute_forward_mul_mat(
     if (src1_cont) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(row1 - row0, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + row0*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + row0*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     tith, tnth,
                                      src0->type,
                                      src1->type,
                                      dst->type))
@@ -11129,7 +11223,7 @@ UseGgmlGemm1:;
 
     if (ith == 0) {
         // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store(&params->shared->current_chunk, nth);
+        atomic_store(&params->shared->current_chunk[params->ichunk].i, nth);
     }
 
 #if GGML_USE_LLAMAFILE
@@ -11139,14 +11233,14 @@ UseGgmlGemm1:;
 
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(row1 - row0, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + row0*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + row0*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     tith, tnth,
                                      src0->type,
                                      vec_dot_type,
                                      dst->type))
@@ -11200,8 +11294,8 @@ UseGgmlGemm2:;
     if ((ggml_n_dims(src0) == 2) && gemv) {
         const void * src1_wdata      = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t src1_col_stride = ggml_is_contiguous(src1) || src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ne10) : nb11;
-        int64_t src0_start = (ith * ne01) / nth;
-        int64_t src0_end   = ((ith + 1) * ne01) / nth;
+        int64_t src0_start = row0 + (tith * (row1 - row0)) / tnth;
+        int64_t src0_end   = row0 + ((tith + 1) * (row1 - row0)) / tnth;
         src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
         src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
         if (src0_start >= src0_end) return;
@@ -11219,6 +11313,14 @@ UseGgmlGemm2:;
         return;
     }
 
+    if (team) { // [jart]
+        const int64_t dr = (row1 - row0 + tnth - 1) / tnth;
+        const int64_t ir0_start = MIN(row0 + dr * tith, row1);
+        const int64_t ir0_end = MIN(ir0_start + dr, row1);
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+        return;
+    }
+
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
     int current_chunk = ith;
 
@@ -11238,7 +11340,7 @@ UseGgmlGemm2:;
             break;
         }
 
-        current_chunk = atomic_fetch_add(&params->shared->current_chunk, 1);
+        current_chunk = atomic_fetch_add(&params->shared->current_chunk[params->ichunk].i, 1);
     }
 }
 
@@ -13971,6 +14073,28 @@ static void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+// y += dequantize(x)*s without going through a temporary fp32 row
+static void ggml_vec_mad_q8_0(const int n, float * restrict y, const void * restrict vx, const float s) {
+    const block_q8_0 * restrict x = (const block_q8_0 *) vx;
+    for (int i = 0; i < n/QK8_0; ++i) {
+        const float d = GGML_FP16_TO_FP32(x[i].d)*s;
+        for (int j = 0; j < QK8_0; ++j) {
+            y[i*QK8_0 + j] += x[i].qs[j]*d;
+        }
+    }
+}
+
+static void ggml_vec_mad_q4_0(const int n, float * restrict y, const void * restrict vx, const float s) {
+    const block_q4_0 * restrict x = (const block_q4_0 *) vx;
+    for (int i = 0; i < n/QK4_0; ++i) {
+        const float d = GGML_FP16_TO_FP32(x[i].d)*s;
+        for (int j = 0; j < QK4_0/2; ++j) {
+            y[i*QK4_0 + j]           += ((x[i].qs[j] & 0x0F) - 8)*d;
+            y[i*QK4_0 + j + QK4_0/2] += ((x[i].qs[j] >>   4) - 8)*d;
+        }
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -14051,6 +14175,14 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
     ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
 
+    // quantized kv caches accumulate V straight from their blocks
+    void (*v_mad)(const int, float * restrict, const void * restrict, const float) = NULL;
+    if (v->type == GGML_TYPE_Q8_0) {
+        v_mad = ggml_vec_mad_q8_0;
+    } else if (v->type == GGML_TYPE_Q4_0) {
+        v_mad = ggml_vec_mad_q4_0;
+    }
+
     // loop over n_batch and n_head
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -14139,10 +14271,13 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                     vs = expf(s - M);
                 }
 
-                v_to_float(v_data, V32, D);
-
                 // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                if (v_mad) {
+                    v_mad(D, VKQ32, v_data, vs);
+                } else {
+                    v_to_float(v_data, V32, D);
+                    ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                }
             }
 
             S = S*ms + vs; // scale and increment sum with partial sum
@@ -15473,6 +15608,173 @@ static void ggml_compute_forward_cross_entropy_loss_back(
     }
 }
 
+// [jart] fused kernels
+//
+// llama.cpp builds graphs where an op is immediately consumed by a
+// multiply, e.g. rms_norm followed by the norm weights, or silu of the
+// ffn gate followed by the up projection. computing such pairs a row
+// at a time, with the same vectorized primitives the separate ops use,
+// keeps each activation row in L1 between the two steps and gets rid
+// of a full pass over memory, as well as a barrier, for every layer.
+// the intermediate tensor is still written, since it may have readers
+// elsewhere in the graph, and results are identical to the unfused ops
+
+enum ggml_fusion {
+    GGML_FUSE_NONE,
+    GGML_FUSE_PRODUCER, // computed as part of the next node
+    GGML_FUSE_RMS_NORM_MUL,
+    GGML_FUSE_SILU_MUL,
+};
+
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * norm = dst->src[0];
+    const struct ggml_tensor * src0 = norm->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps > 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                float * y = (float *) ((char *) norm->data + i01*norm->nb[1] + i02*norm->nb[2] + i03*norm->nb[3]);
+
+                memcpy(y, x, ne00 * sizeof(float));
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                ggml_vec_scale_f32(ne00, y, scale);
+
+                float * z = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+                float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                ggml_vec_mul_f32(ne00, z, y, w);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_silu_mul_f32(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * silu = dst->src[0];
+    const struct ggml_tensor * src0 = silu->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        float * s = (float *) ((char *) silu->data + i1*(silu->nb[1]));
+
+        ggml_vec_silu_f32(nc, s, (float *) ((char *) src0->data + i1*(src0->nb[1])));
+
+        ggml_vec_mul_f32(nc,
+                (float *) ((char *) dst->data  + i1*( dst->nb[1])), s,
+                (float *) ((char *) src1->data + i1*(src1->nb[1])));
+    }
+}
+
+static void ggml_compute_forward_fused(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst,
+        enum ggml_fusion fusion) {
+
+    switch (fusion) {
+        case GGML_FUSE_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, dst);
+            } break;
+        case GGML_FUSE_SILU_MUL:
+            {
+                ggml_compute_forward_silu_mul_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+// returns true if writing w a row at a time can't clobber rows of r
+// that another thread hasn't read yet
+static bool ggml_fusion_is_rowwise_safe(const struct ggml_tensor * w, const struct ggml_tensor * r) {
+    if (w->data == r->data) {
+        return ggml_are_same_shape(w, r) && ggml_are_same_stride(w, r);
+    }
+    const char * w0 = (const char *)w->data;
+    const char * r0 = (const char *)r->data;
+    return !(w0 < r0 + ggml_nbytes(r) && r0 < w0 + ggml_nbytes(w));
+}
+
+// returns how node a and the node b that follows it may be computed
+// together, or GGML_FUSE_NONE if they can't be
+static enum ggml_fusion ggml_graph_fusion(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (b->op != GGML_OP_MUL || b->src[0] != a) {
+        return GGML_FUSE_NONE;
+    }
+
+    const struct ggml_tensor * x = a->src[0];
+    const struct ggml_tensor * w = b->src[1];
+
+    if (!a->data || !b->data || !x->data || !w->data ||
+        ggml_is_empty(a) ||
+        x->type != GGML_TYPE_F32 || a->type != GGML_TYPE_F32 ||
+        w->type != GGML_TYPE_F32 || b->type != GGML_TYPE_F32 ||
+        x->nb[0] != sizeof(float) || a->nb[0] != sizeof(float) ||
+        w->nb[0] != sizeof(float) || b->nb[0] != sizeof(float) ||
+        !ggml_are_same_shape(x, a) || !ggml_are_same_shape(a, b) ||
+        !ggml_fusion_is_rowwise_safe(a, x) || !ggml_fusion_is_rowwise_safe(a, w) ||
+        !ggml_fusion_is_rowwise_safe(b, x) || !ggml_fusion_is_rowwise_safe(b, w) ||
+        !ggml_fusion_is_rowwise_safe(b, a)) {
+        return GGML_FUSE_NONE;
+    }
+
+    if (a->op == GGML_OP_RMS_NORM &&
+        w->ne[0] == a->ne[0] && ggml_can_repeat(w, a)) {
+        return GGML_FUSE_RMS_NORM_MUL;
+    }
+
+    if (a->op == GGML_OP_UNARY && ggml_get_unary_op(a) == GGML_UNARY_OP_SILU &&
+        ggml_are_same_shape(w, a) &&
+        ggml_is_contiguous_1(x) && ggml_is_contiguous_1(a) &&
+        ggml_is_contiguous_1(w) && ggml_is_contiguous_1(b)) {
+        return GGML_FUSE_SILU_MUL;
+    }
+
+    return GGML_FUSE_NONE;
+}
+
 /////////////////////////////////
 
 static bool ggml_is_noop(enum ggml_op op) { // [jart]
@@ -17197,6 +17499,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_INTERLEAVE: // [jart]
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -17258,6 +17561,57 @@ static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+// [jart] weights whose rows ggml_numa_place() is touching
+struct ggml_numa_placement {
+    struct ggml_tensor ** tensors;
+    int n_tensors;
+    int node;
+};
+
+static thread_ret_t ggml_numa_place_thread(void * arg) {
+    const struct ggml_numa_placement * p = arg;
+    set_numa_thread_affinity(p->node);
+    for (int i = 0; i < p->n_tensors; ++i) {
+        struct ggml_tensor * t = p->tensors[i];
+        if (!ggml_numa_splits(t)) {
+            continue;
+        }
+        int64_t r0, r1;
+        ggml_numa_rows(t->ne[1], p->node, &r0, &r1);
+        for (int64_t i3 = 0; i3 < t->ne[3]; ++i3) {
+            for (int64_t i2 = 0; i2 < t->ne[2]; ++i2) {
+                memset((char *)t->data + i3*t->nb[3] + i2*t->nb[2] + r0*t->nb[1], 0, (r1 - r0)*t->nb[1]);
+            }
+        }
+    }
+    clear_numa_thread_affinity();
+    return 0;
+}
+
+// [jart] first touches rows of weights from the node that'll own them
+//
+// this must be called on freshly allocated memory, before the weights
+// are loaded, since linux puts each page on the node that faults it in
+void ggml_numa_place(struct ggml_tensor ** tensors, int n_tensors) {
+    if (!ggml_numa_interleaved()) {
+        return;
+    }
+    const int n = g_state.numa.n_nodes;
+    ggml_thread_t * threads = alloca(n * sizeof(ggml_thread_t));
+    struct ggml_numa_placement * placements = alloca(n * sizeof(struct ggml_numa_placement));
+    for (int node = 0; node < n; ++node) {
+        placements[node] = (struct ggml_numa_placement) {tensors, n_tensors, node};
+        const int rc = ggml_thread_create(&threads[node], ggml_numa_place_thread, &placements[node]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+    for (int node = 0; node < n; ++node) {
+        const int rc = ggml_thread_join(threads[node], NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+}
+
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     int n_tasks = 0;
 
@@ -17460,6 +17814,346 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+// [jart] scratch memory needed by a node's threads in the work buffer
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const struct ggml_tensor * src2 = node->src[2];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                size_t cur2 = llamafile_mixmul_needs(src0, src1, src2); // [jart]
+                cur = cur > cur2 ? cur : cur2;
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ABORT("fatal error");
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // D
+
+                cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+        default:
+            break;
+    }
+
+    return cur;
+}
+
+// [jart] dependency-aware barrier elision
+//
+// ggml normally makes every thread rendezvous after each node, so the
+// next node can safely read what the previous one wrote. many adjacent
+// nodes don't depend on each other though (e.g. the q/k/v projections
+// or the ffn gate and up matmuls all just read the same normalized
+// input) and with lots of cores, decoding a single token is dominated
+// by threads waiting on each other. so we group consecutive nodes into
+// runs whose memory doesn't overlap, and only put barriers in between
+// runs. nodes within a run each get their own slice of scratch memory
+// and their own matmul chunk counter, so threads are free to drift.
+
+#define GGML_SCHED_MAX_RUN  8 // max nodes computed between barriers
+#define GGML_SCHED_CHUNKERS 4 // max matmuls per run
+#define GGML_SCHED_FUSE_GAP 4 // max nodes a fused op may be deferred past
+
+struct ggml_sched_node {
+    uint32_t offset; // where node's scratch begins, in cache lines
+    uint8_t  ichunk; // which chunk counter matmul should use
+    uint8_t  fusion; // how node is computed together with its neighbor
+    bool     barrier; // whether threads need to rendezvous afterwards
+};
+
+// returns true if op has no shared state besides its tensors and its
+// scratch memory, thus it can safely overlap with other such nodes
+static bool ggml_sched_is_elidable(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_DUP:
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_SCALE:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_FLASH_ATTN_EXT:
+        case GGML_OP_UNARY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_sched_overlaps(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (!a || !b) {
+        return false;
+    }
+    if (!a->data || !b->data) {
+        return true;
+    }
+    const char * a0 = (const char *)a->data;
+    const char * b0 = (const char *)b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// returns true if b neither reads what a writes, nor writes what a
+// reads or writes, in which case they may be computed concurrently
+static bool ggml_sched_is_independent(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_sched_overlaps(a, b)) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (ggml_sched_overlaps(a->src[i], b) ||
+            ggml_sched_overlaps(a, b->src[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// finds a later node that node i can be computed together with
+//
+// the consumer isn't always adjacent, e.g. llama.cpp computes the ffn
+// up projection in between the silu of the gate and the multiply. the
+// producer may be deferred until its consumer as long as nothing in
+// between touches its input or output.
+static int ggml_graph_find_fusion(const struct ggml_cgraph * cgraph, int i, enum ggml_fusion * fusion) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+    if (node->op != GGML_OP_RMS_NORM && node->op != GGML_OP_UNARY) {
+        return -1;
+    }
+    for (int j = i + 1; j < cgraph->n_nodes && j <= i + GGML_SCHED_FUSE_GAP; ++j) {
+        const struct ggml_tensor * next = cgraph->nodes[j];
+        if (next->src[0] == node && (*fusion = ggml_graph_fusion(node, next))) {
+            return j;
+        }
+        if (!ggml_sched_is_independent(node, next)) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// decides where the barriers go and how scratch memory is divided
+//
+// if sched is non-null then it's filled with one entry per graph node.
+// the number of scratch bytes needed by the busiest run is returned.
+static size_t ggml_graph_schedule(const struct ggml_cgraph * cgraph, int n_threads,
+                                  struct ggml_sched_node * sched) {
+    const struct ggml_tensor * run[GGML_SCHED_MAX_RUN];
+    int n_run = 0;
+    int n_chunkers = 0;
+    bool open = false;
+    size_t need = 0;
+    size_t most = 0;
+    int prev = -1;
+    int producer = -1;
+    int consumer = -1;
+    enum ggml_fusion pending = GGML_FUSE_NONE;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_is_noop(node->op)) {
+            if (sched) {
+                sched[i] = (struct ggml_sched_node){0, 0, GGML_FUSE_NONE, true};
+            }
+            continue;
+        }
+
+        // a fused pair is scheduled as a unit at the consumer's spot,
+        // and both tensors are written, so both need to be independent
+        const struct ggml_tensor * unit[2];
+        int n_unit = 0;
+        enum ggml_fusion fusion = GGML_FUSE_NONE;
+        if (i == consumer) {
+            unit[n_unit++] = cgraph->nodes[producer];
+            fusion = pending;
+            consumer = -1;
+        } else if (consumer == -1 &&
+                   (consumer = ggml_graph_find_fusion(cgraph, i, &pending)) != -1) {
+            producer = i;
+            if (sched) {
+                sched[i] = (struct ggml_sched_node){0, 0, GGML_FUSE_PRODUCER, false};
+            }
+            continue;
+        }
+        unit[n_unit++] = node;
+        const struct ggml_tensor * first = unit[0];
+
+        size_t cur = 0;
+        if (!fusion) {
+            cur = ggml_graph_node_work_size(node, ggml_get_n_tasks((struct ggml_tensor *)node, n_threads));
+        }
+        if (cur) {
+            cur = GGML_PAD(cur + CACHE_LINE_SIZE*(n_threads - 1), CACHE_LINE_SIZE);
+        }
+
+        bool join = n_threads > 1 && open &&
+                    n_run + n_unit <= GGML_SCHED_MAX_RUN &&
+                    ggml_sched_is_elidable(first) &&
+                    ggml_sched_is_elidable(node) &&
+                    (node->op != GGML_OP_MUL_MAT || n_chunkers < GGML_SCHED_CHUNKERS);
+        for (int j = 0; join && j < n_run; ++j) {
+            for (int k = 0; join && k < n_unit; ++k) {
+                join = ggml_sched_is_independent(run[j], unit[k]);
+            }
+        }
+
+        if (!join) {
+            n_run = 0;
+            n_chunkers = 0;
+            need = 0;
+        } else if (sched) {
+            sched[prev].barrier = false;
+        }
+
+        if (sched) {
+            sched[i].offset = need / CACHE_LINE_SIZE;
+            sched[i].ichunk = node->op == GGML_OP_MUL_MAT ? n_chunkers : 0;
+            sched[i].fusion = fusion;
+            sched[i].barrier = true;
+        }
+
+        if (node->op == GGML_OP_MUL_MAT) {
+            ++n_chunkers;
+        }
+        need += cur;
+        most = MAX(most, need);
+        for (int k = 0; k < n_unit; ++k) {
+            run[n_run++] = unit[k];
+        }
+        open = ggml_sched_is_elidable(node);
+        prev = i;
+    }
+
+    return most;
+}
+
 struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -17480,142 +18174,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
-
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type) ||
-                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const struct ggml_tensor * src2 = node->src[2];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                    size_t cur2 = llamafile_mixmul_needs(src0, src1, src2); // [jart]
-                    cur = cur > cur2 ? cur : cur2;
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ABORT("fatal error");
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
-
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // D
-
-                    cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ABORT("fatal error");
-                }
-            default:
-                break;
-        }
+        size_t cur = ggml_graph_node_work_size(node, n_tasks);
 
         work_size = MAX(work_size, cur);
     }
@@ -17624,7 +18183,11 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
         work_size += CACHE_LINE_SIZE*(n_threads - 1);
     }
 
+    // [jart] make room for the barrier schedule at the end of the buffer
     cplan.n_threads = MIN(max_tasks, n_threads);
+    work_size = MAX(work_size, ggml_graph_schedule(cgraph, cplan.n_threads, NULL));
+    work_size += sizeof(struct ggml_sched_node) * (cgraph->n_nodes + 1);
+
     cplan.work_size = work_size;
     cplan.work_data = NULL;
 
@@ -17637,7 +18200,12 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const struct ggml_cgraph * cgraph = state->shared->cgraph;
     const struct ggml_cplan  * cplan  = state->shared->cplan;
 
-    set_numa_thread_affinity(state->ith);
+    if (cplan->cpus && cplan->cpus[state->ith] >= 0 && !ggml_numa_interleaved()) { // [jart]
+        llamafile_pin_thread(cplan->cpus[state->ith]);
+    } else {
+        llamafile_pin_thread(-1);
+        set_numa_thread_affinity(state->ith);
+    }
 
 #ifdef LLAMAFILE_DEBUG // [jart]
     if (FLAG_trap && !state->is_main_thread) {
@@ -17657,8 +18225,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.wsize =*/ cplan->work_size,
         /*.wdata =*/ cplan->work_data,
         /*.shared=*/ state->shared,
+        /*.ichunk=*/ 0,
     };
 
+    const struct ggml_sched_node * sched = state->shared->sched; // [jart]
+
     for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
@@ -17669,12 +18240,33 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         llamafile_debug_op_index = node_n;
 #endif
 
-        ggml_compute_forward(&params, node);
+        if (sched) { // [jart]
+            if (sched[node_n].fusion == GGML_FUSE_PRODUCER)
+                continue;
+            size_t offset = (size_t)sched[node_n].offset * CACHE_LINE_SIZE;
+            params.wdata = (char *)cplan->work_data + offset;
+            params.wsize = state->shared->wsize - offset;
+            params.ichunk = sched[node_n].ichunk;
+        }
+
+        if (sched && sched[node_n].fusion) // [jart]
+            ggml_compute_forward_fused(&params, node, sched[node_n].fusion);
+        else
+            ggml_compute_forward(&params, node);
 
         if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->ec = GGML_STATUS_ABORTED;
         }
 
+        // [jart] the next node doesn't touch anything this one did, so
+        //        let threads move on to it without waiting. errors get
+        //        noticed after the next barrier, so everyone agrees.
+        if (sched && !sched[node_n].barrier) {
+            if (state->ith == 0)
+                ++state->shared->n_skipped;
+            continue;
+        }
+
         ggml_barrier(&params);
 
         if (state->shared->ec != GGML_STATUS_SUCCESS) {
@@ -17684,6 +18276,12 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     pthread_setcanceltype(ct, 0); // [jart]
 
+    // [jart] cplan->cpus are given back once the graph is done, so idle
+    //        pool workers mustn't keep spinning on cores that now belong
+    //        to some other graph. the main thread is unpinned by caller
+    if (!state->is_main_thread)
+        llamafile_pin_thread(-1);
+
     return 0;
 }
 
@@ -17695,6 +18293,7 @@ struct ggml_compute_cleanup {
 static void ggml_compute_canceled(void *arg) {
     struct ggml_compute_cleanup *cleanup = arg;
     clear_numa_thread_affinity();
+    llamafile_pin_thread(-1); // [jart]
     for (int j = 1; j < cleanup->n_threads; j++) {
         ggml_thread_t t;
         if ((t = atomic_exchange_explicit(&cleanup->workers[j].thrd, 0,
@@ -17724,6 +18323,27 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
             (struct ggml_phaser *)(((uintptr_t)mem + az) & -az);
     memset(n_barrier_passed, 0, pz * n_threads);
 
+    struct ggml_chunker current_chunk[GGML_SCHED_CHUNKERS];
+    for (int i = 0; i < GGML_SCHED_CHUNKERS; ++i)
+        atomic_init(&current_chunk[i].i, 0);
+
+    // [jart] the schedule of barriers and fused ops lives at the end of
+    //        the work buffer. it won't be used if the caller didn't ask
+    //        ggml_graph_plan() how much memory is needed.
+    const struct ggml_sched_node * sched = NULL;
+    size_t wsize = cplan->work_size;
+    size_t schedz = sizeof(struct ggml_sched_node) * (cgraph->n_nodes + 1);
+    if (cplan->work_size >= schedz) {
+        struct ggml_sched_node * table = (struct ggml_sched_node *)
+            (((uintptr_t)cplan->work_data + cplan->work_size - schedz +
+              alignof(struct ggml_sched_node) - 1) & -alignof(struct ggml_sched_node));
+        size_t avail = (uint8_t *)table - cplan->work_data;
+        if (ggml_graph_schedule(cgraph, n_threads, table) <= avail) {
+            sched = table;
+            wsize = avail;
+        }
+    }
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
@@ -17732,7 +18352,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.n_barrier_passed        =*/ n_barrier_passed,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
-        /*.current_chunk           =*/ 0,
+        /*.current_chunk           =*/ current_chunk,
+        /*.sched                   =*/ sched,
+        /*.wsize                   =*/ wsize,
+        /*.n_skipped               =*/ 0,
         /*.ec                      =*/ GGML_STATUS_SUCCESS,
     };
 
@@ -17812,8 +18435,24 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     }
     pthread_setcancelstate(cs, 0);
 
+    // [jart] report how much time threads spent waiting on each other
+    if (n_threads > 1) {
+        long long waited = 0;
+        for (int j = 0; j < n_threads; j++)
+            waited += n_barrier_passed[j].waited;
+        atomic_fetch_add_explicit(&g_barrier_stats.barriers, n_barrier_passed[0].calls, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_barrier_stats.skipped, state_shared.n_skipped, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_barrier_stats.wait_ticks, waited, memory_order_relaxed);
+        if (!atomic_load_explicit(&g_barrier_stats.epoch_ticks, memory_order_relaxed)) {
+            long long zero = 0;
+            if (atomic_compare_exchange_strong(&g_barrier_stats.epoch_ns, &zero, ggml_barrier_nanos()))
+                atomic_store_explicit(&g_barrier_stats.epoch_ticks, rdtsc(), memory_order_release);
+        }
+    }
+
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
+    llamafile_pin_thread(-1); // [jart]
 
     pthread_cleanup_pop(false);
 
@@ -635,6 +635,9 @@ extern "C" {
 
         int n_threads;
 
+        // [jart] cpu to pin each thread to, or null to not pin them
+        const int * cpus;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -690,6 +693,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_INTERLEAVE = 5, // [jart] split weight rows between nodes
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -704,6 +708,9 @@ extern "C" {
         void * wdata;
 
         struct ggml_compute_state_shared * shared;
+
+        // which matmul chunk counter to use
+        int ichunk;
     };
 
     void ggml_barrier(const struct ggml_compute_params * params);
@@ -731,6 +738,8 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API bool    ggml_numa_interleaved(void); // [jart] true if weight rows are split between nodes
+    GGML_API void    ggml_numa_place(struct ggml_tensor ** tensors, int n_tensors); // [jart] call before loading weights
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -2041,6 +2050,16 @@ extern "C" {
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API enum ggml_status  ggml_graph_compute(      struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+
+    // [jart] cumulative counters of how cpu threads synchronized
+    struct ggml_barrier_stats {
+        uint64_t barriers; // times all threads had to rendezvous
+        uint64_t skipped;  // barriers elided between independent nodes
+        uint64_t wait_ns;  // total time threads spent waiting on others
+    };
+
+    GGML_API void ggml_get_barrier_stats(struct ggml_barrier_stats * stats);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
@@ -6,6 +6,29 @@
 #include "llama-sampling.h"
 
 #include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+// most grammar states whose token masks are remembered per grammar
+#define LLAMA_GRAMMAR_MAX_MASKS 256
+
+// most distinct grammars whose token masks are remembered
+#define LLAMA_GRAMMAR_MAX_CACHED 8
+
+// candidate arrays smaller than this are checked token by token unless
+// there's already a mask for the grammar state, since the sampler uses
+// single token arrays to quickly check if its first choice is allowed
+#define LLAMA_GRAMMAR_MIN_MASKED 64
+
+struct llama_grammar_masks {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<uint64_t>>> states;
+};
+
+struct llama_grammar_mask_cache {
+    std::vector<std::pair<std::string, std::shared_ptr<llama_grammar_masks>>> grammars;
+};
 
 // Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
 // pointer. If an invalid sequence is encountered, returns `llama_partial_utf8.n_remain == -1`.
@@ -382,6 +405,230 @@ static bool llama_grammar_detect_left_recursion(
     return false;
 }
 
+//
+// token masks
+//
+
+// builds prefix tree of vocabulary code points
+//
+// end of generation tokens, empty pieces, and tokens that aren't valid
+// utf-8 are left out, since the grammar never allows them anyway.
+static std::shared_ptr<const llama_token_trie> llama_token_trie_build(const llama_vocab & vocab) {
+    struct entry {
+        std::vector<uint32_t> code_points;
+        llama_token           id;
+        llama_partial_utf8    partial_utf8;
+    };
+
+    std::vector<entry> entries;
+    entries.reserve(vocab.cache_token_to_piece.size());
+    for (size_t i = 0; i < vocab.cache_token_to_piece.size(); ++i) {
+        const llama_token   id    = i;
+        const std::string & piece = vocab.cache_token_to_piece[i];
+        if (llama_token_is_eog_impl(vocab, id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+        auto decoded = decode_utf8(piece, { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+        decoded.first.pop_back(); // terminating 0
+        entries.push_back({ std::move(decoded.first), id, decoded.second });
+    }
+
+    // once sorted, a token's path shares its prefix with the previous one
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        if (a.code_points != b.code_points) {
+            return a.code_points < b.code_points;
+        }
+        return a.id < b.id;
+    });
+
+    auto trie = std::make_shared<llama_token_trie>();
+    trie->tokens.reserve(entries.size());
+    trie->nodes.push_back({ 0, 0, 0, 0 });
+    std::vector<uint32_t> path = { 0 };
+    const std::vector<uint32_t> * prev = nullptr;
+    for (const auto & e : entries) {
+        size_t common = 0;
+        if (prev) {
+            while (common < prev->size() && common < e.code_points.size() &&
+                   (*prev)[common] == e.code_points[common]) {
+                ++common;
+            }
+        }
+        while (path.size() > common + 1) {
+            trie->nodes[path.back()].end = trie->nodes.size();
+            path.pop_back();
+        }
+        for (size_t i = common; i < e.code_points.size(); ++i) {
+            path.push_back(trie->nodes.size());
+            trie->nodes.push_back({ e.code_points[i], 0, 0, 0 });
+        }
+        llama_token_trie::node & node = trie->nodes[path.back()];
+        if (node.tok_begin == node.tok_end) {
+            node.tok_begin = node.tok_end = trie->tokens.size();
+        }
+        trie->tokens.emplace_back(e.id, e.partial_utf8);
+        ++node.tok_end;
+        prev = &e.code_points;
+    }
+    while (!path.empty()) {
+        trie->nodes[path.back()].end = trie->nodes.size();
+        path.pop_back();
+    }
+    return trie;
+}
+
+static std::shared_ptr<const llama_token_trie> llama_token_trie_get(const llama_vocab & vocab) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!vocab.grammar_trie) {
+        vocab.grammar_trie = llama_token_trie_build(vocab);
+    }
+    return vocab.grammar_trie;
+}
+
+// sets bits of tokens in subtree of trie node i which stack allows
+//
+// this has the same semantics as llama_grammar_reject_candidates_for_stack
+// except tokens which share a prefix are matched together.
+static void llama_grammar_mask_stack(
+        const llama_grammar_rules & rules,
+        const llama_token_trie    & trie,
+        uint32_t                    i,
+        const llama_grammar_stack & stack,
+        std::vector<uint64_t>     & mask) {
+    const llama_token_trie::node & node = trie.nodes[i];
+    const llama_grammar_element  * pos  = stack.empty() ? nullptr : stack.back();
+
+    // tokens that end here are allowed, unless they end with a partial
+    // sequence that can't satisfy this position in grammar
+    for (uint32_t k = node.tok_begin; k < node.tok_end; ++k) {
+        const auto & tok = trie.tokens[k];
+        if (tok.second.n_remain == 0 || (pos && llama_grammar_match_partial_char(pos, tok.second))) {
+            mask[tok.first / 64] |= 1ull << (tok.first % 64);
+        }
+    }
+    if (!pos) {
+        return;
+    }
+
+    // where the stack goes doesn't depend on which character matched
+    llama_grammar_stacks next_stacks;
+    bool advanced = false;
+    for (uint32_t j = i + 1; j < node.end; j = trie.nodes[j].end) {
+        if (!llama_grammar_match_char(pos, trie.nodes[j].code_point).first) {
+            continue;
+        }
+        if (!advanced) {
+            const auto * pos_after = llama_grammar_match_char(pos, 0).second;
+            llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos_after)) {
+                stack_after.push_back(pos_after);
+            }
+            llama_grammar_advance_stack(rules, stack_after, next_stacks);
+            advanced = true;
+        }
+        for (const auto & next : next_stacks) {
+            llama_grammar_mask_stack(rules, trie, j, next, mask);
+        }
+    }
+}
+
+// serializes grammar state in a way that doesn't depend on where the
+// rules are stored in memory, so copies of a grammar can share masks
+static std::string llama_grammar_state_key(const llama_grammar * grammar) {
+    std::string key;
+    for (const auto & stack : grammar->stacks) {
+        for (const llama_grammar_element * pos : stack) {
+            uint32_t loc[2] = { UINT32_MAX, UINT32_MAX };
+            for (size_t r = 0; r < grammar->rules.size(); ++r) {
+                const auto & rule = grammar->rules[r];
+                if (rule.data() <= pos && pos < rule.data() + rule.size()) {
+                    loc[0] = r;
+                    loc[1] = pos - rule.data();
+                    break;
+                }
+            }
+            key.append((const char *) loc, sizeof(loc));
+        }
+        key.append(8, '\xff');
+    }
+    return key;
+}
+
+// finds token masks of a previously seen grammar with the same rules
+//
+// masks are kept by the vocab they were computed with, so they're freed
+// along with the model, and can't be mistaken for another model's masks
+static std::shared_ptr<llama_grammar_masks> llama_grammar_masks_get(const llama_grammar_rules & rules, const llama_vocab & vocab) {
+    static std::mutex mutex;
+
+    std::string key;
+    for (const auto & rule : rules) {
+        key.append((const char *) rule.data(), rule.size() * sizeof(llama_grammar_element));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!vocab.grammar_masks) {
+        vocab.grammar_masks = std::make_shared<llama_grammar_mask_cache>();
+    }
+    auto & cached = vocab.grammar_masks->grammars;
+    for (auto it = cached.begin(); it != cached.end(); ++it) {
+        if (it->first == key) {
+            auto masks = it->second;
+            cached.erase(it);
+            cached.emplace_back(std::move(key), masks);
+            return masks;
+        }
+    }
+    if (cached.size() >= LLAMA_GRAMMAR_MAX_CACHED) {
+        cached.erase(cached.begin());
+    }
+    auto masks = std::make_shared<llama_grammar_masks>();
+    cached.emplace_back(std::move(key), masks);
+    return masks;
+}
+
+// returns bitmask of tokens allowed by grammar's current state
+//
+// masks are remembered, so walking the vocabulary only needs to happen
+// the first time a grammar reaches a given state. if there's no mask
+// yet and compute is false, then null is returned.
+static std::shared_ptr<const std::vector<uint64_t>> llama_grammar_get_mask(
+        const llama_grammar * grammar,
+        const llama_vocab   * vocab,
+        bool                  compute) {
+    if (!grammar->masks) {
+        grammar->masks = llama_grammar_masks_get(grammar->rules, *vocab);
+    }
+    std::string key = llama_grammar_state_key(grammar);
+    {
+        std::lock_guard<std::mutex> lock(grammar->masks->mutex);
+        auto it = grammar->masks->states.find(key);
+        if (it != grammar->masks->states.end()) {
+            return it->second;
+        }
+    }
+    if (!compute) {
+        return nullptr;
+    }
+
+    auto trie = llama_token_trie_get(*vocab);
+    auto mask = std::make_shared<std::vector<uint64_t>>((vocab->cache_token_to_piece.size() + 63) / 64);
+    for (const auto & stack : grammar->stacks) {
+        llama_grammar_mask_stack(grammar->rules, *trie, 0, stack, *mask);
+    }
+
+    std::lock_guard<std::mutex> lock(grammar->masks->mutex);
+    if (grammar->masks->states.size() >= LLAMA_GRAMMAR_MAX_MASKS) {
+        grammar->masks->states.clear();
+    }
+    grammar->masks->states.emplace(std::move(key), mask);
+    return mask;
+}
+
 //
 // grammar - external
 //
@@ -440,7 +687,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, nullptr };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -448,7 +695,7 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy_impl(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, grammar->masks };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -480,6 +727,25 @@ void llama_grammar_sample_impl(const struct llama_grammar * grammar, const struc
         }
     }
 
+    // use bitmask of allowed tokens unless a code point is half done
+    if (grammar->partial_utf8.n_remain == 0) {
+        const auto mask = llama_grammar_get_mask(grammar, vocab, candidates->size >= LLAMA_GRAMMAR_MIN_MASKED);
+        if (mask) {
+            for (size_t i = 0; i < candidates->size; ++i) {
+                const llama_token id = candidates->data[i].id;
+                if (llama_token_is_eog_impl(*vocab, id)) {
+                    if (!allow_eog) {
+                        candidates->data[i].logit = -INFINITY;
+                    }
+                } else if (!((*mask)[id / 64] >> (id % 64) & 1)) {
+                    candidates->data[i].logit = -INFINITY;
+                }
+            }
+            smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(candidates->size);
 
@@ -4,8 +4,27 @@
 
 #include "llama-impl.h"
 
+#include <memory>
+
 struct llama_vocab;
 struct llama_sampling;
+struct llama_grammar_masks;
+
+// code points of every token in a vocabulary, arranged as a prefix tree
+// so tokens which start the same way only get matched against a grammar
+// once. nodes are stored in depth-first order, and the subtree of node i
+// spans the nodes in [i + 1, end)
+struct llama_token_trie {
+    struct node {
+        uint32_t code_point;
+        uint32_t end;
+        uint32_t tok_begin; // tokens whose code points end at this node
+        uint32_t tok_end;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+    std::vector<std::pair<llama_token, llama_partial_utf8>> tokens;
+};
 
 struct llama_grammar {
     const llama_grammar_rules  rules;
@@ -13,6 +32,11 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // allowed tokens of each grammar state seen so far, which is found
+    // in the vocab the first time the grammar is sampled, and is shared
+    // with other grammars that have the same rules
+    mutable std::shared_ptr<llama_grammar_masks> masks;
 };
 
 //
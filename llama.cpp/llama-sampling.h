@@ -4,6 +4,8 @@
 
 #include "llama-impl.h"
 
+#include <atomic>
+
 struct llama_sampling {
     llama_sampling(int32_t n_vocab) : n_vocab(n_vocab) {}
 
@@ -11,8 +13,9 @@ struct llama_sampling {
 
     int32_t n_vocab = 0;
 
-    mutable int64_t t_sample_us = 0;
-    mutable int32_t n_sample = 0;
+    // [jart] atomic since slots of the server sample concurrently
+    mutable std::atomic<int64_t> t_sample_us{0};
+    mutable std::atomic<int32_t> n_sample{0};
 
     void reset_timings() const {
         t_sample_us = 0;
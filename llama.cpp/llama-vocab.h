@@ -8,6 +8,10 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <memory>
+
+struct llama_token_trie;
+struct llama_grammar_mask_cache;
 
 struct llama_vocab {
     using id    = llama_token;
@@ -61,6 +65,12 @@ struct llama_vocab {
 
     std::vector<char> precompiled_charsmap;
 
+    // built by the grammar sampler the first time it's needed
+    mutable std::shared_ptr<const llama_token_trie> grammar_trie;
+
+    // token masks of grammars recently sampled with this vocabulary
+    mutable std::shared_ptr<llama_grammar_mask_cache> grammar_masks;
+
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
 };
 
@@ -4,6 +4,7 @@
 #include "llamafile/log.h"
 #include "llamafile/latency.h"
 #include "llamafile/debug.h"
+#include "llamafile/llamafile.h"
 
 #include "llama-impl.h"
 #include "llama-vocab.h"
@@ -69,6 +70,7 @@
 // bump if necessary
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 160  // DeepSeekV2
+#define LLAMA_MAX_CPUS    512  // [jart] most threads a graph may use
 
 //
 // helpers
@@ -3713,6 +3715,12 @@ struct llama_model_loader {
             use_mmap = false;
         }
 
+        // [jart] pages of a mapped file live wherever they were faulted in
+        if (use_mmap && ggml_numa_interleaved()) {
+            LLAMA_LOG_INFO("%s: not using mmap so weights can be interleaved across numa nodes\n", __func__);
+            use_mmap = false;
+        }
+
         this->use_mmap = use_mmap;
         this->check_tensors = check_tensors;
     }
@@ -7866,6 +7874,17 @@ static bool llm_load_tensors(
         }
     }
 
+    // [jart] place rows of weights on the numa nodes that'll read them
+    if (ggml_numa_interleaved()) {
+        std::vector<ggml_tensor *> weights;
+        for (auto & it : model.tensors_by_name) {
+            if (it.second->buffer && ggml_backend_buffer_is_host(it.second->buffer)) {
+                weights.push_back(it.second);
+            }
+        }
+        ggml_numa_place(weights.data(), weights.size());
+    }
+
     // load tensor data
     for (auto & it : ctx_bufs) {
         ggml_context * ctx = it.first;
@@ -15362,12 +15381,15 @@ static void llama_graph_compute(
                   int   n_threads) {
 
     // [jart] resource management
-    n_threads = g_core_manager.acquire(1, n_threads);
-    static ThreadLocal<void> cleanup(
-      [](void* n_threads) {
-          g_core_manager.release((intptr_t)n_threads);
+    //          cpus[0] holds the count, followed by the cores acquired
+    static thread_local int cpus[LLAMA_MAX_CPUS + 1];
+    n_threads = std::min(n_threads, LLAMA_MAX_CPUS);
+    n_threads = cpus[0] = g_core_manager.acquire(1, n_threads, cpus + 1);
+    static ThreadLocal<int> cleanup(
+      [](int* cpus) {
+          g_core_manager.release(cpus + 1, cpus[0]);
       });
-    cleanup.set((void *)(intptr_t)n_threads);
+    cleanup.set(cpus);
 
 // #ifdef GGML_USE_METAL
     if (ggml_backend_is_metal(lctx.backend_metal)) {
@@ -15378,6 +15400,7 @@ static void llama_graph_compute(
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        ggml_backend_cpu_set_cpus(lctx.backend_cpu, FLAG_pin ? cpus + 1 : nullptr); // [jart]
     }
 #ifdef GGML_USE_BLAS
     if (lctx.backend_blas != nullptr) {
@@ -15388,8 +15411,11 @@ static void llama_graph_compute(
     ggml_backend_sched_graph_compute_async(lctx.sched, gf);
 
     // [jart] resources management
+    if (lctx.backend_cpu != nullptr) {
+        ggml_backend_cpu_set_cpus(lctx.backend_cpu, nullptr);
+    }
     cleanup.set(nullptr);
-    g_core_manager.release((intptr_t)n_threads);
+    g_core_manager.release(cpus + 1, cpus[0]);
 
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
@@ -20175,7 +20201,7 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample),
+        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample.load()),
         /*.n_p_eval =*/ std::max(0, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
     };
@@ -20251,11 +20277,11 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e-3 * ctx->sampling.t_sample_us / ctx->sampling.n_sample);
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
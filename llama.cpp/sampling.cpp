@@ -267,11 +267,163 @@ static void sampler_queue(
     }
 }
 
+static llama_token_data_array llama_sampling_prepare_impl(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  float * logits,
+                  bool apply_grammar,
+                  std::vector<float> * original_logits);
+
+// [jart] top-k candidates can be chosen straight from the raw logits
+//
+// when top-k is the first sampler in the chain, every sampler after it
+// only ever looks at k candidates. so rather than building and sorting
+// llama_token_data for the entire vocabulary, we make a single pass
+// over the logits that only keeps what could still make the top k.
+static bool llama_sampling_can_fuse(
+                  const llama_sampling_params & params,
+                  struct llama_context * ctx_cfg,
+                  int n_vocab) {
+    return params.temp > 0 &&
+           params.mirostat == 0 &&
+           params.top_k > 0 &&
+           params.top_k < n_vocab / 4 &&
+           !ctx_cfg &&
+           !params.samplers_sequence.empty() &&
+           params.samplers_sequence[0] == llama_sampler_type::TOP_K;
+}
+
+// selects k highest logits in descending order
+//
+// logits are compared in blocks against the k-th best value seen so
+// far, which compiles to a few vector instructions per block. blocks
+// that can't contribute anything are skipped without being examined.
+static void llama_sampling_top_k_fused(
+                  const float * logits,
+                  int n_vocab,
+                  int k,
+                  std::vector<llama_token_data> & out) {
+    constexpr int block = 16;
+    const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+    float threshold = -INFINITY;
+    out.clear();
+    out.reserve(4 * k + block);
+    for (int i = 0; i < n_vocab; i += block) {
+        const int n = std::min(block, n_vocab - i);
+        if (n == block) {
+            int any = 0;
+            for (int j = 0; j < block; ++j) {
+                any |= logits[i + j] >= threshold;
+            }
+            if (!any) {
+                continue;
+            }
+        }
+        for (int j = 0; j < n; ++j) {
+            if (logits[i + j] >= threshold) {
+                out.push_back(llama_token_data{i + j, logits[i + j], 0.0f});
+            }
+        }
+        if (out.size() >= 4 * (size_t) k) {
+            std::nth_element(out.begin(), out.begin() + k - 1, out.end(), comp);
+            out.resize(k);
+            threshold = out[k - 1].logit;
+        }
+    }
+    if (out.size() > (size_t) k) {
+        std::nth_element(out.begin(), out.begin() + k - 1, out.end(), comp);
+        out.resize(k);
+    }
+    std::sort(out.begin(), out.end(), comp);
+}
+
+// same as llama_sampling_prepare_impl() except it only returns top k
+//
+// repetition penalties only concern a handful of tokens, so they're
+// applied to the logits directly, and then undone after selection.
+static llama_token_data_array llama_sampling_prepare_fused(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  const int idx,
+                  float * logits,
+                  std::vector<float> * original_logits) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const llama_model * model = llama_get_model(ctx_main);
+    const int n_vocab = llama_n_vocab(model);
+
+    const int32_t penalty_last_n  = params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n;
+    const float   penalty_repeat  = params.penalty_repeat;
+    const float   penalty_freq    = params.penalty_freq;
+    const float   penalty_present = params.penalty_present;
+
+    if (!logits) {
+        logits = llama_get_logits_ith(ctx_main, idx);
+    }
+
+    if (ctx_sampling->grammar != NULL) {
+        *original_logits = {logits, logits + n_vocab};
+    }
+
+    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+        logits[it->first] += it->second;
+    }
+
+    // apply penalties
+    std::vector<std::pair<llama_token, float>> saved;
+    const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : ctx_sampling->prev;
+    const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
+    if (penalty_tokens_used_size && (penalty_repeat != 1.0f || penalty_freq != 0.0f || penalty_present != 0.0f)) {
+        std::vector<llama_token> tokens(penalty_tokens.end() - penalty_tokens_used_size, penalty_tokens.end());
+        std::sort(tokens.begin(), tokens.end());
+        for (size_t i = 0; i < tokens.size();) {
+            const llama_token id = tokens[i];
+            size_t count = 1;
+            while (i + count < tokens.size() && tokens[i + count] == id) {
+                ++count;
+            }
+            i += count;
+            if (id < 0 || id >= n_vocab) {
+                continue;
+            }
+            saved.emplace_back(id, logits[id]);
+            if (logits[id] <= 0) {
+                logits[id] *= penalty_repeat;
+            } else {
+                logits[id] /= penalty_repeat;
+            }
+            logits[id] -= float(count) * penalty_freq + penalty_present;
+        }
+        if (!params.penalize_nl) {
+            const llama_token nl = llama_token_nl(model);
+            for (const auto & s : saved) {
+                if (s.first == nl) {
+                    logits[nl] = s.second;
+                }
+            }
+        }
+    }
+
+    const int k = std::min(std::max(params.top_k, std::max(1, params.min_keep)), n_vocab);
+    llama_sampling_top_k_fused(logits, n_vocab, k, ctx_sampling->cur);
+
+    for (const auto & s : saved) {
+        logits[s.first] = s.second;
+    }
+
+    return { ctx_sampling->cur.data(), ctx_sampling->cur.size(), true };
+}
+
 static llama_token llama_sampling_sample_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx,
+                  float * logits,
                   bool is_resampling) {
     const llama_sampling_params & params = ctx_sampling->params;
 
@@ -281,7 +433,12 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_eta    = params.mirostat_eta;
 
     std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
+    llama_token_data_array cur_p;
+    if (!is_resampling && llama_sampling_can_fuse(params, ctx_cfg, llama_n_vocab(llama_get_model(ctx_main)))) {
+        cur_p = llama_sampling_prepare_fused(ctx_sampling, ctx_main, idx, logits, &original_logits);
+    } else {
+        cur_p = llama_sampling_prepare_impl(ctx_sampling, ctx_main, ctx_cfg, idx, logits, /* apply_grammar= */ is_resampling, &original_logits);
+    }
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         GGML_ASSERT(!original_logits.empty());
     }
@@ -327,7 +484,9 @@ static llama_token llama_sampling_sample_impl(
 
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         // Get a pointer to the logits
-        float * logits = llama_get_logits_ith(ctx_main, idx);
+        if (!logits) {
+            logits = llama_get_logits_ith(ctx_main, idx);
+        }
 
         // Create an array with a single token data element for the sampled id
         llama_token_data single_token_data = {id, logits[id], 0.0f};
@@ -346,7 +505,7 @@ static llama_token llama_sampling_sample_impl(
             // Restore logits from the copy
             std::copy(original_logits.begin(), original_logits.end(), logits);
 
-            return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ true);
+            return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, logits, /* is_resampling= */ true);
         }
     }
 
@@ -360,6 +519,7 @@ static llama_token_data_array llama_sampling_prepare_impl(
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx,
+                  float * logits,
                   bool apply_grammar,
                   std::vector<float> * original_logits) {
     const llama_sampling_params & params = ctx_sampling->params;
@@ -377,7 +537,9 @@ static llama_token_data_array llama_sampling_prepare_impl(
     auto & cur  = ctx_sampling->cur;
 
     // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    if (!logits) {
+        logits = llama_get_logits_ith(ctx_main, idx);
+    }
 
     if (ctx_sampling->grammar != NULL && !apply_grammar) {
         GGML_ASSERT(original_logits != NULL);
@@ -437,7 +599,15 @@ llama_token llama_sampling_sample(
                   struct llama_context * ctx_cfg,
                   const int idx) {
     // Call the implementation function with is_resampling set to false by default
-    return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ false);
+    return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, nullptr, /* is_resampling= */ false);
+}
+
+// [jart] samples from logits the caller saved, e.g. after a batched decode
+llama_token llama_sampling_sample_logits(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  float * logits) {
+    return llama_sampling_sample_impl(ctx_sampling, ctx_main, nullptr, 0, logits, /* is_resampling= */ false);
 }
 
 llama_token_data_array llama_sampling_prepare(
@@ -447,7 +617,7 @@ llama_token_data_array llama_sampling_prepare(
                   const int idx,
                   bool apply_grammar,
                   std::vector<float> * original_logits) {
-    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, apply_grammar, original_logits);
+    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, nullptr, apply_grammar, original_logits);
 }
 
 void llama_sampling_accept(
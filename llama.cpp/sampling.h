@@ -144,6 +144,15 @@ llama_token llama_sampling_sample(
         struct llama_context * ctx_cfg,
         int idx = -1);
 
+// [jart] same as llama_sampling_sample() except logits are supplied by
+//        the caller, rather than being read from ctx_main, which might
+//        have since been used to decode a batch for other sequences.
+//        the logits array may be modified.
+llama_token llama_sampling_sample_logits(
+        struct llama_sampling_context * ctx_sampling,
+        struct llama_context * ctx_main,
+        float * logits);
+
 // Prepares and adjusts the set of token candidates for sampling based on penalties, biases, and sampling parameters.
 llama_token_data_array llama_sampling_prepare(
         struct llama_sampling_context * ctx_sampling,
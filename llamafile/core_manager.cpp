@@ -17,17 +17,179 @@
 
 #include "core_manager.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <cosmo.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "llama.cpp/cores.h"
+#include "llamafile.h"
 
 CoreManager g_core_manager;
 
+static cpu_set_t g_affinity;
+static bool g_have_affinity;
+
 CoreManager::CoreManager()
     : used_(0),
       total_(cpu_get_num_math()),
       cv_(PTHREAD_COND_INITIALIZER),
       mu_(PTHREAD_MUTEX_INITIALIZER) {
+    g_have_affinity = !pthread_getaffinity_np(pthread_self(), sizeof(g_affinity), &g_affinity);
+}
+
+static int read_int(const char *path) {
+    FILE *f;
+    int x = -1;
+    if ((f = fopen(path, "r"))) {
+        if (fscanf(f, "%d", &x) != 1)
+            x = -1;
+        fclose(f);
+    }
+    return x;
+}
+
+// parses a sysfs cpu list like "0-3,8" into set
+static bool read_cpu_list(const char *path, cpu_set_t *set) {
+    FILE *f;
+    char list[1024];
+    CPU_ZERO(set);
+    if (!(f = fopen(path, "r")))
+        return false;
+    if (!fgets(list, sizeof(list), f))
+        *list = 0;
+    fclose(f);
+    for (char *p = list; *p;) {
+        char *e;
+        int lo = strtol(p, &e, 10);
+        if (e == p)
+            break;
+        int hi = lo;
+        if (*e == '-')
+            hi = strtol(e + 1, &e, 10);
+        for (int c = lo; c <= hi && c < CPU_SETSIZE; ++c)
+            CPU_SET(c, set);
+        p = *e == ',' ? e + 1 : e;
+    }
+    return true;
+}
+
+// returns lowest sibling of cpu we're allowed to run on
+static int first_sibling(int cpu) {
+    char path[128];
+    cpu_set_t siblings;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+             cpu);
+    if (!read_cpu_list(path, &siblings))
+        return cpu;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &siblings) && CPU_ISSET(c, &g_affinity))
+            return c;
+    return cpu;
+}
+
+static int numa_node(int cpu) {
+    DIR *d;
+    int node = 0;
+    char path[128];
+    struct dirent *e;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((d = opendir(path))) {
+        while ((e = readdir(d)))
+            if (!strncmp(e->d_name, "node", 4) && '0' <= e->d_name[4] && e->d_name[4] <= '9') {
+                node = atoi(e->d_name + 4);
+                break;
+            }
+        closedir(d);
+    }
+    return node;
+}
+
+// builds list of cores, with hyperthreads removed
+//
+// cores are sorted so each cache domain is a contiguous range, and the
+// domains of each numa node are next to each other. if the topology of
+// the system can't be determined, cores won't be pinned.
+void CoreManager::discover() {
+    char path[128];
+    if (IsLinux() && g_have_affinity) {
+        // linux lists the efficiency cores of hybrid intel chips here
+        cpu_set_t atoms;
+        read_cpu_list("/sys/devices/cpu_atom/cpus", &atoms);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &g_affinity))
+                continue;
+            if (CPU_ISSET(cpu, &atoms))
+                continue;
+            if (first_sibling(cpu) != cpu)
+                continue;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+            int domain = read_int(path);
+            if (domain == -1) {
+                snprintf(path, sizeof(path),
+                         "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+                domain = read_int(path);
+            }
+            cores_.push_back({cpu, domain, numa_node(cpu), false});
+        }
+        std::sort(cores_.begin(), cores_.end(), [](const Core &a, const Core &b) {
+            if (a.node != b.node)
+                return a.node < b.node;
+            if (a.domain != b.domain)
+                return a.domain < b.domain;
+            return a.cpu < b.cpu;
+        });
+    }
+    if (cores_.empty()) {
+        for (int i = 0; i < total_; ++i)
+            cores_.push_back({-1, 0, 0, false});
+    } else if ((int)cores_.size() > total_) {
+        // keep the first total_ cores, which only happens if sysfs
+        // disagrees with the cpuid based count of cpu_get_num_math()
+        cores_.resize(total_);
+    } else {
+        total_ = cores_.size();
+    }
+}
+
+// returns index of free core closest to home
+//
+// when there's no home, the first free core of the cache domain with
+// the most cores free is chosen, so concurrent callers spread out. the
+// caller must hold mu_ and ensure used_ < total_.
+int CoreManager::pick(int domain, int node) {
+    int best = -1;
+    int best_score = -1;
+    for (int i = 0, n = cores_.size(); i < n;) {
+        int j = i;
+        int free = 0;
+        int first = -1;
+        for (; j < n && cores_[j].node == cores_[i].node && cores_[j].domain == cores_[i].domain;
+             ++j)
+            if (!cores_[j].used) {
+                if (first == -1)
+                    first = j;
+                ++free;
+            }
+        if (first != -1) {
+            int score = free;
+            if (cores_[i].node == node)
+                score += n;
+            if (cores_[i].domain == domain && cores_[i].node == node)
+                score += n * 2;
+            if (score > best_score) {
+                best_score = score;
+                best = first;
+            }
+        }
+        i = j;
+    }
+    npassert(best != -1);
+    return best;
 }
 
 static void unlock_mutex(void *arg) {
@@ -35,17 +197,30 @@ static void unlock_mutex(void *arg) {
     pthread_mutex_unlock(mu);
 }
 
-int CoreManager::acquire(int need, int greed) {
+// acquires between need and greed cores
+//
+// the cpu number of each core is stored to cpus, which may be -1 if it
+// shouldn't be pinned. the first core is the home of the set, and the
+// rest are taken from its cache domain first, then its numa node.
+int CoreManager::acquire(int need, int greed, int *cpus) {
     npassert(need >= 1);
     npassert(greed >= need);
 
     int got = 0;
+    int domain = -1;
+    int node = -1;
 
     while (got < need) {
         pthread_mutex_lock(&mu_);
         pthread_cleanup_push(unlock_mutex, &mu_);
+        if (cores_.empty())
+            discover();
         if (used_ < total_) {
-            ++got;
+            int i = pick(domain, node);
+            cores_[i].used = true;
+            cpus[got++] = cores_[i].cpu;
+            domain = cores_[i].domain;
+            node = cores_[i].node;
             ++used_;
         } else {
             pthread_cond_wait(&cv_, &mu_);
@@ -54,11 +229,12 @@ int CoreManager::acquire(int need, int greed) {
     }
 
     while (got < greed) {
-        errno_t err;
         if (pthread_mutex_trylock(&mu_))
             break;
         if (used_ < total_) {
-            ++got;
+            int i = pick(domain, node);
+            cores_[i].used = true;
+            cpus[got++] = cores_[i].cpu;
             ++used_;
         } else {
             greed = got;
@@ -69,16 +245,38 @@ int CoreManager::acquire(int need, int greed) {
     return got;
 }
 
-void CoreManager::release(int count) {
-    bool ok;
+void CoreManager::release(const int *cpus, int count) {
+    bool ok = true;
     pthread_mutex_lock(&mu_);
-    if ((used_ -= count) >= 0) {
-        ok = true;
-    } else {
-        ok = false;
-        used_ = 0;
+    for (int i = 0; i < count; ++i) {
+        auto it = std::find_if(cores_.begin(), cores_.end(),
+                               [&](const Core &c) { return c.used && c.cpu == cpus[i]; });
+        if (it != cores_.end()) {
+            it->used = false;
+            --used_;
+        } else {
+            ok = false;
+        }
     }
-    pthread_cond_signal(&cv_);
+    pthread_cond_broadcast(&cv_);
     pthread_mutex_unlock(&mu_);
     npassert(ok);
 }
+
+// pins calling thread to cpu, or -1 to restore original affinity
+void llamafile_pin_thread(int cpu) {
+    static thread_local int g_pinned = -1;
+    if (cpu == g_pinned)
+        return;
+    if (cpu >= 0) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        if (!pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+            g_pinned = cpu;
+    } else {
+        if (g_have_affinity)
+            pthread_setaffinity_np(pthread_self(), sizeof(g_affinity), &g_affinity);
+        g_pinned = -1;
+    }
+}
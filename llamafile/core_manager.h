@@ -17,16 +17,32 @@
 
 #pragma once
 #include <pthread.h>
+#include <vector>
 
+// hands out cpu cores to threads that do math
+//
+// cores are grouped by the last level cache they share, and the numa
+// node they belong to. a caller gets cores from the cache domain that
+// has the most of them free, so that when several graphs are computed
+// at once, each one stays within its own domain when possible.
 class CoreManager {
   public:
     CoreManager();
-    int acquire(int, int);
-    void release(int);
+    int acquire(int, int, int *);
+    void release(const int *, int);
 
   private:
+    struct Core {
+        int cpu; // or -1 if the topology isn't known
+        int domain;
+        int node;
+        bool used;
+    };
+    void discover();
+    int pick(int, int);
     int used_;
     int total_;
+    std::vector<Core> cores_;
     pthread_cond_t cv_;
     pthread_mutex_t mu_;
 };
@@ -35,6 +35,7 @@
 #include "llama.cpp/cores.h"
 #include "llama.cpp/llama.h"
 #include "llamafile/macros.h"
+#include "llamafile/pool.h"
 
 bool FLAGS_READY = false;
 bool FLAG_ascii = false;
@@ -47,6 +48,7 @@ bool FLAG_mmap = true;
 bool FLAG_no_display_prompt = false;
 bool FLAG_nocompile = false;
 bool FLAG_nologo = false;
+bool FLAG_pin = false;
 bool FLAG_precise = false;
 bool FLAG_recompile = false;
 bool FLAG_tinyblas = false;
@@ -57,12 +59,14 @@ const char *FLAG_chat_template = "";
 const char *FLAG_db = nullptr;
 const char *FLAG_db_startup_sql = "PRAGMA journal_mode=WAL;"
                                   "PRAGMA synchronous=NORMAL;";
+const char *FLAG_draft_model = nullptr;
 const char *FLAG_file = nullptr;
 const char *FLAG_ip_header = nullptr;
 const char *FLAG_listen = "127.0.0.1:8080";
 const char *FLAG_mmproj = nullptr;
 const char *FLAG_model = nullptr;
 const char *FLAG_prompt = nullptr;
+const char *FLAG_slot_cache = nullptr;
 const char *FLAG_url_prefix = "";
 const char *FLAG_www_root = "/zip/www";
 double FLAG_token_rate = 1;
@@ -73,20 +77,33 @@ float FLAG_reserve_tokens = .15;
 float FLAG_temperature = .8;
 float FLAG_top_p = .95;
 int FLAG_batch = 256;
+int FLAG_cache_type_k = GGML_TYPE_F16;
+int FLAG_cache_type_v = GGML_TYPE_F16;
 int FLAG_ctx_size = 8192;
 int FLAG_decay_delay = 60 * 5;
+int FLAG_draft = 5;
 int FLAG_flash_attn = false;
 int FLAG_gpu = 0;
 int FLAG_http_ibuf_size = 5 * 1024 * 1024;
 int FLAG_http_obuf_size = 1024 * 1024;
+int FLAG_idle_buffer = 256;
+int FLAG_idle_timeout = 60;
+int FLAG_image_cache = 256;
 int FLAG_keepalive = 5;
 int FLAG_main_gpu = 0;
 int FLAG_n_gpu_layers = -1;
+int FLAG_numa = GGML_NUMA_STRATEGY_DISABLED;
+int FLAG_poll = POOL_POLL_DEFAULT;
+int FLAG_prefill_budget = 64;
+int FLAG_prefix_cache = 0;
+int FLAG_queue_timeout = 0;
+int FLAG_slot_cache_size = 4096;
 int FLAG_slots = 1;
 int FLAG_split_mode = LLAMA_SPLIT_MODE_LAYER;
 int FLAG_threads = MIN(cpu_get_num_math(), 20);
 int FLAG_threads_batch = cpu_get_num_math();
 int FLAG_token_burst = 100;
+int FLAG_token_cache = 64;
 int FLAG_token_cidr = 24;
 int FLAG_ubatch = 512;
 int FLAG_verbose = 0;
@@ -132,6 +149,16 @@ static wontreturn void unknown(const char *flag) {
     exit(1);
 }
 
+static int parse_cache_type(const char *flag, const char *s) {
+    if (!strcmp(s, "f16"))
+        return GGML_TYPE_F16;
+    if (!strcmp(s, "q8_0"))
+        return GGML_TYPE_Q8_0;
+    if (!strcmp(s, "q4_0"))
+        return GGML_TYPE_Q4_0;
+    bad(flag);
+}
+
 static bool is_valid_chat_template(const char *tmpl) {
     llama_chat_message chat[] = {{"user", "test"}};
     return llama_chat_apply_template(nullptr, tmpl, chat, 1, true, nullptr, 0) >= 0;
@@ -300,6 +327,15 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--queue-timeout")) {
+            if (i == argc)
+                missing("--queue-timeout");
+            FLAG_queue_timeout = atoi(argv[i++]);
+            if (FLAG_queue_timeout < 0)
+                error("--queue-timeout must be non-negative");
+            continue;
+        }
+
         //////////////////////////////////////////////////////////////////////
         // http server flags
 
@@ -346,6 +382,24 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--idle-timeout")) {
+            if (i == argc)
+                missing("--idle-timeout");
+            FLAG_idle_timeout = atoi(argv[i++]);
+            if (FLAG_idle_timeout < 0)
+                error("--idle-timeout SECONDS must be non-negative");
+            continue;
+        }
+
+        if (!strcmp(flag, "--idle-buffer")) {
+            if (i == argc)
+                missing("--idle-buffer");
+            FLAG_idle_buffer = atoi(argv[i++]);
+            if (FLAG_idle_buffer < 0)
+                error("--idle-buffer MEGABYTES must be non-negative");
+            continue;
+        }
+
         //////////////////////////////////////////////////////////////////////
         // sampling flags
 
@@ -421,6 +475,23 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "-md") || !strcmp(flag, "--draft-model")) {
+            if (i == argc)
+                missing("--draft-model");
+            FLAG_draft_model = argv[i++];
+            continue;
+        }
+
+        if (!strcmp(flag, "--draft")) {
+            if (i == argc)
+                missing("--draft");
+            int n = atoi(argv[i++]);
+            if (!(1 <= n && n <= 32))
+                error("--draft INT must be between 1 and 32");
+            FLAG_draft = n;
+            continue;
+        }
+
         if (!strcmp(flag, "-f") || !strcmp(flag, "--file")) {
             if (i == argc)
                 missing("--file");
@@ -442,6 +513,16 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--poll")) {
+            if (i == argc)
+                missing("--poll");
+            FLAG_poll = atoi(argv[i++]);
+            if (FLAG_poll < 0)
+                error("--poll MICROS must be non-negative");
+            llamafile_task_poll(FLAG_poll);
+            continue;
+        }
+
         if (!strcmp(flag, "-b") || !strcmp(flag, "--batch-size")) {
             if (i == argc)
                 missing("--batch-size");
@@ -463,6 +544,20 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "-ctk") || !strcmp(flag, "--cache-type-k")) {
+            if (i == argc)
+                missing("--cache-type-k");
+            FLAG_cache_type_k = parse_cache_type("--cache-type-k", argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "-ctv") || !strcmp(flag, "--cache-type-v")) {
+            if (i == argc)
+                missing("--cache-type-v");
+            FLAG_cache_type_v = parse_cache_type("--cache-type-v", argv[i++]);
+            continue;
+        }
+
         if (!strcmp(flag, "--no-warmup")) {
             FLAG_warmup = false;
             continue;
@@ -496,6 +591,54 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--prefill-budget")) {
+            if (i == argc)
+                missing("--prefill-budget");
+            FLAG_prefill_budget = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--prefix-cache")) {
+            if (i == argc)
+                missing("--prefix-cache");
+            FLAG_prefix_cache = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--image-cache")) {
+            if (i == argc)
+                missing("--image-cache");
+            FLAG_image_cache = atoi(argv[i++]);
+            if (FLAG_image_cache < 0)
+                error("--image-cache MEGABYTES must be non-negative");
+            continue;
+        }
+
+        if (!strcmp(flag, "--token-cache")) {
+            if (i == argc)
+                missing("--token-cache");
+            FLAG_token_cache = atoi(argv[i++]);
+            if (FLAG_token_cache < 0)
+                error("--token-cache MEGABYTES must be non-negative");
+            continue;
+        }
+
+        if (!strcmp(flag, "--slot-cache")) {
+            if (i == argc)
+                missing("--slot-cache");
+            FLAG_slot_cache = argv[i++];
+            continue;
+        }
+
+        if (!strcmp(flag, "--slot-cache-size")) {
+            if (i == argc)
+                missing("--slot-cache-size");
+            FLAG_slot_cache_size = atoi(argv[i++]);
+            if (FLAG_slot_cache_size < 0)
+                error("--slot-cache-size MEGABYTES must be non-negative");
+            continue;
+        }
+
         if (!strcmp(flag, "--decay-delay")) {
             if (i == argc)
                 missing("--decay-delay");
@@ -535,6 +678,28 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--pin")) {
+            FLAG_pin = true;
+            continue;
+        }
+
+        if (!strcmp(flag, "--numa")) {
+            if (i == argc)
+                missing("--numa");
+            const char *value = argv[i++];
+            if (!strcmp(value, "distribute"))
+                FLAG_numa = GGML_NUMA_STRATEGY_DISTRIBUTE;
+            else if (!strcmp(value, "isolate"))
+                FLAG_numa = GGML_NUMA_STRATEGY_ISOLATE;
+            else if (!strcmp(value, "numactl"))
+                FLAG_numa = GGML_NUMA_STRATEGY_NUMACTL;
+            else if (!strcmp(value, "interleave"))
+                FLAG_numa = GGML_NUMA_STRATEGY_INTERLEAVE;
+            else
+                bad("--numa");
+            continue;
+        }
+
         if (!strcmp(flag, "--precise")) {
             FLAG_precise = true;
             continue;
@@ -643,6 +808,9 @@ void llamafile_get_flags(int argc, char **argv) {
     if (!FLAG_model)
         required("--model");
 
+    if (FLAG_cache_type_v != GGML_TYPE_F16 && !FLAG_flash_attn)
+        error("--cache-type-v needs --flash-attn");
+
     FLAGS_READY = true;
     FLAG_n_gpu_layers = llamafile_gpu_layers(FLAG_n_gpu_layers);
 }
@@ -17,6 +17,7 @@
 
 #include "llama.h"
 #include "llama.cpp/llama.h"
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include <vector>
@@ -44,6 +45,23 @@ std::string llamafile_token_to_piece(const llama_context *ctx, llama_token token
     return piece;
 }
 
+// appends piece to string, reusing its capacity
+void llamafile_token_to_piece(const llama_context *ctx, llama_token token, bool special,
+                              std::string *out) {
+    size_t n = out->size();
+    out->resize(std::max(out->capacity(), n + 16));
+    const int n_chars = llama_token_to_piece(llama_get_model(ctx), token, &(*out)[n],
+                                             out->size() - n, 0, special);
+    if (n_chars < 0) {
+        out->resize(n - n_chars);
+        int check = llama_token_to_piece(llama_get_model(ctx), token, &(*out)[n],
+                                         out->size() - n, 0, special);
+        unassert(check == -n_chars);
+    } else {
+        out->resize(n + n_chars);
+    }
+}
+
 std::vector<llama_token> llamafile_tokenize(const struct llama_model *model,
                                             const std::string_view &text, bool add_special,
                                             bool parse_special) {
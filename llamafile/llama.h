@@ -43,4 +43,5 @@ struct llama_context;
 int llamafile_token_eot(llama_model *);
 
 std::string llamafile_token_to_piece(const llama_context *, int, bool);
+void llamafile_token_to_piece(const llama_context *, int, bool, std::string *);
 std::vector<int> llamafile_tokenize(const llama_model *, const std::string_view &, bool, bool);
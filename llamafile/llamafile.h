@@ -17,6 +17,7 @@ extern bool FLAG_mmap;
 extern bool FLAG_no_display_prompt;
 extern bool FLAG_nocompile;
 extern bool FLAG_nologo;
+extern bool FLAG_pin;
 extern bool FLAG_precise;
 extern bool FLAG_recompile;
 extern bool FLAG_tinyblas;
@@ -27,12 +28,14 @@ extern bool FLAG_v2;
 extern const char *FLAG_chat_template;
 extern const char *FLAG_db;
 extern const char *FLAG_db_startup_sql;
+extern const char *FLAG_draft_model;
 extern const char *FLAG_file;
 extern const char *FLAG_ip_header;
 extern const char *FLAG_listen;
 extern const char *FLAG_mmproj;
 extern const char *FLAG_model;
 extern const char *FLAG_prompt;
+extern const char *FLAG_slot_cache;
 extern const char *FLAG_url_prefix;
 extern const char *FLAG_www_root;
 extern double FLAG_token_rate;
@@ -43,21 +46,34 @@ extern float FLAG_reserve_tokens;
 extern float FLAG_temperature;
 extern float FLAG_top_p;
 extern int FLAG_batch;
+extern int FLAG_cache_type_k;
+extern int FLAG_cache_type_v;
 extern int FLAG_ctx_size;
 extern int FLAG_decay_delay;
+extern int FLAG_draft;
 extern int FLAG_flash_attn;
 extern int FLAG_gpu;
 extern int FLAG_gpu;
 extern int FLAG_http_ibuf_size;
 extern int FLAG_http_obuf_size;
+extern int FLAG_idle_buffer;
+extern int FLAG_idle_timeout;
+extern int FLAG_image_cache;
 extern int FLAG_keepalive;
 extern int FLAG_main_gpu;
 extern int FLAG_n_gpu_layers;
+extern int FLAG_numa;
+extern int FLAG_poll;
+extern int FLAG_prefill_budget;
+extern int FLAG_prefix_cache;
+extern int FLAG_queue_timeout;
+extern int FLAG_slot_cache_size;
 extern int FLAG_slots;
 extern int FLAG_split_mode;
 extern int FLAG_threads;
 extern int FLAG_threads_batch;
 extern int FLAG_token_burst;
+extern int FLAG_token_cache;
 extern int FLAG_token_cidr;
 extern int FLAG_ubatch;
 extern int FLAG_verbose;
@@ -93,6 +109,7 @@ void llamafile_schlep(const void *, size_t);
 void llamafile_get_app_dir(char *, size_t);
 void llamafile_launch_browser(const char *);
 void llamafile_get_flags(int, char **);
+void llamafile_pin_thread(int);
 
 #define LLAMAFILE_GPU_ERROR -2
 #define LLAMAFILE_GPU_DISABLE -1
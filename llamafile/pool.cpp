@@ -43,12 +43,35 @@ struct llamafile_thread {
     _Atomic(pthread_t) th = -1;
     pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
     pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
-    llamafile_task *task;
+    _Atomic(llamafile_task *) task;
     llamafile_thread *next;
 };
 
 static atomic_int g_active;
 static atomic_uintptr_t g_idle;
+static atomic_int g_poll = POOL_POLL_DEFAULT;
+
+// spins until ready() is true or the polling budget has elapsed
+//
+// ggml computes a graph per token, and the next one usually comes
+// along within a fraction of a millisecond. it's cheaper to burn that
+// time on a core that's already awake than to put the thread to sleep
+// and pay for a futex wake, and the scheduler latency, on every token.
+template <typename F> static bool spin_until(F ready) {
+    int micros = atomic_load_explicit(&g_poll, memory_order_relaxed);
+    if (micros <= 0)
+        return ready();
+    struct timespec deadline = timespec_add(timespec_mono(), timespec_frommicros(micros));
+    for (;;) {
+        for (int i = 0; i < 64; ++i) {
+            if (ready())
+                return true;
+            pthread_pause_np();
+        }
+        if (timespec_cmp(timespec_mono(), deadline) >= 0)
+            return ready();
+    }
+}
 
 #define MASQUE 0x00fffffffffffff0
 #define PTR(x) ((uintptr_t)(x) & MASQUE)
@@ -96,29 +119,33 @@ static void llamafile_thread_canceled(llamafile_thread *thread) {
 }
 
 static void *llamafile_thread_worker(void *arg) {
-    errno_t err;
+    errno_t err = 0;
     llamafile_thread *thread = (llamafile_thread *)arg;
 
     ++g_active;
     g_key.set(thread);
     do {
-        void *res = thread->task->func(thread->task->arg);
+        llamafile_task *task = thread->task;
+        void *res = task->func(task->arg);
         pthread_setcancelstate(PTHREAD_CANCEL_MASKED, 0);
 
         for (;;)
             if (atomic_load_explicit(&thread->th, memory_order_acquire) != -1)
-                if (atomic_load_explicit(&thread->task->th, memory_order_acquire) != -1)
+                if (atomic_load_explicit(&task->th, memory_order_acquire) != -1)
                     break;
 
-        pthread_mutex_lock(&thread->task->mu);
-        thread->task->res = res;
-        atomic_store_explicit(&thread->task->th, 0, memory_order_release);
-        pthread_cond_signal(&thread->task->cv);
-        pthread_mutex_unlock(&thread->task->mu);
+        pthread_mutex_lock(&task->mu);
+        task->res = res;
+        atomic_store_explicit(&task->th, 0, memory_order_release);
+        pthread_cond_signal(&task->cv);
+        pthread_mutex_unlock(&task->mu);
 
-        pthread_mutex_lock(&thread->mu);
-        thread->task = nullptr;
+        atomic_store_explicit(&thread->task, nullptr, memory_order_relaxed);
         idle_push(thread);
+        spin_until([thread] {
+            return atomic_load_explicit(&thread->task, memory_order_acquire) != nullptr;
+        });
+        pthread_mutex_lock(&thread->mu);
         while (!thread->task) {
             err = pthread_cond_wait(&thread->cv, &thread->mu);
             if (err == ECANCELED)
@@ -190,6 +217,7 @@ static void unlock_mutex(void *arg) {
 }
 
 errno_t llamafile_task_join(llamafile_task *task, void **out_res) {
+    spin_until([task] { return !atomic_load_explicit(&task->th, memory_order_acquire); });
     pthread_cleanup_push(unlock_mutex, &task->mu);
     pthread_mutex_lock(&task->mu);
     while (atomic_load_explicit(&task->th, memory_order_acquire))
@@ -212,6 +240,10 @@ errno_t llamafile_task_cancel(llamafile_task *task) {
     return err;
 }
 
+void llamafile_task_poll(int micros) {
+    atomic_store_explicit(&g_poll, micros, memory_order_relaxed);
+}
+
 void llamafile_task_shutdown(void) {
     pthread_t th;
     int backoff = 0;
@@ -1,4 +1,8 @@
 #pragma once
+
+// microseconds that idle workers and joiners spin before sleeping
+#define POOL_POLL_DEFAULT 200
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,6 +13,7 @@ errno_t llamafile_task_create(llamafile_task_t *, void *(*)(void *), void *);
 errno_t llamafile_task_join(llamafile_task_t, void **);
 errno_t llamafile_task_cancel(llamafile_task_t);
 void llamafile_task_shutdown(void);
+void llamafile_task_poll(int);
 
 #ifdef __cplusplus
 }
@@ -32,11 +32,27 @@ $(LLAMAFILE_SERVER_ASSETS:%=o/$(MODE)/%.zip.o): private ZIPOBJ_FLAGS += -C2
 
 $(LLAMAFILE_SERVER_OBJS): llamafile/server/BUILD.mk
 
+o/$(MODE)/llamafile/server/assets_test:						\
+		o/$(MODE)/llamafile/server/assets_test.o			\
+		o/$(MODE)/llamafile/server/assets.o				\
+		o/$(MODE)/llamafile/server/log.o				\
+		o/$(MODE)/llama.cpp/llama.cpp.a					\
+
 o/$(MODE)/llamafile/server/atom_test:						\
 		o/$(MODE)/llamafile/server/atom_test.o				\
 		o/$(MODE)/llamafile/server/atom.o				\
 		o/$(MODE)/llamafile/server/image.o				\
 
+o/$(MODE)/llamafile/server/event_test:						\
+		o/$(MODE)/llamafile/server/event_test.o				\
+		o/$(MODE)/llamafile/server/event.o				\
+		o/$(MODE)/llamafile/server/fastjson.o				\
+		o/$(MODE)/double-conversion/double-conversion.a			\
+
+o/$(MODE)/llamafile/server/histogram_test:					\
+		o/$(MODE)/llamafile/server/histogram_test.o			\
+		o/$(MODE)/llamafile/server/histogram.o				\
+
 o/$(MODE)/llamafile/server/image_test:						\
 		o/$(MODE)/llamafile/server/image_test.o				\
 		o/$(MODE)/llamafile/server/image.o				\
@@ -46,6 +62,25 @@ o/$(MODE)/llamafile/server/fastjson_test:					\
 		o/$(MODE)/llamafile/server/fastjson.o				\
 		o/$(MODE)/double-conversion/double-conversion.a			\
 
+o/$(MODE)/llamafile/server/image_cache_test:					\
+		o/$(MODE)/llamafile/server/image_cache_test.o			\
+		o/$(MODE)/llamafile/server/image_cache.o			\
+		o/$(MODE)/llamafile/server/image.o				\
+
+o/$(MODE)/llamafile/server/json_view_test:					\
+		o/$(MODE)/llamafile/server/json_view_test.o			\
+		o/$(MODE)/llamafile/server/json_view.o				\
+
+o/$(MODE)/llamafile/server/prefix_cache_test:					\
+		o/$(MODE)/llamafile/server/prefix_cache_test.o			\
+		o/$(MODE)/llamafile/server/prefix_cache.o			\
+		o/$(MODE)/llamafile/server/atom.o				\
+		o/$(MODE)/llamafile/server/image.o				\
+
+o/$(MODE)/llamafile/server/token_cache_test:					\
+		o/$(MODE)/llamafile/server/token_cache_test.o			\
+		o/$(MODE)/llamafile/server/token_cache.o			\
+
 o/$(MODE)/llamafile/server/tokenbucket_test:					\
 		o/$(MODE)/llamafile/server/tokenbucket_test.o			\
 		o/$(MODE)/llamafile/server/tokenbucket.o			\
@@ -55,7 +90,14 @@ o/$(MODE)/llamafile/server/tokenbucket_test:					\
 .PHONY: o/$(MODE)/llamafile/server
 o/$(MODE)/llamafile/server:							\
 		o/$(MODE)/llamafile/server/main					\
+		o/$(MODE)/llamafile/server/assets_test.runs			\
 		o/$(MODE)/llamafile/server/atom_test.runs			\
+		o/$(MODE)/llamafile/server/event_test.runs			\
 		o/$(MODE)/llamafile/server/fastjson_test.runs			\
+		o/$(MODE)/llamafile/server/histogram_test.runs			\
+		o/$(MODE)/llamafile/server/image_cache_test.runs		\
 		o/$(MODE)/llamafile/server/image_test.runs			\
+		o/$(MODE)/llamafile/server/json_view_test.runs			\
+		o/$(MODE)/llamafile/server/prefix_cache_test.runs		\
+		o/$(MODE)/llamafile/server/token_cache_test.runs		\
 		o/$(MODE)/llamafile/server/tokenbucket_test.runs		\
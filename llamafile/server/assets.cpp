@@ -0,0 +1,181 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "assets.h"
+#include "llamafile/server/log.h"
+#include <cstdio>
+#include <pthread.h>
+#include <third_party/zlib/zlib.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// maximum number of bytes held by the asset cache
+#define MAX_CACHE_BYTES (64 * 1024 * 1024)
+
+namespace lf {
+namespace server {
+
+static size_t g_bytes;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<std::string, std::shared_ptr<const Asset>> g_assets;
+
+static bool
+is_immutable(const std::string& path)
+{
+    return path.starts_with("/zip/");
+}
+
+static bool
+is_same_file(const Asset& asset, const struct stat& st)
+{
+    return st.st_size == asset.content.size() &&
+           st.st_mtim.tv_sec == asset.mtim.tv_sec &&
+           st.st_mtim.tv_nsec == asset.mtim.tv_nsec;
+}
+
+static void
+gzip(const std::string& s, std::string* out)
+{
+    z_stream zs = {};
+    if (deflateInit2(&zs,
+                     Z_BEST_COMPRESSION,
+                     Z_DEFLATED,
+                     MAX_WBITS + 16,
+                     MAX_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+    out->resize(deflateBound(&zs, s.size()) + 32);
+    zs.next_in = (Bytef*)s.data();
+    zs.avail_in = s.size();
+    zs.next_out = (Bytef*)out->data();
+    zs.avail_out = out->size();
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        out->resize(zs.total_out);
+    } else {
+        out->clear();
+    }
+    deflateEnd(&zs);
+}
+
+static std::string
+make_content_etag(const std::string& s)
+{
+    char buf[40];
+    unsigned crc = crc32(0, (const Bytef*)s.data(), s.size());
+    snprintf(buf, sizeof(buf), "\"%zx-%08x\"", s.size(), crc);
+    return buf;
+}
+
+// returns etag for file that's too big to cache
+std::string
+make_etag(const struct stat& st)
+{
+    char buf[64];
+    snprintf(buf,
+             sizeof(buf),
+             "\"%jx-%jx%09ld\"",
+             (intmax_t)st.st_size,
+             (intmax_t)st.st_mtim.tv_sec,
+             st.st_mtim.tv_nsec);
+    return buf;
+}
+
+void
+assets_destroy()
+{
+    pthread_mutex_lock(&g_lock);
+    g_assets.clear();
+    g_bytes = 0;
+    pthread_mutex_unlock(&g_lock);
+}
+
+// returns cached asset for key, or null if it isn't cached
+//
+// files under /zip/ can't change while we're running, so they're only
+// ever read once. files on disk need a stat() to check if they're
+// still the same.
+std::shared_ptr<const Asset>
+assets_lookup(const std::string& key)
+{
+    std::shared_ptr<const Asset> asset;
+    pthread_mutex_lock(&g_lock);
+    auto it = g_assets.find(key);
+    if (it != g_assets.end())
+        asset = it->second;
+    pthread_mutex_unlock(&g_lock);
+    if (!asset || is_immutable(asset->path))
+        return asset;
+    struct stat st;
+    if (stat(asset->path.c_str(), &st) || !is_same_file(*asset, st))
+        return nullptr;
+    return asset;
+}
+
+// reads file into memory and caches it under key
+//
+// the asset is returned even if the cache is too full to hold it. it
+// is compressed ahead of time, so requests that accept gzip can have
+// it without costing us any cpu. returns null on error.
+std::shared_ptr<const Asset>
+assets_insert(const std::string& key,
+              const std::string& path,
+              int fd,
+              const struct stat& st,
+              const char* content_type)
+{
+    auto asset = std::make_shared<Asset>();
+    asset->path = path;
+    asset->mtim = st.st_mtim;
+    asset->content_type = content_type;
+    asset->content.resize(st.st_size);
+    for (size_t i = 0; i < asset->content.size();) {
+        ssize_t got = pread(
+          fd, asset->content.data() + i, asset->content.size() - i, i);
+        if (got <= 0) {
+            if (got == -1)
+                SLOG("%s: pread failed %m", path.c_str());
+            else
+                SLOG("%s: file shrank while reading", path.c_str());
+            return nullptr;
+        }
+        i += got;
+    }
+    asset->etag = make_content_etag(asset->content);
+    gzip(asset->content, &asset->gzip);
+    if (asset->gzip.size() + asset->gzip.size() / 8 < asset->content.size()) {
+        asset->gzip_etag = asset->etag;
+        asset->gzip_etag.insert(asset->gzip_etag.size() - 1, "-gz");
+    } else {
+        asset->gzip.clear();
+    }
+    size_t bytes = asset->content.size() + asset->gzip.size();
+    pthread_mutex_lock(&g_lock);
+    auto it = g_assets.find(key);
+    if (it != g_assets.end()) {
+        g_bytes -= it->second->content.size() + it->second->gzip.size();
+        g_assets.erase(it);
+    }
+    if (g_bytes + bytes <= MAX_CACHE_BYTES) {
+        g_assets[key] = asset;
+        g_bytes += bytes;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return asset;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,60 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <ctime>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+namespace lf {
+namespace server {
+
+// in-memory copy of a small static file
+//
+// assets are immutable once they're created. if the file changes on
+// disk, a new asset is made, and the old one lives on until whoever
+// is still sending it lets go.
+struct Asset
+{
+    std::string path; // file that was read
+    std::string content;
+    std::string gzip; // empty if compression didn't help
+    std::string etag;
+    std::string gzip_etag;
+    const char* content_type;
+    timespec mtim;
+};
+
+void
+assets_destroy();
+
+std::shared_ptr<const Asset>
+assets_lookup(const std::string&);
+
+std::shared_ptr<const Asset>
+assets_insert(const std::string&,
+              const std::string&,
+              int,
+              const struct stat&,
+              const char*);
+
+std::string
+make_etag(const struct stat&);
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,133 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llamafile/server/assets.h"
+#include <cosmo.h>
+#include <cstdlib>
+#include <fcntl.h>
+#include <third_party/zlib/zlib.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+namespace {
+
+const char* g_path = "/tmp/assets_test.js";
+
+void
+write_file(const std::string& s)
+{
+    int fd = open(g_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        exit(1);
+    if (write(fd, s.data(), s.size()) != s.size())
+        exit(2);
+    close(fd);
+}
+
+std::shared_ptr<const Asset>
+load_file()
+{
+    struct stat st;
+    int fd = open(g_path, O_RDONLY);
+    if (fd == -1)
+        exit(3);
+    if (fstat(fd, &st))
+        exit(4);
+    auto asset = assets_insert("/www/", g_path, fd, st, "text/javascript");
+    close(fd);
+    return asset;
+}
+
+std::string
+gunzip(const std::string& s)
+{
+    std::string res(65536, 0);
+    z_stream zs = {};
+    if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK)
+        exit(5);
+    zs.next_in = (Bytef*)s.data();
+    zs.avail_in = s.size();
+    zs.next_out = (Bytef*)res.data();
+    zs.avail_out = res.size();
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END)
+        exit(6);
+    res.resize(zs.total_out);
+    inflateEnd(&zs);
+    return res;
+}
+
+void
+assets_test()
+{
+    std::string text;
+    for (int i = 0; i < 100; ++i)
+        text += "console.log('hello world');\n";
+    write_file(text);
+
+    if (assets_lookup("/www/"))
+        exit(7);
+    auto a = load_file();
+    if (!a)
+        exit(8);
+    if (a->content != text)
+        exit(9);
+    if (a->gzip.empty() || a->gzip.size() >= text.size())
+        exit(10);
+    if (gunzip(a->gzip) != text)
+        exit(11);
+    if (a->etag.empty() || a->etag == a->gzip_etag)
+        exit(12);
+    if (assets_lookup("/www/") != a)
+        exit(13);
+
+    // files that don't compress well are sent as is
+    write_file("hi");
+    if (assets_lookup("/www/"))
+        exit(14);
+    auto b = load_file();
+    if (b->content != "hi")
+        exit(15);
+    if (!b->gzip.empty() || !b->gzip_etag.empty())
+        exit(16);
+    if (b->etag == a->etag)
+        exit(17);
+    if (assets_lookup("/www/") != b)
+        exit(18);
+
+    // old assets stay valid while they're still being used
+    if (gunzip(a->gzip) != text)
+        exit(19);
+
+    a.reset();
+    b.reset();
+    unlink(g_path);
+    if (assets_lookup("/www/"))
+        exit(20);
+    assets_destroy();
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::assets_test();
+}
@@ -17,11 +17,13 @@
 
 #include "atom.h"
 #include "llama.cpp/base64.h"
+#include "llama.cpp/common.h"
 #include "llamafile/chatbot.h"
 #include "llamafile/datauri.h"
 #include "llamafile/image.h"
 #include "llamafile/llama.h"
 #include "llamafile/server/image.h"
+#include "llamafile/server/token_cache.h"
 #include "llamafile/string.h"
 #include <string>
 #include <vector>
@@ -76,6 +78,63 @@ atomize(const llama_model* model,
     }
 }
 
+// turns rendered chat prompt into atoms, reusing earlier tokenizations
+//
+// if `cache` is null, this is the same as atomize() with special token
+// parsing enabled.
+void
+atomize_chat(const llama_model* model,
+             TokenCache* cache,
+             std::vector<Atom>* result,
+             std::string_view prompt,
+             const std::vector<llama_chat_msg>& messages)
+{
+    if (!cache) {
+        atomize(model, result, prompt, PARSE_SPECIAL);
+        return;
+    }
+    std::vector<std::string_view> contents;
+    for (const llama_chat_msg& message : messages)
+        contents.emplace_back(message.content);
+    std::vector<int> tokens;
+    for (std::string_view chunk : cache->split(prompt, contents)) {
+        if (chunk.find("data:") != std::string_view::npos) {
+            atomize(model, result, chunk, PARSE_SPECIAL);
+            continue;
+        }
+        if (!cache->lookup(chunk, &tokens)) {
+            tokens = llamafile_tokenize(
+              model, chunk, DONT_ADD_SPECIAL, PARSE_SPECIAL);
+            cache->insert(chunk, tokens);
+        }
+        for (int token : tokens)
+            result->emplace_back(token);
+    }
+}
+
+// returns text of control tokens that chat prompts may be split before
+//
+// the tokenizer always turns these into tokens of their own, so text on
+// either side of them gets tokenized independently. tokens that strip
+// adjacent whitespace are left out, since they reach across the split.
+std::vector<std::string>
+get_chat_delimiters(const llama_model* model)
+{
+    std::vector<std::string> res;
+    int n_vocab = llama_n_vocab(model);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        int attr = llama_token_get_attr(model, id);
+        if (!(attr & LLAMA_TOKEN_ATTR_CONTROL))
+            continue;
+        if (attr & (LLAMA_TOKEN_ATTR_LSTRIP | LLAMA_TOKEN_ATTR_RSTRIP))
+            continue;
+        const char* text = llama_token_get_text(model, id);
+        if (text && *text)
+            res.emplace_back(text);
+    }
+    return res;
+}
+
 // having multiple images in the context window is janky right now, so
 // let's erase old images from the chat history until we find out more
 std::vector<Atom>
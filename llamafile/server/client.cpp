@@ -19,9 +19,14 @@
 #include "llama.cpp/llama.h"
 #include "llamafile/flags.h"
 #include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/assets.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/event.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
+#include "llamafile/server/slots.h"
 #include "llamafile/server/time.h"
 #include "llamafile/server/tokenbucket.h"
 #include "llamafile/server/utils.h"
@@ -33,8 +38,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <string>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <time.h>
@@ -46,6 +53,10 @@
     "Referrer-Policy: origin\r\n" \
     "Cache-Control: private; max-age=0\r\n"
 
+// static files bigger than this are sent with sendfile() every time
+// rather than being kept in memory
+#define MAX_ASSET_SIZE (1024 * 1024)
+
 namespace lf {
 namespace server {
 
@@ -73,6 +84,58 @@ on_http_cancel(Client* client)
 
 static ThreadLocal<Client> g_http_cancel(on_http_cancel);
 
+static std::string_view
+trim(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// returns true if etag is listed by an If-None-Match header value
+static bool
+etag_matches(std::string_view list, std::string_view etag)
+{
+    while (!list.empty()) {
+        size_t i = list.find(',');
+        std::string_view tag = trim(list.substr(0, i));
+        list = i == std::string_view::npos ? "" : list.substr(i + 1);
+        if (tag.starts_with("W/"))
+            tag.remove_prefix(2);
+        if (tag == "*" || tag == etag)
+            return true;
+    }
+    return false;
+}
+
+// returns true if an Accept-Encoding header value allows gzip
+static bool
+accepts_gzip(std::string_view list)
+{
+    while (!list.empty()) {
+        size_t i = list.find(',');
+        std::string_view coding = trim(list.substr(0, i));
+        list = i == std::string_view::npos ? "" : list.substr(i + 1);
+        std::string_view params;
+        if ((i = coding.find(';')) != std::string_view::npos) {
+            params = trim(coding.substr(i + 1));
+            coding = trim(coding.substr(0, i));
+        }
+        if (coding == "gzip")
+            return params.empty() || !params.starts_with("q=0") ||
+                   params.find_first_of("123456789") != std::string_view::npos;
+    }
+    return false;
+}
+
+static void
+cleanup_asset(void* arg)
+{
+    delete (std::shared_ptr<const Asset>*)arg;
+}
+
 static const char*
 pick_content_type(const std::string_view& path)
 {
@@ -143,12 +206,24 @@ Client::defer_cleanup(void (*func)(void*), void* arg)
     cleanups_ = clean;
 }
 
+// serves http messages that are sent over the connection
+//
+// if a poller is being used, then this returns once there's no whole
+// message left in the input buffer, and parked_ is set, so the worker
+// can go do something else while the client thinks of what to say.
 void
 Client::run()
 {
-    ibuf_.n = 0;
+    parked_ = false;
     for (;;) {
 
+        // don't wait on client if there's a poller
+        if (worker_->server_->poller_ &&
+            !is_message_ready(ibuf_.p, ibuf_.n, ibuf_.c)) {
+            parked_ = true;
+            break;
+        }
+
         // read headers
         clear();
         if (!read_request())
@@ -240,13 +315,17 @@ Client::transport()
         set_thread_name(name);
     }
 
+    priority_ = PRIORITY_NORMAL;
     if (get_header("X-Priority") == "batch") {
+        priority_ = PRIORITY_BATCH;
         worker_->deprioritize();
-    } else if (!effective_ip_trusted_) {
-        if (tokenbucket_acquire(client_ip_) > FLAG_token_burst) {
-            SLOG("deprioritizing");
-            worker_->deprioritize();
-        }
+    } else if (!effective_ip_trusted_ &&
+               tokenbucket_acquire(client_ip_) > FLAG_token_burst) {
+        SLOG("deprioritizing");
+        priority_ = PRIORITY_BATCH;
+        worker_->deprioritize();
+    } else if (get_header("X-Priority") == "high" && effective_ip_trusted_) {
+        priority_ = PRIORITY_HIGH;
     }
 
     if (msg_.version > 11) {
@@ -323,6 +402,19 @@ Client::send_error(int code, const char* reason)
     return false;
 }
 
+// tells client all slots are busy and it should come back later
+bool
+Client::send_retry_later()
+{
+    SLOG("error 429 Too Many Requests");
+    char* p = append_http_response_message(obuf_.p, 429);
+    p = stpcpy(p, "Retry-After: ");
+    p = FormatInt32(p, MAX(1, FLAG_queue_timeout));
+    p = stpcpy(p, "\r\n");
+    (void)!send_response(obuf_.p, p, "Too Many Requests\r\n");
+    return false;
+}
+
 // appends start of http response message to `p`
 //
 // after this function is called, more header lines may be appended.
@@ -499,6 +591,24 @@ Client::send_response_chunk(const std::string_view content)
     return true;
 }
 
+// sends streaming completion event as chunk of response body
+//
+// the event is rendered into the output buffer, so the per token path
+// doesn't need to serialize json or allocate memory.
+bool
+Client::send_event(const Event& event, std::string_view text, int index)
+{
+    long now = timespec_real().tv_sec;
+    size_t need = event.bound(text.size());
+    if (need > obuf_.c) {
+        std::string s(need, 0);
+        s.resize(event.render(s.data(), text, index, now) - s.data());
+        return send_response_chunk(s);
+    }
+    char* p = event.render(obuf_.p, text, index, now);
+    return send_response_chunk(std::string_view(obuf_.p, p - obuf_.p));
+}
+
 // finishes sending chunked http response body.
 //
 // after this function is called, the handler must return control.
@@ -532,6 +642,25 @@ Client::send_binary(const void* p, size_t n)
     return true;
 }
 
+// returns true if peer has gone away
+//
+// this doesn't consume anything from the socket, so pipelined requests
+// are unaffected. it's cheap enough to call between each decode step.
+// we don't ask for POLLRDHUP, since a client that does shutdown(SHUT_WR)
+// after sending its request still wants the response. a client that's
+// truly gone is noticed once its connection resets, or a write fails.
+bool
+Client::hung_up()
+{
+    struct pollfd pfd = { fd_, 0 };
+    if (poll(&pfd, 1, 0) != 1)
+        return false;
+    if (!(pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+        return false;
+    close_connection_ = true;
+    return true;
+}
+
 // writes non-binary data to socket
 //
 // consider using the higher level methods like send_error(),
@@ -705,6 +834,8 @@ Client::dispatcher()
         return slotz();
     if (p1 == "flagz")
         return flagz();
+    if (p1 == "metrics")
+        return metrics();
 
 #if 0
     // TODO: implement frontend for database
@@ -728,9 +859,14 @@ Client::dispatcher()
 #endif
 
     // serve static endpoints
+    std::string key = resolve(FLAG_www_root, p1);
+    auto asset = new std::shared_ptr<const Asset>(assets_lookup(key));
+    defer_cleanup(cleanup_asset, asset);
+    if (*asset)
+        return send_asset(**asset);
     int infd;
-    size_t size;
-    resolved_ = resolve(FLAG_www_root, p1);
+    struct stat st;
+    resolved_ = key;
     for (;;) {
         infd = open(resolved_.c_str(), O_RDONLY);
         if (infd == -1) {
@@ -745,13 +881,11 @@ Client::dispatcher()
                 return send_error(500);
             }
         }
-        struct stat st;
         if (fstat(infd, &st)) {
             SLOG("%s: %s", strerror(errno), resolved_.c_str());
             ::close(infd);
             return send_error(500);
         }
-        size = st.st_size;
         if (S_ISREG(st.st_mode)) {
             break;
         } else if (S_ISDIR(st.st_mode)) {
@@ -764,42 +898,127 @@ Client::dispatcher()
         }
     }
     defer_cleanup(cleanup_fildes, (void*)(intptr_t)infd);
+    if (st.st_size > MAX_ASSET_SIZE)
+        return send_file(infd, st);
+    *asset = assets_insert(
+      key, resolved_, infd, st, pick_content_type(resolved_));
+    if (!*asset)
+        return send_error(500);
+    return send_asset(**asset);
+}
+
+// sends http 304 response if client already has the etag
+//
+// returns true if a response was sent, in which case ok is set to
+// whether or not sending succeeded.
+bool
+Client::send_not_modified(const std::string_view etag, bool* ok)
+{
+    if (!HasHeader(kHttpIfNoneMatch))
+        return false;
+    if (!etag_matches(std::string_view(HeaderData(kHttpIfNoneMatch),
+                                       HeaderLength(kHttpIfNoneMatch)),
+                      etag))
+        return false;
+    char* p = append_http_response_message(obuf_.p, 304);
+    p = stpcpy(p, "ETag: ");
+    p = (char*)mempcpy(p, etag.data(), etag.size());
+    p = stpcpy(p, "\r\n");
+    p = stpcpy(p, "\r\n");
+    should_send_error_if_canceled_ = false;
+    *ok = send(std::string_view(obuf_.p, p - obuf_.p));
+    return true;
+}
+
+// sends static file from memory
+//
+// the gzip encoding is used if it's available and the client accepts
+// it. if the client already has the asset, then only headers are sent.
+bool
+Client::send_asset(const Asset& asset)
+{
+    bool ok;
+    bool gzip = !asset.gzip.empty() && HasHeader(kHttpAcceptEncoding) &&
+                accepts_gzip(std::string_view(
+                  HeaderData(kHttpAcceptEncoding),
+                  HeaderLength(kHttpAcceptEncoding)));
+    const std::string& etag = gzip ? asset.gzip_etag : asset.etag;
+    if (send_not_modified(etag, &ok))
+        return ok;
+    char* p = append_http_response_message(obuf_.p, 200, "OK");
+    p = stpcpy(p, "Content-Type: ");
+    p = stpcpy(p, asset.content_type);
+    p = stpcpy(p, "\r\n");
+    p = stpcpy(p, "ETag: ");
+    p = stpcpy(p, etag.c_str());
+    p = stpcpy(p, "\r\n");
+    if (!asset.gzip.empty())
+        p = stpcpy(p, "Vary: Accept-Encoding\r\n");
+    if (gzip)
+        p = stpcpy(p, "Content-Encoding: gzip\r\n");
+    if (!send_response(obuf_.p, p, gzip ? asset.gzip : asset.content))
+        return false;
+    if (FLAG_verbose >= 1)
+        SLOG("served %s", asset.path.c_str());
+    return true;
+}
+
+// sends static file that's too big to keep in memory
+//
+// the kernel copies the file straight into the socket if it's able.
+// otherwise, e.g. for /zip/ files, it's copied using the output buffer
+// since the headers have already been sent by then.
+bool
+Client::send_file(int infd, const struct stat& st)
+{
+    bool ok;
+    std::string etag = make_etag(st);
+    if (send_not_modified(etag, &ok))
+        return ok;
     char* p = append_http_response_message(obuf_.p, 200, "OK");
     p = stpcpy(p, "Content-Type: ");
     p = stpcpy(p, pick_content_type(resolved_));
     p = stpcpy(p, "\r\n");
+    p = stpcpy(p, "ETag: ");
+    p = stpcpy(p, etag.c_str());
+    p = stpcpy(p, "\r\n");
     p = stpcpy(p, "Content-Length: ");
-    p = FormatInt64(p, size);
+    p = FormatInt64(p, st.st_size);
     p = stpcpy(p, "\r\n");
     p = stpcpy(p, "\r\n");
     should_send_error_if_canceled_ = false;
     if (!send(std::string_view(obuf_.p, p - obuf_.p)))
         return false;
-    char buf[512];
-    size_t i, chunk;
-    for (i = 0; i < size; i += chunk) {
-        chunk = size - i;
-        if (chunk > sizeof(buf))
-            chunk = sizeof(buf);
-        ssize_t got = pread(infd, buf, chunk, i);
-        if (got == -1) {
-            SLOG("static asset pread failed: %s", strerror(errno));
-            close_connection_ = true;
-            return false;
-        }
-        if (got != chunk) {
-            SLOG("couldn't read full amount reading static asset");
-            close_connection_ = true;
-            return false;
+    off_t off = 0;
+    bool can_sendfile = true;
+    while (off < st.st_size) {
+        ssize_t rc;
+        if (can_sendfile) {
+            rc = sendfile(fd_, infd, &off, st.st_size - off);
+            if (rc == -1 && !off && (errno == EINVAL || errno == ENOSYS)) {
+                can_sendfile = false;
+                continue;
+            }
+        } else {
+            size_t chunk = MIN(obuf_.c, (size_t)(st.st_size - off));
+            rc = pread(infd, obuf_.p, chunk, off);
+            if (rc > 0 && !send_binary(obuf_.p, rc))
+                return false;
+            if (rc > 0)
+                off += rc;
         }
-        if (!send_binary(buf, chunk)) {
+        if (rc <= 0) {
+            if (rc == -1 && errno != EAGAIN && errno != ECONNRESET &&
+                errno != EPIPE)
+                SLOG("static asset send failed: %s", strerror(errno));
+            if (!rc)
+                SLOG("couldn't read full amount reading static asset");
             close_connection_ = true;
             return false;
         }
     }
     if (FLAG_verbose >= 1)
         SLOG("served %s", resolved_.c_str());
-    cleanup();
     return true;
 }
 
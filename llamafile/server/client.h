@@ -25,6 +25,7 @@
 #include <optional>
 #include <string>
 #include <sys/resource.h>
+#include <sys/stat.h>
 
 #define HasHeader(H) (!!msg_.headers[H].a)
 #define HeaderData(H) (ibuf_.p + msg_.headers[H].a)
@@ -39,7 +40,9 @@ struct llama_model;
 namespace lf {
 namespace server {
 
+struct Asset;
 struct Cleanup;
+class Event;
 struct Slot;
 struct Worker;
 struct TokenizeParams;
@@ -55,6 +58,8 @@ struct Client
     bool client_ip_trusted_ = false;
     bool effective_ip_trusted_ = false;
     bool close_connection_ = false;
+    bool parked_ = false;
+    int priority_; // see enum Priority
     bool should_send_error_if_canceled_;
     size_t unread_ = 0;
     Worker* worker_; // borrowed
@@ -86,12 +91,15 @@ struct Client
     bool send_continue() __wur;
     bool send(const std::string_view) __wur;
     bool send_binary(const void*, size_t) __wur;
+    bool hung_up();
     void defer_cleanup(void (*)(void*), void*);
     bool send_error(int, const char* = nullptr);
+    bool send_retry_later();
     char* append_http_response_message(char*, int, const char* = nullptr);
     bool send_response(char*, char*, const std::string_view) __wur;
     bool send_response_start(char*, char*) __wur;
     bool send_response_chunk(const std::string_view) __wur;
+    bool send_event(const Event&, std::string_view, int) __wur;
     bool send_response_finish() __wur;
     bool send2(const std::string_view, const std::string_view) __wur;
     char* append_header(const std::string_view, const std::string_view);
@@ -104,6 +112,9 @@ struct Client
 
     bool dispatch() __wur;
     bool dispatcher() __wur;
+    bool send_asset(const Asset&) __wur;
+    bool send_file(int, const struct stat&) __wur;
+    bool send_not_modified(const std::string_view, bool*) __wur;
 
     bool tokenize() __wur;
     bool get_tokenize_params(TokenizeParams*) __wur;
@@ -121,6 +132,7 @@ struct Client
 
     bool slotz() __wur;
     bool flagz() __wur;
+    bool metrics() __wur;
     bool db_chat(int64_t) __wur;
     bool db_chats() __wur;
     bool db_message(int64_t) __wur;
@@ -19,6 +19,7 @@
 #include "client.h"
 #include "llama.cpp/llama.h"
 #include "llamafile/llamafile.h"
+#include "llamafile/server/json_view.h"
 #include "llamafile/string.h"
 #include <string>
 
@@ -48,9 +49,11 @@ Client::db_chats()
         }
         if (!read_payload())
             return false;
-        auto [status, json] = jt::Json::parse(std::string(payload_));
-        if (status != jt::Json::success)
+        JsonDocument doc;
+        jt::Json::Status status;
+        if ((status = doc.parse(payload_)) != jt::Json::success)
             return send_error(400, jt::Json::StatusToString(status));
+        JsonView json = doc.root();
         if (!json.isObject())
             return send_error(400, "JSON body must be an object");
         if (!json["title"].isString())
@@ -99,9 +102,11 @@ Client::db_chat(int64_t id)
         }
         if (!read_payload())
             return false;
-        auto [status, json] = jt::Json::parse(std::string(payload_));
-        if (status != jt::Json::success)
+        JsonDocument doc;
+        jt::Json::Status status;
+        if ((status = doc.parse(payload_)) != jt::Json::success)
             return send_error(400, jt::Json::StatusToString(status));
+        JsonView json = doc.root();
         if (!json.isObject())
             return send_error(400, "JSON body must be an object");
         if (!json["title"].isString())
@@ -148,9 +153,11 @@ Client::db_messages(int64_t chat_id)
         }
         if (!read_payload())
             return false;
-        auto [status, json] = jt::Json::parse(std::string(payload_));
-        if (status != jt::Json::success)
+        JsonDocument doc;
+        jt::Json::Status status;
+        if ((status = doc.parse(payload_)) != jt::Json::success)
             return send_error(400, jt::Json::StatusToString(status));
+        JsonView json = doc.root();
         if (!json.isObject())
             return send_error(400, "JSON body must be an object");
         if (!json["role"].isString())
@@ -0,0 +1,275 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "embedder.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include <cassert>
+#include <cmath>
+
+// maximum number of embedding contexts that may exist at once
+#define MAX_CONTEXTS 2
+
+// maximum number of tokens that get decoded together
+#define MAX_BATCH 2048
+
+// maximum number of inputs that get decoded together
+#define MAX_SEQS 64
+
+namespace lf {
+namespace server {
+
+struct EmbedWaiter
+{
+    Embedder* embedder;
+    std::vector<Embed>* inputs;
+};
+
+void
+normalize_embeddings(const float* inp, float* out, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += inp[i] * inp[i];
+    sum = sqrt(sum);
+    const float norm = sum > 0 ? 1.f / sum : 0.f;
+    for (int i = 0; i < n; i++)
+        out[i] = inp[i] * norm;
+}
+
+// runs if a client thread is cancelled while it waits for embeddings
+//
+// some other client might be decoding our inputs right now, in which
+// case we need to wait, since it writes to memory we own.
+static void
+abandon_inputs(void* arg)
+{
+    EmbedWaiter* w = (EmbedWaiter*)arg;
+    Embedder* e = w->embedder;
+    for (;;) {
+        bool busy = false;
+        for (Embed& in : *w->inputs)
+            busy |= in.in_flight;
+        if (!busy)
+            break;
+        pthread_cond_wait(&e->cond_, &e->lock_);
+    }
+    for (Embed& in : *w->inputs)
+        if (!in.done)
+            dll_remove(&e->queue_, &in.elem_);
+    pthread_mutex_unlock(&e->lock_);
+}
+
+Embedder::Embedder(llama_model* model) : model_(model)
+{
+    n_embd_ = llama_n_embd(model);
+    n_batch_ = MIN(llama_n_ctx_train(model), MAX_BATCH);
+    n_seq_max_ = MAX_SEQS;
+}
+
+Embedder::~Embedder()
+{
+    for (llama_context* ctx : idle_)
+        llama_free(ctx);
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+llama_context*
+Embedder::create_context(int n_ctx, int n_seq)
+{
+    llama_context_params cparams = {};
+    cparams.embeddings = true;
+    cparams.embeddings_only = true;
+    cparams.logits_all = true;
+    cparams.seed = _rand64();
+    cparams.n_ctx = n_ctx;
+    cparams.n_batch = n_ctx;
+    cparams.n_ubatch = n_ctx;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = MIN(FLAG_threads, 20);
+    cparams.n_threads_batch = FLAG_threads;
+    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
+    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_LAST;
+    cparams.type_k = GGML_TYPE_F16;
+    cparams.type_v = GGML_TYPE_F16;
+    cparams.flash_attn = FLAG_flash_attn;
+    llama_context* ctx = llama_new_context_with_model(model_, cparams);
+    if (!ctx)
+        SLOG("llama_new_context_with_model failed");
+    return ctx;
+}
+
+// decodes many inputs at once, each as its own sequence
+//
+// all of the inputs must fit in a single ubatch, since llama.cpp only
+// keeps the pooled embeddings of the most recent ubatch around.
+void
+Embedder::decode(llama_context* ctx, std::vector<Embed*>& picked)
+{
+    int count = 0;
+    for (Embed* in : picked)
+        count += in->n;
+    llama_batch batch = llama_batch_init(count, 0, 1);
+    for (int s = 0; s < picked.size(); ++s) {
+        for (int i = 0; i < picked[s]->n; ++i) {
+            int j = batch.n_tokens++;
+            batch.token[j] = picked[s]->tokens[i];
+            batch.pos[j] = i;
+            batch.n_seq_id[j] = 1;
+            batch.seq_id[j][0] = s;
+            batch.logits[j] = true;
+        }
+    }
+    llama_kv_cache_clear(ctx);
+    int rc = llama_decode(ctx, batch);
+    if (rc)
+        SLOG("llama_decode failed %d", rc);
+    for (int s = 0; s < picked.size(); ++s) {
+        const float* embd = nullptr;
+        if (!rc && !(embd = llama_get_embeddings_seq(ctx, s)))
+            SLOG("llama_get_embeddings_seq failed");
+        if (embd) {
+            normalize_embeddings(embd, picked[s]->out, n_embd_);
+            picked[s]->rc = 0;
+        } else {
+            picked[s]->rc = -1;
+        }
+    }
+    llama_batch_free(batch);
+}
+
+// decodes input that's too long to share a batch
+int
+Embedder::decode_alone(Embed* in)
+{
+    llama_context* ctx;
+    if (!(ctx = create_context(in->n, 1)))
+        return -1;
+    std::vector<Embed*> picked = { in };
+    decode(ctx, picked);
+    llama_free(ctx);
+    return in->rc;
+}
+
+// computes embeddings of inputs
+//
+// each input needs to have tokens, n, and out initialized. the out
+// pointer must have room for llama_n_embd() floats. returns zero if
+// every embedding was computed successfully.
+int
+Embedder::embed(std::vector<Embed>* inputs)
+{
+    int rc = 0;
+    int cs;
+
+    // inputs that are too big for the pool get their own context
+    for (Embed& in : *inputs) {
+        unassert(in.n > 0);
+        in.rc = 0;
+        in.in_flight = false;
+        in.done = in.n > n_batch_;
+        dll_init(&in.elem_);
+        if (in.done) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+            rc |= decode_alone(&in);
+            pthread_setcancelstate(cs, 0);
+        }
+    }
+
+    // put the rest on the shared queue
+    EmbedWaiter w = { this, inputs };
+    pthread_mutex_lock(&lock_);
+    for (Embed& in : *inputs)
+        if (!in.done)
+            dll_make_last(&queue_, &in.elem_);
+    pthread_cleanup_push(abandon_inputs, &w);
+    for (;;) {
+        bool finished = true;
+        for (Embed& in : *inputs)
+            finished &= in.done;
+        if (finished)
+            break;
+
+        // wait if someone else is already using all the contexts
+        bool pending = false;
+        for (Dll* e = dll_first(queue_); e; e = dll_next(queue_, e))
+            if (!EMBED(e)->in_flight)
+                pending = true;
+        if (!pending || (idle_.empty() && n_contexts_ >= MAX_CONTEXTS)) {
+            pthread_cond_wait(&cond_, &lock_);
+            continue;
+        }
+
+        // become the leader and decode whatever is queued first
+        std::vector<Embed*> picked;
+        int n_tokens = 0;
+        for (Dll* e = dll_first(queue_); e; e = dll_next(queue_, e)) {
+            Embed* in = EMBED(e);
+            if (in->in_flight)
+                continue;
+            if (picked.size() == n_seq_max_)
+                break;
+            if (n_tokens + in->n > n_batch_)
+                break;
+            in->in_flight = true;
+            n_tokens += in->n;
+            picked.push_back(in);
+        }
+        llama_context* ctx = nullptr;
+        if (!idle_.empty()) {
+            ctx = idle_.back();
+            idle_.pop_back();
+        } else {
+            ++n_contexts_;
+        }
+        pthread_mutex_unlock(&lock_);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+        if (!ctx)
+            ctx = create_context(n_batch_, n_seq_max_);
+        if (ctx) {
+            decode(ctx, picked);
+        } else {
+            for (Embed* in : picked)
+                in->rc = -1;
+        }
+        pthread_mutex_lock(&lock_);
+        pthread_setcancelstate(cs, 0);
+        if (ctx) {
+            idle_.push_back(ctx);
+        } else {
+            --n_contexts_;
+        }
+        for (Embed* in : picked) {
+            dll_remove(&queue_, &in->elem_);
+            in->in_flight = false;
+            in->done = true;
+        }
+        pthread_cond_broadcast(&cond_);
+    }
+    pthread_cleanup_pop(false);
+    pthread_mutex_unlock(&lock_);
+    for (Embed& in : *inputs)
+        rc |= in.rc;
+    return rc;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,76 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cosmo.h>
+#include <pthread.h>
+#include <vector>
+
+#define EMBED(e) DLL_CONTAINER(Embed, elem_, e)
+
+struct llama_context;
+struct llama_model;
+
+namespace lf {
+namespace server {
+
+// request to compute the embedding of a single input
+struct Embed
+{
+    Dll elem_;
+    const int* tokens;
+    int n;
+    float* out;
+    int rc = 0;
+    bool done = false;
+    bool in_flight = false;
+};
+
+// computes embeddings using a pool of long-lived contexts
+//
+// inputs from all the http clients that are asking for embeddings at
+// the same time are gathered into a shared queue. whichever client is
+// able to grab an idle context becomes the leader, and packs as many
+// queued inputs as will fit into one multi-sequence llama_batch, no
+// matter whose they are. everyone else waits for the results.
+struct Embedder
+{
+    llama_model* model_;
+    int n_embd_;
+    int n_batch_;
+    int n_seq_max_;
+    int n_contexts_ = 0;
+    std::vector<llama_context*> idle_;
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    Dll* queue_ = nullptr;
+
+    explicit Embedder(llama_model*);
+    ~Embedder();
+    int embed(std::vector<Embed>*);
+
+  private:
+    llama_context* create_context(int, int);
+    int decode_alone(Embed*);
+    void decode(llama_context*, std::vector<Embed*>&);
+};
+
+void
+normalize_embeddings(const float*, float*, int);
+
+} // namespace server
+} // namespace lf
@@ -19,10 +19,13 @@
 #include "llama.cpp/llama.h"
 #include "llamafile/json.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/embedder.h"
 #include "llamafile/server/fastjson.h"
+#include "llamafile/server/json_view.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/server.h"
 #include "llamafile/server/utils.h"
-#include <cmath>
+#include "llamafile/server/worker.h"
 #include <cstring>
 #include <sys/resource.h>
 #include <vector>
@@ -36,43 +39,28 @@ struct EmbeddingParams
 {
     bool add_special;
     bool parse_special;
-    std::string_view prompt;
-    std::string content;
+    bool is_array = false;
+    std::vector<std::string_view> prompts;
+    std::vector<std::string> content;
     std::string model;
 };
 
 void
-normalize_embeddings(const float* inp, float* out, int n)
+cleanup_embedding_params(void* arg)
 {
-    double sum = 0;
-    for (int i = 0; i < n; i++)
-        sum += inp[i] * inp[i];
-    sum = sqrt(sum);
-    const float norm = sum > 0 ? 1.f / sum : 0.f;
-    for (int i = 0; i < n; i++)
-        out[i] = inp[i] * norm;
+    delete (EmbeddingParams*)arg;
 }
 
 static void
-add_token_to_batch(struct llama_batch& batch,
-                   llama_token id,
-                   llama_pos pos,
-                   const std::vector<llama_seq_id>& seq_ids,
-                   bool logits)
+cleanup_embed_vector(void* arg)
 {
-    batch.token[batch.n_tokens] = id;
-    batch.pos[batch.n_tokens] = pos;
-    batch.n_seq_id[batch.n_tokens] = seq_ids.size();
-    for (size_t i = 0; i < seq_ids.size(); ++i)
-        batch.seq_id[batch.n_tokens][i] = seq_ids[i];
-    batch.logits[batch.n_tokens] = logits;
-    batch.n_tokens++;
+    delete (std::vector<Embed>*)arg;
 }
 
-void
-cleanup_embedding_params(void* arg)
+static void
+cleanup_token_vectors(void* arg)
 {
-    delete (EmbeddingParams*)arg;
+    delete (std::vector<std::vector<llama_token>>*)arg;
 }
 
 bool
@@ -98,7 +86,7 @@ Client::get_embedding_params(EmbeddingParams* params)
     if (prompt.has_value()) {
         // [simple mode] if the prompt was supplied in the request-uri
         //               then we don't bother looking for a json body.
-        params->prompt = prompt.value();
+        params->prompts.push_back(prompt.value());
     } else if (HasHeader(kHttpContentType)) {
         // [standard mode] if the prompt wasn't specified as a
         //                 request-uri parameter, then it must be in the
@@ -106,40 +94,71 @@ Client::get_embedding_params(EmbeddingParams* params)
         if (IsMimeType(HeaderData(kHttpContentType),
                        HeaderLength(kHttpContentType),
                        "text/plain")) {
-            params->prompt = payload_;
+            params->prompts.push_back(payload_);
         } else if (IsMimeType(HeaderData(kHttpContentType),
                               HeaderLength(kHttpContentType),
                               "application/json")) {
-            std::pair<Json::Status, Json> json =
-              Json::parse(std::string(payload_));
-            if (json.first != Json::success)
-                return send_error(400, Json::StatusToString(json.first));
-            if (!json.second.isObject())
+            JsonDocument doc;
+            Json::Status status;
+            if ((status = doc.parse(payload_)) != Json::success)
+                return send_error(400, Json::StatusToString(status));
+            JsonView json = doc.root();
+            if (!json.isObject())
                 return send_error(400, "JSON body must be an object");
-            if (json.second["content"].isString())
-                params->content = json.second["content"].getString();
-            else if (json.second["prompt"].isString())
-                params->content = json.second["prompt"].getString();
-            else if (json.second["input"].isString())
-                params->content = json.second["input"].getString();
+            JsonView input;
+            if (json.contains("content"))
+                input = json["content"];
+            else if (json.contains("prompt"))
+                input = json["prompt"];
+            else if (json.contains("input"))
+                input = json["input"];
             else
                 return send_error(400, "JSON missing content/prompt/input key");
-            params->prompt = params->content;
-            if (json.second["add_special"].isBool())
-                params->add_special = json.second["add_special"].getBool();
-            if (json.second["parse_special"].isBool())
-                params->parse_special = json.second["parse_special"].getBool();
-            if (json.second["model"].isString())
-                params->model = json.second["model"].getString();
+            if (input.isString()) {
+                params->content.push_back(input.getString());
+            } else if (input.isArray()) {
+                // openai lets you embed several strings in one request
+                params->is_array = true;
+                for (JsonView item : input) {
+                    if (!item.isString())
+                        return send_error(400, "input array must be strings");
+                    params->content.push_back(item.getString());
+                }
+                if (params->content.empty())
+                    return send_error(400, "input array must not be empty");
+            } else {
+                return send_error(400, "input must be string or array");
+            }
+            for (const std::string& content : params->content)
+                params->prompts.push_back(content);
+            if (json["add_special"].isBool())
+                params->add_special = json["add_special"].getBool();
+            if (json["parse_special"].isBool())
+                params->parse_special = json["parse_special"].getBool();
+            if (json["model"].isString())
+                params->model = json["model"].getString();
         } else {
             return send_error(501, "Content Type Not Implemented");
         }
     } else {
-        params->prompt = payload_;
+        params->prompts.push_back(payload_);
     }
     return true;
 }
 
+static void
+append_embedding(std::string* s, const float* embd, int n)
+{
+    char buf[32];
+    *s += '[';
+    for (int i = 0; i < n; ++i) {
+        if (i)
+            *s += ", ";
+        s->append(buf, encode_json(buf, embd[i]) - buf);
+    }
+    *s += ']';
+}
+
 bool
 Client::embedding()
 {
@@ -161,88 +180,57 @@ Client::embedding()
     timespec started = timespec_real();
 
     // turn text into tokens
-    auto toks = new std::vector<llama_token>(params->prompt.size() + 16);
-    defer_cleanup(cleanup_token_vector, toks);
-    int count = llama_tokenize(model_,
-                               params->prompt.data(),
-                               params->prompt.size(),
-                               &(*toks)[0],
-                               toks->size(),
-                               params->add_special,
-                               params->parse_special);
-    if (count < 0) {
-        SLOG("llama_tokenize failed");
-        return send_error(405);
-    }
-    toks->resize(count);
-
-    if (toks->empty())
-        return send_error(400, "completely empty prompt disallowed");
-
-    // truncate if exceeds model context size
+    //
+    // each prompt is truncated if it exceeds the model context size
     const int n_ctx_train = llama_n_ctx_train(model_);
-    if (count > n_ctx_train)
-        count = n_ctx_train;
-
-    // initialize context
-    llama_context_params cparams = {};
-    cparams.embeddings = true;
-    cparams.embeddings_only = true;
-    cparams.logits_all = true;
-    cparams.seed = _rand64();
-    cparams.n_ctx = count;
-    cparams.n_batch = count;
-    cparams.n_ubatch = count;
-    cparams.n_seq_max = 1;
-    cparams.n_threads = 8;
-    cparams.n_threads_batch = 8;
-    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
-    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
-    cparams.pooling_type = LLAMA_POOLING_TYPE_NONE;
-    cparams.type_k = GGML_TYPE_F16;
-    cparams.type_v = GGML_TYPE_F16;
-    cparams.flash_attn = FLAG_flash_attn;
-    llama_context* ctx = llama_new_context_with_model(model_, cparams);
-    if (!ctx) {
-        SLOG("llama_new_context_with_model failed");
-        return send_error(500);
+    size_t tokens_provided = 0;
+    size_t tokens_used = 0;
+    auto toks = new std::vector<std::vector<llama_token>>;
+    defer_cleanup(cleanup_token_vectors, toks);
+    for (const std::string_view& prompt : params->prompts) {
+        std::vector<llama_token>& tok = toks->emplace_back(prompt.size() + 16);
+        int count = llama_tokenize(model_,
+                                   prompt.data(),
+                                   prompt.size(),
+                                   &tok[0],
+                                   tok.size(),
+                                   params->add_special,
+                                   params->parse_special);
+        if (count < 0) {
+            SLOG("llama_tokenize failed");
+            return send_error(405);
+        }
+        if (!count)
+            return send_error(400, "completely empty prompt disallowed");
+        tok.resize(count);
+        tokens_provided += count;
+        tokens_used += MIN(count, n_ctx_train);
     }
-    defer_cleanup(cleanup_llama_context, ctx);
 
-    // initialize batch
+    // compute embeddings
+    //
+    // this might get batched together with inputs from other clients
     const int n_embd = llama_n_embd(model_);
-    llama_batch* batch = new llama_batch;
-    *batch = llama_batch_init(count, 0, 1);
-    defer_cleanup(cleanup_llama_batch, batch);
-    for (size_t i = 0; i < count; ++i)
-        add_token_to_batch(*batch, (*toks)[i], i, { 0 }, i == count - 1);
-
-    // inference time
-    if (llama_decode(ctx, *batch) < 0) {
-        SLOG("llama_decode failed");
-        return send_error(500);
-    }
-    auto embeddings = new std::vector<float>(n_embd, 0);
+    auto embeddings = new std::vector<float>(toks->size() * n_embd);
     defer_cleanup(cleanup_float_vector, embeddings);
-    for (int i = 0; i < batch->n_tokens; i++) {
-        if (!batch->logits[i])
-            continue;
-        const float* embd = llama_get_embeddings_ith(ctx, i);
-        if (!embd) {
-            SLOG("llama_get_embeddings_ith failed");
-            return send_error(500);
-        }
-        normalize_embeddings(
-          embd, embeddings->data() + batch->seq_id[i][0] * n_embd, n_embd);
+    auto inputs = new std::vector<Embed>(toks->size());
+    defer_cleanup(cleanup_embed_vector, inputs);
+    for (size_t i = 0; i < toks->size(); ++i) {
+        (*inputs)[i].tokens = (*toks)[i].data();
+        (*inputs)[i].n = MIN((*toks)[i].size(), n_ctx_train);
+        (*inputs)[i].out = embeddings->data() + i * n_embd;
     }
+    if (worker_->server_->embedder_->embed(inputs))
+        return send_error(500);
 
     // determine how output json should look
     bool in_openai_mode = path() == "/v1/embeddings";
 
-    // serialize tokens to json
-    char* p = obuf_.p;
-    p = stpcpy(p, "{\n");
-
+    // serialize embeddings to json
+    //
+    // this can get too big for the output buffer when there's several
+    // inputs, so the response body is built as a string.
+    //
     // Here's what an OpenAI /v1/embedding response looks like:
     //
     //     {
@@ -267,50 +255,61 @@ Client::embedding()
     //       }
     //     }
     //
-
+    char buf[32];
+    std::string& s = dump_;
+    s = "{\n";
     if (in_openai_mode) {
-        p = stpcpy(p, "  \"object\": \"list\",\n");
-        p = stpcpy(p, "  \"model\": ");
-        p = encode_json(p, params->model);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"usage\": {\n");
-        p = stpcpy(p, "    \"prompt_tokens\": ");
-        p = encode_json(p, count);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "    \"total_tokens\": ");
-        p = encode_json(p, toks->size());
-        p = stpcpy(p, "\n  },\n");
-        p = stpcpy(p, "  \"data\": [{\n");
-        p = stpcpy(p, "  \"object\": \"embedding\",\n");
-        p = stpcpy(p, "  \"index\": 0,\n");
+        s += "  \"object\": \"list\",\n";
+        s += "  \"model\": ";
+        s.append(obuf_.p, encode_json(obuf_.p, params->model) - obuf_.p);
+        s += ",\n";
+        s += "  \"usage\": {\n";
+        s += "    \"prompt_tokens\": ";
+        s.append(buf, encode_json(buf, tokens_used) - buf);
+        s += ",\n";
+        s += "    \"total_tokens\": ";
+        s.append(buf, encode_json(buf, tokens_provided) - buf);
+        s += "\n  },\n";
+        s += "  \"data\": [";
+        for (size_t i = 0; i < inputs->size(); ++i) {
+            if (i)
+                s += ", ";
+            s += "{\n";
+            s += "  \"object\": \"embedding\",\n";
+            s += "  \"index\": ";
+            s.append(buf, encode_json(buf, i) - buf);
+            s += ",\n";
+            s += "  \"embedding\": ";
+            append_embedding(&s, (*inputs)[i].out, n_embd);
+            s += "\n  }";
+        }
+        s += "]\n";
     } else {
-        p = stpcpy(p, "  \"add_special\": ");
-        p = encode_bool(p, params->add_special);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"parse_special\": ");
-        p = encode_bool(p, params->parse_special);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"tokens_provided\": ");
-        p = encode_json(p, toks->size());
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"tokens_used\": ");
-        p = encode_json(p, count);
-        p = stpcpy(p, ",\n");
-    }
-
-    p = stpcpy(p, "  \"embedding\": [");
-    for (size_t i = 0; i < embeddings->size(); ++i) {
-        if (i) {
-            *p++ = ',';
-            *p++ = ' ';
+        s += "  \"add_special\": ";
+        s.append(buf, encode_bool(buf, params->add_special) - buf);
+        s += ",\n";
+        s += "  \"parse_special\": ";
+        s.append(buf, encode_bool(buf, params->parse_special) - buf);
+        s += ",\n";
+        s += "  \"tokens_provided\": ";
+        s.append(buf, encode_json(buf, tokens_provided) - buf);
+        s += ",\n";
+        s += "  \"tokens_used\": ";
+        s.append(buf, encode_json(buf, tokens_used) - buf);
+        s += ",\n";
+        s += "  \"embedding\": ";
+        if (params->is_array)
+            s += '[';
+        for (size_t i = 0; i < inputs->size(); ++i) {
+            if (i)
+                s += ", ";
+            append_embedding(&s, (*inputs)[i].out, n_embd);
         }
-        p = encode_json(p, (*embeddings)[i]);
+        if (params->is_array)
+            s += ']';
+        s += "\n";
     }
-    p = stpcpy(p, "]\n");
-    if (in_openai_mode)
-        p = stpcpy(p, "  }]\n");
-    p = stpcpy(p, "}\n");
-    std::string_view content(obuf_.p, p - obuf_.p);
+    s += "}\n";
 
     // collect statistics
     rusage ruend = {};
@@ -324,6 +323,7 @@ Client::embedding()
     long system_us = timeval_tomicros(system);
 
     // send response
+    char* p = obuf_.p;
     char* headers = p;
     p = append_http_response_message(p, 200);
     p = stpcpy(p, "Content-Type: application/json\r\n");
@@ -334,7 +334,7 @@ Client::embedding()
     p = stpcpy(p, "\r\nX-System-Micros: ");
     p = FormatInt64(p, system_us);
     p = stpcpy(p, "\r\n");
-    return send_response(headers, p, content);
+    return send_response(headers, p, dump_);
 }
 
 } // namespace server
@@ -0,0 +1,102 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "event.h"
+#include "llamafile/server/fastjson.h"
+#include <cstring>
+
+namespace lf {
+namespace server {
+
+// turns rendered event into template
+//
+// the json should already be wrapped in "data: ...\n\n" framing.
+void
+Event::compile(std::string_view rendered)
+{
+    static const struct
+    {
+        std::string_view placeholder;
+        Hole hole;
+    } kHoles[] = {
+        { "\"" EVENT_TEXT "\"", TEXT },
+        { "\"" EVENT_INDEX "\"", INDEX },
+        { "\"" EVENT_CREATED "\"", CREATED },
+    };
+    data_ = rendered;
+    pieces_.clear();
+    size_t i = 0;
+    for (;;) {
+        Hole hole = NONE;
+        size_t pos = std::string_view::npos;
+        size_t len = 0;
+        for (const auto& h : kHoles) {
+            size_t j = data_.find(h.placeholder, i);
+            if (j < pos) {
+                pos = j;
+                len = h.placeholder.size();
+                hole = h.hole;
+            }
+        }
+        if (hole == NONE) {
+            pieces_.push_back({ i, data_.size() - i, NONE });
+            break;
+        }
+        pieces_.push_back({ i, pos - i, hole });
+        i = pos + len;
+    }
+}
+
+// returns upper bound on bytes needed to render event
+//
+// json escaping may grow each byte of text by up to six times, and
+// integers take at most twenty digits. includes the nul terminator.
+size_t
+Event::bound(size_t text_size) const
+{
+    return data_.size() + pieces_.size() * 24 + text_size * 6 + 1;
+}
+
+// renders event into `p` which must have bound() bytes of space
+//
+// @return pointer to nul terminator
+char*
+Event::render(char* p, std::string_view text, int index, long created) const
+{
+    for (const Piece& piece : pieces_) {
+        memcpy(p, data_.data() + piece.off, piece.len);
+        p += piece.len;
+        switch (piece.hole) {
+            case TEXT:
+                p = encode_json(p, text);
+                break;
+            case INDEX:
+                p = encode_json(p, index);
+                break;
+            case CREATED:
+                p = encode_json(p, created);
+                break;
+            default:
+                *p = 0;
+                break;
+        }
+    }
+    return p;
+}
+
+} // namespace server
+} // namespace lf
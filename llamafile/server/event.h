@@ -0,0 +1,66 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+// placeholders that get punched out of a rendered event
+#define EVENT_TEXT "@@event-text@@"
+#define EVENT_INDEX "@@event-index@@"
+#define EVENT_CREATED "@@event-created@@"
+
+namespace lf {
+namespace server {
+
+// pre-rendered server-sent event for streaming completions
+//
+// streamed completions send an event for each token, and these only
+// differ by a few fields. rather than serializing a json tree on each
+// token, the tree is rendered once with string placeholders assigned,
+// e.g. choice["index"] = EVENT_INDEX, and each event is assembled by
+// splicing values in where the quoted placeholders used to be.
+class Event
+{
+  public:
+    void compile(std::string_view);
+    size_t bound(size_t) const;
+    char* render(char*, std::string_view, int, long) const;
+
+  private:
+    enum Hole
+    {
+        NONE,
+        TEXT,
+        INDEX,
+        CREATED,
+    };
+
+    struct Piece
+    {
+        size_t off;
+        size_t len;
+        Hole hole; // goes after literal
+    };
+
+    std::string data_;
+    std::vector<Piece> pieces_;
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,77 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "event.h"
+#include <cosmo.h>
+#include <cstdlib>
+#include <string>
+
+namespace lf {
+namespace server {
+namespace {
+
+void
+event_test()
+{
+    {
+        Event e;
+        e.compile("data: {\"choices\":[{\"delta\":{\"content\":\"" EVENT_TEXT
+                  "\"},\"index\":\"" EVENT_INDEX "\"}],\"created\":\"" //
+                  EVENT_CREATED "\",\"id\":\"x\"}\n\n");
+        std::string s(e.bound(5), 0);
+        s.resize(e.render(s.data(), "a\"b\n", 3, 1700000000) - s.data());
+        if (s != "data: {\"choices\":[{\"delta\":{\"content\":\"a\\\"b\\n\"},"
+                 "\"index\":3}],\"created\":1700000000,\"id\":\"x\"}\n\n")
+            exit(1);
+
+        // holes may be filled again without recompiling
+        s.assign(e.bound(0), 0);
+        s.resize(e.render(s.data(), "", 0, 0) - s.data());
+        if (s != "data: {\"choices\":[{\"delta\":{\"content\":\"\"},"
+                 "\"index\":0}],\"created\":0,\"id\":\"x\"}\n\n")
+            exit(2);
+    }
+    {
+        // events without holes are sent verbatim
+        Event e;
+        e.compile("data: [DONE]\n\n");
+        char buf[64];
+        if (std::string_view(buf, e.render(buf, "hi", 1, 2) - buf) !=
+            "data: [DONE]\n\n")
+            exit(3);
+    }
+    {
+        // escaping never exceeds bound
+        Event e;
+        e.compile("\"" EVENT_TEXT "\"");
+        std::string text(100, '\1');
+        std::string s(e.bound(text.size()), 0);
+        if (e.render(s.data(), text, 0, 0) - s.data() >= s.size())
+            exit(4);
+    }
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::event_test();
+}
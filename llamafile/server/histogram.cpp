@@ -0,0 +1,91 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "histogram.h"
+#include <cosmo.h>
+#include <cstdio>
+
+namespace lf {
+namespace server {
+
+Histogram::Histogram(std::initializer_list<double> bounds)
+{
+    unassert(bounds.size() <= HISTOGRAM_MAX_BUCKETS);
+    for (double bound : bounds) {
+        unassert(!n_ || bound > bounds_[n_ - 1]);
+        bounds_[n_++] = bound;
+    }
+}
+
+void
+Histogram::observe(double value, unsigned long n)
+{
+    int i = 0;
+    while (i < n_ && value > bounds_[i])
+        ++i;
+    counts_[i].fetch_add(n, std::memory_order_relaxed);
+    sum_.fetch_add(value * n, std::memory_order_relaxed);
+}
+
+unsigned long
+Histogram::count() const
+{
+    unsigned long count = 0;
+    for (int i = 0; i <= n_; ++i)
+        count += counts_[i].load(std::memory_order_relaxed);
+    return count;
+}
+
+double
+Histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+
+// appends histogram to prometheus text exposition
+void
+Histogram::describe(std::string* out, const char* name, const char* help) const
+{
+    char buf[128];
+    unsigned long count = 0;
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n", name, help);
+    *out += buf;
+    snprintf(buf, sizeof(buf), "# TYPE %s histogram\n", name);
+    *out += buf;
+    for (int i = 0; i <= n_; ++i) {
+        count += counts_[i].load(std::memory_order_relaxed);
+        if (i < n_) {
+            snprintf(buf,
+                     sizeof(buf),
+                     "%s_bucket{le=\"%g\"} %lu\n",
+                     name,
+                     bounds_[i],
+                     count);
+        } else {
+            snprintf(
+              buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+        }
+        *out += buf;
+    }
+    snprintf(buf, sizeof(buf), "%s_sum %g\n", name, sum());
+    *out += buf;
+    snprintf(buf, sizeof(buf), "%s_count %lu\n", name, count);
+    *out += buf;
+}
+
+} // namespace server
+} // namespace lf
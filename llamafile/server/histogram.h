@@ -0,0 +1,52 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <atomic>
+#include <initializer_list>
+#include <string>
+
+#define HISTOGRAM_MAX_BUCKETS 16
+
+namespace lf {
+namespace server {
+
+// prometheus style histogram that may be updated without locks
+//
+// observations are counted in the first bucket whose upper bound is
+// greater than or equal to the value, or the implicit +Inf bucket if
+// it's bigger than all of them. buckets are stored non-cumulatively,
+// so each observation only needs to touch a single cache line, and
+// they're added up when the histogram is described.
+class Histogram
+{
+  public:
+    explicit Histogram(std::initializer_list<double>);
+    void observe(double, unsigned long = 1);
+    unsigned long count() const;
+    double sum() const;
+    void describe(std::string*, const char*, const char*) const;
+
+  private:
+    int n_ = 0;
+    double bounds_[HISTOGRAM_MAX_BUCKETS];
+    std::atomic_ulong counts_[HISTOGRAM_MAX_BUCKETS + 1] = {};
+    std::atomic<double> sum_ = 0;
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,89 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "histogram.h"
+#include <cosmo.h>
+#include <cstdlib>
+#include <pthread.h>
+
+namespace lf {
+namespace server {
+namespace {
+
+void*
+observer(void* arg)
+{
+    Histogram* h = (Histogram*)arg;
+    for (int i = 0; i < 10000; ++i)
+        h->observe(.5);
+    return nullptr;
+}
+
+void
+histogram_test()
+{
+    {
+        Histogram h({ 1, 2, 4 });
+        if (h.count() || h.sum())
+            exit(1);
+
+        // values land in first bucket that's big enough
+        h.observe(.5);
+        h.observe(1);
+        h.observe(3);
+        h.observe(100, 2);
+        if (h.count() != 5 || h.sum() != 204.5)
+            exit(2);
+
+        // buckets are described cumulatively
+        std::string s;
+        h.describe(&s, "x_seconds", "Help.");
+        if (s != "# HELP x_seconds Help.\n"
+                 "# TYPE x_seconds histogram\n"
+                 "x_seconds_bucket{le=\"1\"} 2\n"
+                 "x_seconds_bucket{le=\"2\"} 2\n"
+                 "x_seconds_bucket{le=\"4\"} 3\n"
+                 "x_seconds_bucket{le=\"+Inf\"} 5\n"
+                 "x_seconds_sum 204.5\n"
+                 "x_seconds_count 5\n")
+            exit(3);
+    }
+    {
+        // concurrent observations aren't lost
+        pthread_t th[4];
+        Histogram h({ 1 });
+        for (int i = 0; i < 4; ++i)
+            if (pthread_create(&th[i], 0, observer, &h))
+                exit(4);
+        for (int i = 0; i < 4; ++i)
+            if (pthread_join(th[i], 0))
+                exit(5);
+        if (h.count() != 40000 || h.sum() != 20000)
+            exit(6);
+    }
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::histogram_test();
+}
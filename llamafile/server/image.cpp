@@ -18,6 +18,7 @@
 #include "image.h"
 #include "llamafile/llamafile.h"
 #include <cassert>
+#include <cosmo.h>
 #include <utility>
 
 namespace lf {
@@ -25,19 +26,33 @@ namespace server {
 
 Image::~Image() = default;
 
-Image::Image(const Image& old) : Image(old.bytes_, old.ctx_used_)
+// images are immutable, so copies share the same bytes
+Image::Image(const Image& old) : Image(old, old.ctx_used_)
+{
+}
+
+Image::Image(const Image& old, int ctx_used)
+  : bytes_(old.bytes_), hash_(old.hash_), ctx_used_(ctx_used)
 {
 }
 
 Image::Image(const std::string_view& bytes, int ctx_used)
-  : bytes_(bytes), ctx_used_(ctx_used)
+  : bytes_(std::make_shared<const std::string>(bytes))
+  , hash_(__fnv(bytes.data(), bytes.size()))
+  , ctx_used_(ctx_used)
 {
 }
 
 const std::string&
 Image::bytes() const
 {
-    return bytes_;
+    return *bytes_;
+}
+
+uint64_t
+Image::hash() const
+{
+    return hash_;
 }
 
 int
@@ -60,16 +75,22 @@ Image::ctx_used() const
     return ctx_used_;
 }
 
+// images are ordered by hash, so the bytes only need to be compared
+// when two images are probably the same
 bool
 operator<(const Image& lhs, const Image& rhs)
 {
+    if (lhs.hash() != rhs.hash())
+        return lhs.hash() < rhs.hash();
     return lhs.bytes() < rhs.bytes();
 }
 
 bool
 operator==(const Image& lhs, const Image& rhs)
 {
-    return lhs.bytes() == rhs.bytes();
+    if (lhs.hash() != rhs.hash())
+        return false;
+    return &lhs.bytes() == &rhs.bytes() || lhs.bytes() == rhs.bytes();
 }
 
 } // namespace server
@@ -16,6 +16,8 @@
 // limitations under the License.
 
 #pragma once
+#include <cstdint>
+#include <memory>
 #include <string>
 
 namespace lf {
@@ -26,12 +28,15 @@ class Image
   public:
     ~Image();
     Image(const Image&);
+    Image(const Image&, int);
     Image(const std::string_view&, int);
     const std::string& bytes() const;
+    uint64_t hash() const;
     int ctx_used() const;
 
   private:
-    std::string bytes_;
+    std::shared_ptr<const std::string> bytes_;
+    uint64_t hash_;
     int ctx_used_;
 };
 
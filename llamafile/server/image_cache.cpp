@@ -0,0 +1,97 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "image_cache.h"
+#include "llamafile/server/image.h"
+
+namespace lf {
+namespace server {
+
+struct ImageCache::Entry
+{
+    Image image;
+    std::shared_ptr<llava_image_embed> embed;
+    size_t size;
+};
+
+ImageCache::ImageCache(size_t capacity) : capacity_(capacity)
+{
+}
+
+ImageCache::~ImageCache()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+// returns number of bytes held by cache
+size_t
+ImageCache::used() const
+{
+    pthread_mutex_lock(&lock_);
+    size_t res = used_;
+    pthread_mutex_unlock(&lock_);
+    return res;
+}
+
+// returns embedding of image, or null if it isn't cached
+std::shared_ptr<llava_image_embed>
+ImageCache::lookup(const Image& image)
+{
+    std::shared_ptr<llava_image_embed> res;
+    pthread_mutex_lock(&lock_);
+    auto it = map_.find(image.hash());
+    if (it != map_.end() && it->second->image == image) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        res = it->second->embed;
+    }
+    pthread_mutex_unlock(&lock_);
+    return res;
+}
+
+// adds embedding of image to cache
+//
+// the least recently used embeddings are evicted until the cache fits
+// in its memory budget. embeddings that are still in use by a slot are
+// only freed once the slot lets go of them.
+void
+ImageCache::insert(const Image& image,
+                   const std::shared_ptr<llava_image_embed>& embed,
+                   size_t embed_size)
+{
+    size_t size = embed_size + image.bytes().size();
+    if (size > capacity_)
+        return;
+    pthread_mutex_lock(&lock_);
+    auto it = map_.find(image.hash());
+    if (it != map_.end()) {
+        used_ -= it->second->size;
+        lru_.erase(it->second);
+        map_.erase(it);
+    }
+    while (used_ + size > capacity_) {
+        used_ -= lru_.back().size;
+        map_.erase(lru_.back().image.hash());
+        lru_.pop_back();
+    }
+    lru_.push_front(Entry{ image, embed, size });
+    map_[image.hash()] = lru_.begin();
+    used_ += size;
+    pthread_mutex_unlock(&lock_);
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,59 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <unordered_map>
+
+struct llava_image_embed;
+
+namespace lf {
+namespace server {
+
+class Image;
+
+// least recently used cache of clip image embeddings
+//
+// chat clients tend to send the same images over and over again, one
+// turn after another, and clip encoding is the most expensive part of
+// prefilling them. embeddings only depend on the image and the vision
+// model, so it's safe for all slots to share them.
+class ImageCache
+{
+  public:
+    explicit ImageCache(size_t);
+    ~ImageCache();
+    size_t used() const;
+    std::shared_ptr<llava_image_embed> lookup(const Image&);
+    void insert(const Image&,
+                const std::shared_ptr<llava_image_embed>&,
+                size_t);
+
+  private:
+    struct Entry;
+    size_t capacity_;
+    size_t used_ = 0;
+    std::list<Entry> lru_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> map_;
+    mutable pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+};
+
+} // namespace server
+} // namespace lf
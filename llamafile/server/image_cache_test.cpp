@@ -0,0 +1,108 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "image_cache.h"
+#include "image.h"
+#include "llama.cpp/llava/llava.h"
+#include <cosmo.h>
+#include <cstdlib>
+
+namespace lf {
+namespace server {
+namespace {
+
+int g_freed;
+
+std::shared_ptr<llava_image_embed>
+make_embed(int n_image_pos)
+{
+    llava_image_embed* embed = new llava_image_embed;
+    embed->embed = nullptr;
+    embed->n_image_pos = n_image_pos;
+    return std::shared_ptr<llava_image_embed>(embed,
+                                              [](llava_image_embed* embed) {
+                                                  ++g_freed;
+                                                  delete embed;
+                                              });
+}
+
+void
+image_cache_test()
+{
+    {
+        ImageCache cache(100);
+        Image a("aaaa", -1);
+        Image b("bbbb", -1);
+        Image c("cccc", -1);
+
+        // lookups only find what was inserted
+        if (cache.lookup(a))
+            exit(1);
+        cache.insert(a, make_embed(1), 36);
+        if (cache.used() != 40)
+            exit(2);
+        if (!cache.lookup(a) || cache.lookup(a)->n_image_pos != 1)
+            exit(3);
+        if (!cache.lookup(Image("aaaa", 1)))
+            exit(4);
+        if (cache.lookup(Image("aaab", 1)))
+            exit(5);
+
+        // least recently used entry gets evicted
+        cache.insert(b, make_embed(2), 36);
+        if (!cache.lookup(a))
+            exit(6);
+        cache.insert(c, make_embed(3), 36);
+        if (cache.used() != 80)
+            exit(7);
+        if (!cache.lookup(a) || cache.lookup(b) || !cache.lookup(c))
+            exit(8);
+        if (g_freed != 1)
+            exit(9);
+
+        // embeddings that are in use outlive eviction
+        std::shared_ptr<llava_image_embed> held = cache.lookup(a);
+        cache.insert(b, make_embed(4), 76);
+        if (cache.lookup(a) || cache.lookup(c) || !cache.lookup(b))
+            exit(10);
+        if (g_freed != 2 || held->n_image_pos != 1)
+            exit(11);
+        held.reset();
+        if (g_freed != 3)
+            exit(12);
+
+        // things too big for the cache are ignored
+        cache.insert(c, make_embed(5), 1000);
+        if (cache.lookup(c) || !cache.lookup(b))
+            exit(13);
+        if (g_freed != 4)
+            exit(14);
+    }
+    if (g_freed != 5)
+        exit(15);
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::image_cache_test();
+}
@@ -0,0 +1,581 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "json_view.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#define DEPTH 20
+
+using jt::Json;
+
+namespace lf {
+namespace server {
+
+static inline bool
+is_space(int c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool
+is_digit(int c)
+{
+    return '0' <= c && c <= '9';
+}
+
+static inline int
+unhex(int c)
+{
+    if ('0' <= c && c <= '9')
+        return c - '0';
+    if ('a' <= c && c <= 'f')
+        return c - 'a' + 10;
+    if ('A' <= c && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int
+unhex4(const char* p)
+{
+    int x = 0;
+    for (int i = 0; i < 4; ++i) {
+        int d = unhex(p[i] & 255);
+        if (d == -1)
+            return -1;
+        x = x << 4 | d;
+    }
+    return x;
+}
+
+// returns true if any of eight bytes needs a closer look
+//
+// that'd be a quote, backslash, control code, or non-ascii byte. it's
+// what lets long base64 strings get validated eight bytes at a time.
+static inline bool
+is_special(uint64_t w)
+{
+    uint64_t ones = 0x0101010101010101;
+    uint64_t high = 0x8080808080808080;
+    uint64_t q = w ^ (ones * '"');
+    uint64_t b = w ^ (ones * '\\');
+    return ((w - ones * 0x20) & ~w & high) | //
+           ((q - ones) & ~q & high) | //
+           ((b - ones) & ~b & high) | //
+           (w & high);
+}
+
+static void
+append_utf8(std::string* s, unsigned c)
+{
+    if (c < 0x80) {
+        *s += c;
+    } else if (c < 0x800) {
+        *s += 0300 | c >> 6;
+        *s += 0200 | (c & 077);
+    } else if (c < 0x10000) {
+        *s += 0340 | c >> 12;
+        *s += 0200 | (c >> 6 & 077);
+        *s += 0200 | (c & 077);
+    } else {
+        *s += 0360 | c >> 18;
+        *s += 0200 | (c >> 12 & 077);
+        *s += 0200 | (c >> 6 & 077);
+        *s += 0200 | (c & 077);
+    }
+}
+
+Json::Status
+JsonDocument::parse(std::string_view text)
+{
+    text_ = text;
+    nodes_.clear();
+    const char* p = text.data();
+    const char* e = p + text.size();
+    while (p < e && is_space(*p))
+        ++p;
+    if (p == e)
+        return Json::absent_value;
+    Json::Status status;
+    if ((status = parse_value(p, e, DEPTH)) != Json::success) {
+        nodes_.clear();
+        return status;
+    }
+    while (p < e && is_space(*p))
+        ++p;
+    if (p < e) {
+        nodes_.clear();
+        return Json::trailing_content;
+    }
+    return Json::success;
+}
+
+JsonView
+JsonDocument::root() const
+{
+    if (nodes_.empty())
+        return JsonView();
+    return JsonView(this, 0);
+}
+
+Json::Status
+JsonDocument::parse_value(const char*& p, const char* e, int depth)
+{
+    Json::Status status;
+    const char* a = p;
+    unsigned i = nodes_.size();
+    switch (*p & 255) {
+        case '{':
+            if (!depth)
+                return Json::depth_exceeded;
+            nodes_.push_back({ JsonView::Object, false, 0, 0, 0 });
+            for (++p;;) {
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p == '}' && nodes_.size() == i + 1) {
+                    ++p;
+                    break;
+                }
+                if (*p != '"')
+                    return Json::object_key_must_be_string;
+                if ((status = parse_string(p, e)) != Json::success)
+                    return status;
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p++ != ':')
+                    return Json::missing_colon;
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p == '}')
+                    return Json::object_missing_value;
+                if ((status = parse_value(p, e, depth - 1)) != Json::success)
+                    return status;
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p == '}') {
+                    ++p;
+                    break;
+                }
+                if (*p++ != ',')
+                    return Json::missing_comma;
+            }
+            break;
+
+        case '[':
+            if (!depth)
+                return Json::depth_exceeded;
+            nodes_.push_back({ JsonView::Array, false, 0, 0, 0 });
+            for (++p;;) {
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p == ']' && nodes_.size() == i + 1) {
+                    ++p;
+                    break;
+                }
+                if ((status = parse_value(p, e, depth - 1)) != Json::success)
+                    return status;
+                while (p < e && is_space(*p))
+                    ++p;
+                if (p == e)
+                    return Json::unexpected_eof;
+                if (*p == ']') {
+                    ++p;
+                    break;
+                }
+                if (*p++ != ',')
+                    return Json::missing_comma;
+            }
+            break;
+
+        case '"':
+            return parse_string(p, e);
+
+        case '-':
+        case '0' ... '9':
+            return parse_number(p, e);
+
+        case 't':
+            if (e - p < 4 || memcmp(p, "true", 4))
+                return Json::illegal_character;
+            nodes_.push_back({ JsonView::Bool, false, 0, 0, 4 });
+            p += 4;
+            break;
+
+        case 'f':
+            if (e - p < 5 || memcmp(p, "false", 5))
+                return Json::illegal_character;
+            nodes_.push_back({ JsonView::Bool, false, 0, 0, 5 });
+            p += 5;
+            break;
+
+        case 'n':
+            if (e - p < 4 || memcmp(p, "null", 4))
+                return Json::illegal_character;
+            nodes_.push_back({ JsonView::Null, false, 0, 0, 4 });
+            p += 4;
+            break;
+
+        case ',':
+            return Json::unexpected_comma;
+        case ':':
+            return Json::unexpected_colon;
+        case ']':
+            return Json::unexpected_end_of_array;
+        case '}':
+            return Json::unexpected_end_of_object;
+        default:
+            return Json::illegal_character;
+    }
+    nodes_[i].off = a - text_.data();
+    nodes_[i].len = p - a;
+    nodes_[i].next = nodes_.size();
+    return Json::success;
+}
+
+Json::Status
+JsonDocument::parse_string(const char*& p, const char* e)
+{
+    int c;
+    const char* a = p++;
+    bool escaped = false;
+    for (;;) {
+        uint64_t w;
+        while (e - p >= 8 && (memcpy(&w, p, 8), !is_special(w)))
+            p += 8;
+        if (p == e)
+            return Json::unexpected_end_of_string;
+        c = *p++ & 255;
+        if (c == '"')
+            break;
+        if (c == '\\') {
+            escaped = true;
+            if (p == e)
+                return Json::unexpected_end_of_string;
+            switch (*p++) {
+                case '"':
+                case '\\':
+                case '/':
+                case 'b':
+                case 'f':
+                case 'n':
+                case 'r':
+                case 't':
+                    break;
+                case 'u':
+                    if (e - p < 4 || (c = unhex4(p)) == -1)
+                        return Json::invalid_hex_escape;
+                    p += 4;
+                    if (0xdc00 <= c && c <= 0xdfff)
+                        return Json::invalid_unicode_escape;
+                    if (0xd800 <= c && c <= 0xdbff) {
+                        if (e - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                            (c = unhex4(p + 2)) == -1 ||
+                            !(0xdc00 <= c && c <= 0xdfff))
+                            return Json::invalid_unicode_escape;
+                        p += 6;
+                    }
+                    break;
+                default:
+                    return Json::invalid_escape_character;
+            }
+        } else if (c < 0x20) {
+            return Json::non_del_c0_control_code_in_string;
+        } else if (c >= 0x80) {
+            int n;
+            int lo = 0x80;
+            int hi = 0xbf;
+            if (c < 0xc0) {
+                return Json::malformed_utf8;
+            } else if (c < 0xc2) {
+                return Json::overlong_ascii;
+            } else if (c < 0xe0) {
+                n = 1;
+                if (c == 0xc2 && p < e && (*p & 255) < 0xa0)
+                    return Json::c1_control_code_in_string;
+            } else if (c < 0xf0) {
+                n = 2;
+                if (c == 0xe0 && p < e && (*p & 255) < 0xa0)
+                    return Json::overlong_utf8_0x7ff;
+                if (c == 0xed && p < e && (*p & 255) >= 0xa0)
+                    return Json::utf16_surrogate_in_utf8;
+            } else if (c < 0xf5) {
+                n = 3;
+                if (c == 0xf0 && p < e && (*p & 255) < 0x90)
+                    return Json::overlong_utf8_0xffff;
+                if (c == 0xf4 && p < e && (*p & 255) >= 0x90)
+                    return Json::utf8_exceeds_utf16_range;
+            } else {
+                return Json::illegal_utf8_character;
+            }
+            for (; n; --n, ++p)
+                if (p == e || !(lo <= (*p & 255) && (*p & 255) <= hi))
+                    return Json::malformed_utf8;
+        }
+    }
+    nodes_.push_back(
+      { JsonView::String, escaped, (unsigned)nodes_.size() + 1, 0, 0 });
+    nodes_.back().off = a - text_.data();
+    nodes_.back().len = p - a;
+    return Json::success;
+}
+
+Json::Status
+JsonDocument::parse_number(const char*& p, const char* e)
+{
+    const char* a = p;
+    JsonView::Type type = JsonView::Long;
+    if (*p == '-')
+        if (++p == e || !is_digit(*p))
+            return Json::bad_negative;
+    if (*p == '0') {
+        if (++p < e && is_digit(*p))
+            return Json::unexpected_octal;
+    } else {
+        while (p < e && is_digit(*p))
+            ++p;
+    }
+    if (p < e && *p == '.') {
+        type = JsonView::Double;
+        if (++p == e || !is_digit(*p))
+            return Json::bad_double;
+        while (p < e && is_digit(*p))
+            ++p;
+    }
+    if (p < e && (*p == 'e' || *p == 'E')) {
+        type = JsonView::Double;
+        if (++p < e && (*p == '+' || *p == '-'))
+            ++p;
+        if (p == e || !is_digit(*p))
+            return Json::bad_exponent;
+        while (p < e && is_digit(*p))
+            ++p;
+    }
+    if (type == JsonView::Long && p - a > 18) {
+        // integers that don't fit in a long are doubles
+        std::string s(a, p - a);
+        errno = 0;
+        strtol(s.c_str(), nullptr, 10);
+        if (errno == ERANGE)
+            type = JsonView::Double;
+    }
+    nodes_.push_back({ (unsigned char)type,
+                       false,
+                       (unsigned)nodes_.size() + 1,
+                       (size_t)(a - text_.data()),
+                       (size_t)(p - a) });
+    return Json::success;
+}
+
+JsonView::Type
+JsonView::type() const
+{
+    if (!doc_ || i_ == -1u)
+        return Missing;
+    return (Type)doc_->nodes_[i_].type;
+}
+
+// returns json source text of value
+std::string_view
+JsonView::raw() const
+{
+    if (!doc_ || i_ == -1u)
+        return {};
+    const JsonDocument::Node& node = doc_->nodes_[i_];
+    return doc_->text_.substr(node.off, node.len);
+}
+
+bool
+JsonView::getBool() const
+{
+    return type() == Bool && raw()[0] == 't';
+}
+
+long
+JsonView::getLong() const
+{
+    switch (type()) {
+        case Long: {
+            std::string_view s = raw();
+            bool neg = s[0] == '-';
+            unsigned long x = 0;
+            for (size_t i = neg; i < s.size(); ++i)
+                x = x * 10 + (s[i] - '0');
+            return neg ? -x : x;
+        }
+        case Double:
+            return getNumber();
+        default:
+            return 0;
+    }
+}
+
+double
+JsonView::getNumber() const
+{
+    switch (type()) {
+        case Long:
+            return getLong();
+        case Double: {
+            std::string s(raw());
+            return strtod(s.c_str(), nullptr);
+        }
+        default:
+            return 0;
+    }
+}
+
+// decodes string value
+//
+// this allocates memory. use the other overload to avoid copying the
+// string when it doesn't contain any escape sequences.
+std::string
+JsonView::getString() const
+{
+    std::string s;
+    std::string_view v = getString(&s);
+    if (v.data() == s.data())
+        return s;
+    return std::string(v);
+}
+
+// returns string value, using `buf` only if it needs to be decoded
+std::string_view
+JsonView::getString(std::string* buf) const
+{
+    if (type() != String)
+        return {};
+    std::string_view s = raw();
+    s = s.substr(1, s.size() - 2);
+    if (!doc_->nodes_[i_].escaped)
+        return s;
+    buf->clear();
+    buf->reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        if (s[i] != '\\') {
+            size_t j = s.find('\\', i);
+            if (j == std::string_view::npos)
+                j = s.size();
+            buf->append(s.data() + i, j - i);
+            i = j;
+            continue;
+        }
+        switch (s[i + 1]) {
+            case 'b':
+                *buf += '\b';
+                break;
+            case 'f':
+                *buf += '\f';
+                break;
+            case 'n':
+                *buf += '\n';
+                break;
+            case 'r':
+                *buf += '\r';
+                break;
+            case 't':
+                *buf += '\t';
+                break;
+            case 'u': {
+                unsigned c = unhex4(s.data() + i + 2);
+                if (0xd800 <= c && c <= 0xdbff) {
+                    c = 0x10000 + ((c - 0xd800) << 10) +
+                        (unhex4(s.data() + i + 8) - 0xdc00);
+                    i += 6;
+                }
+                append_utf8(buf, c);
+                i += 4;
+                break;
+            }
+            default:
+                *buf += s[i + 1];
+                break;
+        }
+        i += 2;
+    }
+    return *buf;
+}
+
+// returns number of items in array or object
+size_t
+JsonView::size() const
+{
+    Type t = type();
+    if (t != Array && t != Object)
+        return 0;
+    size_t n = 0;
+    for (unsigned k = i_ + 1; k < doc_->nodes_[i_].next; ++n) {
+        if (t == Object)
+            ++k;
+        k = doc_->nodes_[k].next;
+    }
+    return n;
+}
+
+bool
+JsonView::contains(std::string_view key) const
+{
+    return (*this)[key].type() != Missing;
+}
+
+// looks up value of key in object
+//
+// if the key appears more than once, then the last one wins.
+JsonView
+JsonView::operator[](std::string_view key) const
+{
+    unsigned res = -1u;
+    if (type() != Object)
+        return JsonView();
+    std::string buf;
+    for (unsigned k = i_ + 1; k < doc_->nodes_[i_].next;
+         k = doc_->nodes_[k + 1].next)
+        if (JsonView(doc_, k).getString(&buf) == key)
+            res = k + 1;
+    return JsonView(doc_, res);
+}
+
+JsonView::iterator
+JsonView::begin() const
+{
+    if (type() != Array)
+        return iterator(doc_, 0);
+    return iterator(doc_, i_ + 1);
+}
+
+JsonView::iterator
+JsonView::end() const
+{
+    if (type() != Array)
+        return iterator(doc_, 0);
+    return iterator(doc_, doc_->nodes_[i_].next);
+}
+
+} // namespace server
+} // namespace lf
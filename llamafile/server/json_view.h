@@ -0,0 +1,171 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "llamafile/json.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+class JsonView;
+
+// zero-copy json parser for request bodies
+//
+// parsing validates the document and records where each value lives
+// in the input text, without decoding anything. the result is a flat
+// array with one small node per value, rather than a tree of strings
+// maps and vectors, so megabytes of base64 image data in a chat
+// history cost a single scan. the input text must outlive the views.
+class JsonDocument
+{
+  public:
+    jt::Json::Status parse(std::string_view);
+    JsonView root() const;
+
+  private:
+    friend class JsonView;
+
+    struct Node
+    {
+        unsigned char type;
+        bool escaped; // string needs decoding
+        unsigned next; // index of node after this value
+        size_t off;
+        size_t len;
+    };
+
+    std::string_view text_;
+    std::vector<Node> nodes_;
+
+    jt::Json::Status parse_value(const char*&, const char*, int);
+    jt::Json::Status parse_string(const char*&, const char*);
+    jt::Json::Status parse_number(const char*&, const char*);
+};
+
+// borrowed reference to a value inside a JsonDocument
+//
+// this has similar accessors to jt::Json. looking up a key that isn't
+// there, or indexing something that isn't an object, yields a missing
+// value for which isNull() is true.
+class JsonView
+{
+  public:
+    enum Type
+    {
+        Missing,
+        Null,
+        Bool,
+        Long,
+        Double,
+        String,
+        Array,
+        Object,
+    };
+
+    class iterator
+    {
+      public:
+        iterator(const JsonDocument* doc, unsigned i) : doc_(doc), i_(i)
+        {
+        }
+
+        JsonView operator*() const
+        {
+            return JsonView(doc_, i_);
+        }
+
+        iterator& operator++()
+        {
+            i_ = doc_->nodes_[i_].next;
+            return *this;
+        }
+
+        bool operator!=(const iterator& other) const
+        {
+            return i_ != other.i_;
+        }
+
+      private:
+        const JsonDocument* doc_;
+        unsigned i_;
+    };
+
+    JsonView() = default;
+    JsonView(const JsonDocument* doc, unsigned i) : doc_(doc), i_(i)
+    {
+    }
+
+    Type type() const;
+    std::string_view raw() const;
+
+    bool isNull() const
+    {
+        return type() <= Null;
+    }
+
+    bool isBool() const
+    {
+        return type() == Bool;
+    }
+
+    bool isLong() const
+    {
+        return type() == Long;
+    }
+
+    bool isNumber() const
+    {
+        return type() == Long || type() == Double;
+    }
+
+    bool isString() const
+    {
+        return type() == String;
+    }
+
+    bool isArray() const
+    {
+        return type() == Array;
+    }
+
+    bool isObject() const
+    {
+        return type() == Object;
+    }
+
+    bool getBool() const;
+    long getLong() const;
+    double getNumber() const;
+    std::string getString() const;
+    std::string_view getString(std::string*) const;
+
+    size_t size() const;
+    bool contains(std::string_view) const;
+    JsonView operator[](std::string_view) const;
+    iterator begin() const;
+    iterator end() const;
+
+  private:
+    const JsonDocument* doc_ = nullptr;
+    unsigned i_ = -1u;
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,170 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "json_view.h"
+#include <cosmo.h>
+#include <cstdlib>
+#include <string>
+
+using jt::Json;
+
+namespace lf {
+namespace server {
+namespace {
+
+Json::Status
+check(const char* s)
+{
+    JsonDocument doc;
+    return doc.parse(s);
+}
+
+void
+json_view_test()
+{
+    {
+        JsonDocument doc;
+        std::string s = "{\"model\": \"m\", \"n\": -2, \"t\": 0.5,"
+                        " \"e\": 1e3, \"big\": 99999999999999999999,"
+                        " \"ok\": true, \"no\": false, \"nil\": null,"
+                        " \"a\": [1, [2], {\"x\": 3}, \"four\"],"
+                        " \"esc\": \"a\\\"b\\u00e9\\ud83d\\ude00\\n\","
+                        " \"n\": 7}";
+        if (doc.parse(s) != Json::success)
+            exit(1);
+        JsonView json = doc.root();
+        if (!json.isObject() || json.size() != 11)
+            exit(2);
+
+        // strings without escapes point into the input
+        std::string buf;
+        std::string_view model = json["model"].getString(&buf);
+        if (model != "m" || model.data() < s.data() ||
+            model.data() >= s.data() + s.size())
+            exit(3);
+
+        // last duplicate key wins, like a map
+        if (!json["n"].isLong() || json["n"].getLong() != 7)
+            exit(4);
+        if (!json["t"].isNumber() || json["t"].isLong() ||
+            json["t"].getNumber() != .5)
+            exit(5);
+        if (json["e"].getNumber() != 1000)
+            exit(6);
+        if (json["big"].isLong() || !json["big"].isNumber())
+            exit(7);
+        if (!json["ok"].getBool() || json["no"].getBool() ||
+            !json["no"].isBool())
+            exit(8);
+
+        // missing values behave like null
+        if (!json["nil"].isNull() || !json["nope"].isNull() ||
+            json.contains("nope") || !json.contains("nil"))
+            exit(9);
+        if (!json["model"]["x"].isNull() || !json["nope"]["x"].isNull())
+            exit(10);
+
+        // arrays can be iterated
+        JsonView a = json["a"];
+        if (!a.isArray() || a.size() != 4)
+            exit(11);
+        int i = 0;
+        for (JsonView item : a) {
+            if ((i == 0 && item.getLong() != 1) ||
+                (i == 1 && (!item.isArray() || item.size() != 1)) ||
+                (i == 2 && item["x"].getLong() != 3) ||
+                (i == 3 && item.getString() != "four"))
+                exit(12);
+            ++i;
+        }
+        if (i != 4)
+            exit(13);
+        if (json["model"].begin() != json["model"].end())
+            exit(14);
+        if (a.raw() != "[1, [2], {\"x\": 3}, \"four\"]")
+            exit(15);
+
+        // escaped strings get decoded
+        if (json["esc"].getString() != "a\"b\u00e9\U0001F600\n")
+            exit(16);
+        if (json["esc"].getString(&buf) != "a\"b\u00e9\U0001F600\n")
+            exit(17);
+    }
+    {
+        JsonDocument doc;
+        if (doc.parse(" [] ") != Json::success || doc.root().size())
+            exit(18);
+        if (doc.parse("\"x\"") != Json::success || !doc.root().isString())
+            exit(19);
+        std::string long_string(1000, 'x');
+        if (doc.parse('"' + long_string + '"') != Json::success ||
+            doc.root().getString() != long_string)
+            exit(20);
+    }
+    if (check("") != Json::absent_value)
+        exit(21);
+    if (check("{} x") != Json::trailing_content)
+        exit(22);
+    if (check("{\"a\":1") != Json::unexpected_eof)
+        exit(23);
+    if (check("{\"a\" 1}") != Json::missing_colon)
+        exit(24);
+    if (check("[1 2]") != Json::missing_comma)
+        exit(25);
+    if (check("[1,]") != Json::unexpected_end_of_array)
+        exit(26);
+    if (check("{1:2}") != Json::object_key_must_be_string)
+        exit(27);
+    if (check("[01]") != Json::unexpected_octal)
+        exit(28);
+    if (check("[-]") != Json::bad_negative)
+        exit(29);
+    if (check("[1.]") != Json::bad_double)
+        exit(30);
+    if (check("[1e]") != Json::bad_exponent)
+        exit(31);
+    if (check("[\"\\x\"]") != Json::invalid_escape_character)
+        exit(32);
+    if (check("[\"\\u12\"]") != Json::invalid_hex_escape)
+        exit(33);
+    if (check("[\"\\udc00\"]") != Json::invalid_unicode_escape)
+        exit(34);
+    if (check("[\"\1\"]") != Json::non_del_c0_control_code_in_string)
+        exit(35);
+    if (check("[\"\xff\"]") != Json::illegal_utf8_character)
+        exit(36);
+    if (check("[\"\xe0\x80\x80\"]") != Json::overlong_utf8_0x7ff)
+        exit(37);
+    if (check("[\"abcdefghijklmnop") != Json::unexpected_end_of_string)
+        exit(38);
+    if (check("[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]") !=
+        Json::depth_exceeded)
+        exit(39);
+    if (check("[tru]") != Json::illegal_character)
+        exit(40);
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::json_view_test();
+}
@@ -0,0 +1,245 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+#include "llamafile/server/client.h"
+#include "llamafile/server/scheduler.h"
+#include "llamafile/server/server.h"
+#include "llamafile/server/slots.h"
+#include "llamafile/server/worker.h"
+#include "llama.cpp/ggml.h"
+#include <cosmo.h>
+#include <cstdio>
+
+// buckets for things measured in seconds
+#define LATENCY_BUCKETS \
+    { .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10, 30, 60 }
+
+// buckets for things measured in tokens per second
+#define SPEED_BUCKETS \
+    { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000 }
+
+namespace lf {
+namespace server {
+
+Metrics g_metrics;
+
+Metrics::Metrics()
+  : queue_wait(LATENCY_BUCKETS)
+  , prefill_speed(SPEED_BUCKETS)
+  , decode_speed(SPEED_BUCKETS)
+  , time_to_first_token(LATENCY_BUCKETS)
+  , inter_token_latency(LATENCY_BUCKETS)
+{
+}
+
+TokenTimer::TokenTimer(timespec started) : started(started)
+{
+}
+
+// records the tokens each sequence generated in one step
+//
+// when a step yields several tokens for a sequence, e.g. because of
+// speculative decoding, the latency of the step is split among them.
+void
+TokenTimer::step(const std::vector<std::vector<int>>& outs)
+{
+    timespec now = timespec_real();
+    double elapsed = timespec_tonanos(timespec_sub(now, last)) * 1e-9;
+    unsigned long n = 0;
+    for (const std::vector<int>& out : outs) {
+        n += out.size();
+        if (tokens && !out.empty())
+            g_metrics.inter_token_latency.observe(elapsed / out.size(),
+                                                  out.size());
+    }
+    if (!n)
+        return;
+    if (!tokens) {
+        first = now;
+        g_metrics.time_to_first_token.observe(
+          timespec_tonanos(timespec_sub(now, started)) * 1e-9);
+    } else {
+        later_tokens += n;
+    }
+    tokens += n;
+    last = now;
+}
+
+void
+TokenTimer::finish()
+{
+    g_metrics.requests.fetch_add(1, std::memory_order_relaxed);
+    g_metrics.generated_tokens.fetch_add(tokens, std::memory_order_relaxed);
+    double elapsed = timespec_tonanos(timespec_sub(last, first)) * 1e-9;
+    if (later_tokens && elapsed > 0)
+        g_metrics.decode_speed.observe(later_tokens / elapsed);
+}
+
+static void
+describe(std::string* out,
+         const char* type,
+         const char* name,
+         const char* help,
+         double value)
+{
+    char buf[256];
+    snprintf(buf,
+             sizeof(buf),
+             "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+             name,
+             help,
+             name,
+             type,
+             name,
+             value);
+    *out += buf;
+}
+
+static void
+describe_queue(std::string* out, Slots* slots)
+{
+    static const char* const kPriorities[PRIORITIES] = {
+        "high",
+        "normal",
+        "batch",
+    };
+    char buf[128];
+    *out += "# HELP llamafile_queue_depth Requests waiting for a slot.\n";
+    *out += "# TYPE llamafile_queue_depth gauge\n";
+    for (int i = 0; i < PRIORITIES; ++i) {
+        snprintf(buf,
+                 sizeof(buf),
+                 "llamafile_queue_depth{priority=\"%s\"} %d\n",
+                 kPriorities[i],
+                 slots->queued_[i].load(std::memory_order_relaxed));
+        *out += buf;
+    }
+}
+
+bool
+Client::metrics()
+{
+    Server* server = worker_->server_;
+    Scheduler* scheduler = server->slots_->scheduler_;
+    unsigned long prompt = g_metrics.prompt_tokens.load();
+    unsigned long cached = g_metrics.cached_tokens.load();
+    ggml_barrier_stats barriers;
+    ggml_get_barrier_stats(&barriers);
+    dump_.clear();
+    describe(&dump_,
+             "counter",
+             "llamafile_requests_total",
+             "Completion requests served.",
+             g_metrics.requests.load());
+    describe(&dump_,
+             "counter",
+             "llamafile_prompt_tokens_total",
+             "Prompt tokens prefilled into slots.",
+             prompt);
+    describe(&dump_,
+             "counter",
+             "llamafile_prompt_tokens_cached_total",
+             "Prompt tokens that were already in the kv cache.",
+             cached);
+    describe(&dump_,
+             "gauge",
+             "llamafile_prefix_hit_ratio",
+             "Fraction of prompt tokens found in the kv cache.",
+             prompt ? (double)cached / prompt : 0);
+    describe(&dump_,
+             "counter",
+             "llamafile_generated_tokens_total",
+             "Tokens generated by completion requests.",
+             g_metrics.generated_tokens.load());
+    describe(&dump_,
+             "counter",
+             "llamafile_requests_shed_total",
+             "Requests that gave up waiting for a slot.",
+             g_metrics.shed.load());
+    describe(&dump_,
+             "counter",
+             "llamafile_requests_abandoned_total",
+             "Requests whose client hung up during generation.",
+             g_metrics.abandoned.load());
+    describe(&dump_,
+             "counter",
+             "llamafile_abandoned_tokens_total",
+             "Tokens generated for clients that hung up.",
+             g_metrics.abandoned_tokens.load());
+    describe(&dump_,
+             "counter",
+             "llamafile_barriers_total",
+             "Times all cpu compute threads had to wait for each other.",
+             barriers.barriers);
+    describe(&dump_,
+             "counter",
+             "llamafile_barriers_skipped_total",
+             "Barriers skipped between independent graph nodes.",
+             barriers.skipped);
+    describe(&dump_,
+             "counter",
+             "llamafile_barrier_wait_seconds_total",
+             "Time cpu compute threads spent idle at barriers.",
+             barriers.wait_ns * 1e-9);
+    describe_queue(&dump_, server->slots_);
+    g_metrics.queue_wait.describe(&dump_,
+                                  "llamafile_queue_wait_seconds",
+                                  "Time spent waiting for a free slot.");
+    g_metrics.prefill_speed.describe(&dump_,
+                                     "llamafile_prefill_tokens_per_second",
+                                     "Prompt evaluation speed of prefills.");
+    g_metrics.decode_speed.describe(&dump_,
+                                    "llamafile_decode_tokens_per_second",
+                                    "Generation speed of requests.");
+    g_metrics.time_to_first_token.describe(
+      &dump_,
+      "llamafile_time_to_first_token_seconds",
+      "Time from receiving a request until its first token.");
+    g_metrics.inter_token_latency.describe(
+      &dump_,
+      "llamafile_inter_token_latency_seconds",
+      "Time between consecutive tokens of a sequence.");
+    if (scheduler) {
+        describe(&dump_,
+                 "gauge",
+                 "llamafile_kv_cells_used",
+                 "Cells of the shared kv cache holding tokens.",
+                 scheduler->kv_used_.load(std::memory_order_relaxed));
+        describe(&dump_,
+                 "gauge",
+                 "llamafile_kv_cells_total",
+                 "Size of the shared kv cache.",
+                 scheduler->kv_size_);
+    }
+    describe(&dump_,
+             "gauge",
+             "llamafile_workers_busy",
+             "Worker threads serving a client.",
+             server->busy_workers.load(std::memory_order_relaxed));
+    describe(&dump_,
+             "gauge",
+             "llamafile_workers_total",
+             "Worker threads.",
+             server->worker_count.load(std::memory_order_relaxed));
+    char* p = append_http_response_message(obuf_.p, 200);
+    p = stpcpy(p, "Content-Type: text/plain; version=0.0.4\r\n");
+    return send_response(obuf_.p, p, dump_);
+}
+
+} // namespace server
+} // namespace lf
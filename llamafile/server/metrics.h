@@ -0,0 +1,67 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "histogram.h"
+#include <atomic>
+#include <ctime>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+// counters exposed by the /metrics endpoint
+//
+// these get updated from the hot paths of every worker, so they're
+// all atomics. things that are cheaper to compute when scraped, such
+// as kv cache occupancy, are read straight from the server instead.
+struct Metrics
+{
+    std::atomic_ulong requests = 0;
+    std::atomic_ulong prompt_tokens = 0;
+    std::atomic_ulong cached_tokens = 0; // prompt tokens already in kv
+    std::atomic_ulong generated_tokens = 0;
+    std::atomic_ulong shed = 0; // requests turned away by slot queue
+    std::atomic_ulong abandoned = 0; // requests whose client hung up
+    std::atomic_ulong abandoned_tokens = 0; // tokens nobody got to read
+    Histogram queue_wait;
+    Histogram prefill_speed;
+    Histogram decode_speed;
+    Histogram time_to_first_token;
+    Histogram inter_token_latency;
+
+    Metrics();
+};
+
+extern Metrics g_metrics;
+
+// times the tokens of a single completion request
+struct TokenTimer
+{
+    timespec started; // when the request message arrived
+    timespec first = {}; // when the first tokens came out
+    timespec last = {}; // when the latest tokens came out
+    unsigned long tokens = 0;
+    unsigned long later_tokens = 0; // tokens after the first step
+
+    explicit TokenTimer(timespec);
+    void step(const std::vector<std::vector<int>>&);
+    void finish();
+};
+
+} // namespace server
+} // namespace lf
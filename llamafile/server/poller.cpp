@@ -0,0 +1,388 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "poller.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/server.h"
+#include <cassert>
+#include <fcntl.h>
+#include <net/http/http.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// maximum number of bytes read from a client at once
+#define READ_SIZE 65536
+
+// maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS 64
+
+namespace lf {
+namespace server {
+
+// returns true if a worker won't need to wait on the client
+//
+// this is the case when the buffer holds a whole http request message,
+// or when it holds enough of one for the worker to reply with an error.
+// clients that say "Expect: 100-continue" won't send their payload til
+// we tell them to, so those are handed off as soon as we have headers.
+bool
+is_message_ready(const char* p, size_t n, size_t c)
+{
+    if (!n)
+        return false;
+    bool ready;
+    HttpMessage msg;
+    InitHttpMessage(&msg, kHttpRequest);
+    int len = ParseHttpMessage(&msg, p, n, c);
+    if (len == -1) {
+        ready = true;
+    } else if (!len) {
+        ready = n >= c;
+    } else if (msg.headers[kHttpExpect].a) {
+        ready = true;
+    } else if (msg.headers[kHttpContentLength].a) {
+        long cl = ParseContentLength(p + msg.headers[kHttpContentLength].a,
+                                     msg.headers[kHttpContentLength].b -
+                                       msg.headers[kHttpContentLength].a);
+        ready = cl == -1 || len + cl > c || len + cl <= n;
+    } else {
+        ready = true;
+    }
+    DestroyHttpMessage(&msg);
+    return ready;
+}
+
+static void
+unlock_poller(void* arg)
+{
+    Poller* poller = (Poller*)arg;
+    pthread_mutex_unlock(&poller->lock_);
+}
+
+static void
+free_connections(Dll** list)
+{
+    Dll* e;
+    while ((e = dll_first(*list))) {
+        dll_remove(list, e);
+        close(CONNECTION(e)->fd);
+        delete CONNECTION(e);
+    }
+}
+
+static void*
+poller_thread(void* arg)
+{
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGHUP);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGQUIT);
+    sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGUSR1);
+    sigaddset(&ss, SIGALRM);
+    pthread_sigmask(SIG_SETMASK, &ss, 0);
+    set_thread_name("poller");
+    ((Poller*)arg)->run();
+    return nullptr;
+}
+
+Poller::Poller(Server* server) : server_(server), scratch_(READ_SIZE)
+{
+}
+
+Poller::~Poller()
+{
+    npassert(!started_);
+    free_connections(&idle_);
+    free_connections(&parking_);
+    free_connections(&ready_);
+    if (epfd_ != -1)
+        close(epfd_);
+    if (wake_[0] != -1)
+        close(wake_[0]);
+    if (wake_[1] != -1)
+        close(wake_[1]);
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+// creates epoll instance and launches thread
+//
+// returns false if the host operating system doesn't have epoll, in
+// which case workers should fall back to calling accept() themselves.
+bool
+Poller::start()
+{
+    if ((epfd_ = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return false;
+    if (pipe2(wake_, O_CLOEXEC)) {
+        SLOG("pipe2 failed %m");
+        return false;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, server_->fd, &ev)) {
+        SLOG("failed to watch listening socket %m");
+        return false;
+    }
+    ev.data.ptr = wake_;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_[0], &ev)) {
+        SLOG("failed to watch wake pipe %m");
+        return false;
+    }
+    int flags = fcntl(server_->fd, F_GETFL);
+    if (fcntl(server_->fd, F_SETFL, flags | O_NONBLOCK)) {
+        SLOG("failed to make listening socket non-blocking %m");
+        return false;
+    }
+    if (pthread_create(&th_, 0, poller_thread, this)) {
+        SLOG("failed to create poller thread");
+        fcntl(server_->fd, F_SETFL, flags);
+        return false;
+    }
+    started_ = true;
+    return true;
+}
+
+void
+Poller::shutdown()
+{
+    if (!started_)
+        return;
+    pthread_cancel(th_);
+    if (pthread_join(th_, 0))
+        __builtin_trap();
+    started_ = false;
+}
+
+// gives idle connection back to poller
+//
+// this is called by workers once a client has no more complete messages
+// buffered. the poller thread is the one that adds it to epoll.
+void
+Poller::park(Connection* conn)
+{
+    pthread_mutex_lock(&lock_);
+    dll_make_last(&parking_, &conn->elem_);
+    pthread_mutex_unlock(&lock_);
+    if (write(wake_[1], "", 1) != 1)
+        SLOG("failed to wake poller %m");
+}
+
+// waits for connection that has a request message ready to be served
+Connection*
+Poller::take()
+{
+    Dll* e;
+    pthread_mutex_lock(&lock_);
+    pthread_cleanup_push(unlock_poller, this);
+    while (!(e = dll_first(ready_)))
+        pthread_cond_wait(&cond_, &lock_);
+    dll_remove(&ready_, e);
+    pthread_cleanup_pop(false);
+    pthread_mutex_unlock(&lock_);
+    return CONNECTION(e);
+}
+
+static timespec
+idle_deadline()
+{
+    return timespec_add(timespec_mono(),
+                        timespec_frommillis(FLAG_idle_timeout * 1000ll));
+}
+
+void
+Poller::watch(Connection* conn)
+{
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    conn->deadline = idle_deadline();
+    idle_bytes_ += conn->buf.size();
+    pthread_mutex_lock(&lock_);
+    dll_make_last(&idle_, &conn->elem_);
+    pthread_mutex_unlock(&lock_);
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, conn->fd, &ev)) {
+        SLOG("epoll_ctl failed %m");
+        drop(conn);
+    }
+}
+
+void
+Poller::drop(Connection* conn)
+{
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->fd, 0);
+    idle_bytes_ -= conn->buf.size();
+    pthread_mutex_lock(&lock_);
+    dll_remove(&idle_, &conn->elem_);
+    pthread_mutex_unlock(&lock_);
+    if (FLAG_verbose >= 2)
+        SLOG("close");
+    close(conn->fd);
+    delete conn;
+}
+
+void
+Poller::accept_client()
+{
+    unsigned ip;
+    int fd = server_->accept(&ip);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            SLOG("accept returned %m");
+        set_thread_name("poller");
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    Connection* conn = new Connection;
+    conn->fd = fd;
+    conn->ip = ip;
+    strlcpy(conn->name, get_thread_name(), sizeof(conn->name));
+    set_thread_name("poller");
+    dll_init(&conn->elem_);
+    watch(conn);
+}
+
+// reads what client sent, and hands it to workers once it's ready
+//
+// level triggered epoll only tells us that a read won't block, so we
+// only call read() once. if there's more, epoll_wait() tells us again.
+// the first bytes of a message restart the client's deadline, so it has
+// --idle-timeout seconds to send the rest of it.
+void
+Poller::receive(Connection* conn)
+{
+    size_t c = FLAG_http_ibuf_size;
+    size_t room = MIN(scratch_.size(), c - conn->buf.size());
+    ssize_t got = read(conn->fd, scratch_.data(), room);
+    if (got <= 0) {
+        if (got == -1 && errno != ECONNRESET)
+            SLOG("read failed %m");
+        drop(conn);
+        return;
+    }
+    if (FLAG_idle_buffer &&
+        idle_bytes_ + got > (size_t)FLAG_idle_buffer * 1024 * 1024) {
+        SLOG("dropping client because --idle-buffer is full");
+        drop(conn);
+        return;
+    }
+    if (conn->buf.empty()) {
+        conn->deadline = idle_deadline();
+        pthread_mutex_lock(&lock_);
+        dll_remove(&idle_, &conn->elem_);
+        dll_make_last(&idle_, &conn->elem_);
+        pthread_mutex_unlock(&lock_);
+    }
+    conn->buf.append(scratch_.data(), got);
+    idle_bytes_ += got;
+    if (!is_message_ready(conn->buf.data(), conn->buf.size(), c))
+        return;
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->fd, 0);
+    idle_bytes_ -= conn->buf.size();
+    pthread_mutex_lock(&lock_);
+    dll_remove(&idle_, &conn->elem_);
+    dll_make_last(&ready_, &conn->elem_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+Poller::adopt_parked()
+{
+    char buf[64];
+    if (read(wake_[0], buf, sizeof(buf)) == -1)
+        SLOG("failed to read wake pipe %m");
+    Dll* list;
+    pthread_mutex_lock(&lock_);
+    list = parking_;
+    parking_ = nullptr;
+    pthread_mutex_unlock(&lock_);
+    Dll* e;
+    while ((e = dll_first(list))) {
+        dll_remove(&list, e);
+        watch(CONNECTION(e));
+    }
+}
+
+// closes connections whose deadline has passed
+void
+Poller::expire()
+{
+    if (!FLAG_idle_timeout)
+        return;
+    Dll* e;
+    timespec now = timespec_mono();
+    while ((e = dll_first(idle_))) {
+        Connection* conn = CONNECTION(e);
+        if (timespec_cmp(conn->deadline, now) > 0)
+            break;
+        if (FLAG_verbose >= 2 || !conn->buf.empty())
+            SLOG("closing connection that exceeded --idle-timeout");
+        drop(conn);
+    }
+}
+
+// returns how long epoll_wait() may block before next deadline
+int
+Poller::wait_millis()
+{
+    Dll* e;
+    if (!FLAG_idle_timeout || !(e = dll_first(idle_)))
+        return -1;
+    timespec now = timespec_mono();
+    timespec deadline = CONNECTION(e)->deadline;
+    if (timespec_cmp(deadline, now) <= 0)
+        return 0;
+    return timespec_tomillis(timespec_sub(deadline, now)) + 1;
+}
+
+void
+Poller::run()
+{
+    int cs;
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd_, events, MAX_EVENTS, wait_millis());
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            SLOG("epoll_wait failed %m");
+            break;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+        for (int i = 0; i < n; ++i) {
+            if (!events[i].data.ptr) {
+                accept_client();
+            } else if (events[i].data.ptr == wake_) {
+                adopt_parked();
+            } else {
+                receive((Connection*)events[i].data.ptr);
+            }
+        }
+        expire();
+        pthread_setcancelstate(cs, 0);
+    }
+}
+
+} // namespace server
+} // namespace lf
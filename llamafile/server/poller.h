@@ -0,0 +1,91 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cosmo.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define CONNECTION(e) DLL_CONTAINER(Connection, elem_, e)
+
+namespace lf {
+namespace server {
+
+struct Server;
+
+// http client connection that isn't being served by a worker
+struct Connection
+{
+    Dll elem_;
+    int fd;
+    unsigned ip;
+    char name[17];
+    timespec deadline; // when poller gives up on it
+    std::string buf; // bytes received but not yet processed
+};
+
+// watches idle connections from a single thread
+//
+// workers used to block in accept() and read(), which meant each
+// keep-alive connection held onto a thread even while it had nothing
+// to say. the poller instead waits on every idle connection using
+// epoll, and only hands a connection to the worker pool once a whole
+// http request message has been received.
+//
+// connections that stay idle, or that take too long to send their
+// message, are closed once --idle-timeout elapses. the bytes buffered
+// across all watched connections are limited by --idle-buffer too, so
+// slow clients can't make the server hold onto unbounded memory.
+struct Poller
+{
+    Server* server_;
+    int epfd_ = -1;
+    int wake_[2] = { -1, -1 };
+    pthread_t th_;
+    bool started_ = false;
+    std::vector<char> scratch_;
+    Dll* idle_ = nullptr; // being watched by epoll, ordered by deadline
+    size_t idle_bytes_ = 0; // bytes buffered by idle connections
+    Dll* parking_ = nullptr; // given back by workers
+    Dll* ready_ = nullptr; // waiting for a worker
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+    explicit Poller(Server*);
+    ~Poller();
+    bool start();
+    void shutdown();
+    void park(Connection*);
+    Connection* take();
+    void run();
+
+  private:
+    void watch(Connection*);
+    void drop(Connection*);
+    void accept_client();
+    void receive(Connection*);
+    void adopt_parked();
+    void expire();
+    int wait_millis();
+};
+
+bool
+is_message_ready(const char*, size_t, size_t);
+
+} // namespace server
+} // namespace lf
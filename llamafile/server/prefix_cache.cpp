@@ -0,0 +1,219 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "prefix_cache.h"
+#include "atom.h"
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Radix tree of prompts whose kv cache is kept around.
+ *
+ * Each edge of the tree holds a run of atoms, along with the range of
+ * kv cache positions where those atoms were decoded. The kv cells are
+ * owned by a sequence id that's reserved for the cache, so they can be
+ * shared with any slot by calling llama_kv_cache_seq_cp(), which only
+ * tags the existing cells as belonging to one more sequence. When an
+ * edge is split, both halves keep the same sequence, since they cover
+ * different positions. This class only does the bookkeeping. It tells
+ * the caller which kv spans need to be copied or removed.
+ */
+
+struct PrefixCache::Node
+{
+    Node* parent = nullptr;
+    std::vector<Atom> atoms;
+    int seq = -1;
+    int pos = 0;
+    int size = 0;
+    unsigned long last_used = 0;
+    std::map<Atom, std::unique_ptr<Node>> children;
+};
+
+PrefixCache::PrefixCache(int first_seq) : root_(new Node), next_seq_(first_seq)
+{
+}
+
+PrefixCache::~PrefixCache()
+{
+    delete root_;
+}
+
+// returns number of kv positions held by cache
+int
+PrefixCache::used() const
+{
+    return used_;
+}
+
+int
+PrefixCache::nodes() const
+{
+    return nodes_;
+}
+
+int
+PrefixCache::alloc_seq()
+{
+    int seq;
+    if (!free_seqs_.empty()) {
+        seq = free_seqs_.back();
+        free_seqs_.pop_back();
+    } else {
+        seq = next_seq_++;
+    }
+    seq_refs_[seq] = 1;
+    return seq;
+}
+
+void
+PrefixCache::free_seq(int seq)
+{
+    if (!--seq_refs_[seq]) {
+        seq_refs_.erase(seq);
+        free_seqs_.push_back(seq);
+    }
+}
+
+// finds longest cached prefix of atoms
+//
+// the kv spans which need to be copied into a sequence to recreate
+// that prefix are appended to spans. returns the number of atoms.
+int
+PrefixCache::lookup(const std::vector<Atom>& atoms, std::vector<KvSpan>* spans)
+{
+    ++tick_;
+    int i = 0;
+    Node* node = root_;
+    while (i < atoms.size()) {
+        auto it = node->children.find(atoms[i]);
+        if (it == node->children.end())
+            break;
+        Node* child = it->second.get();
+        int k = 0;
+        int size = 0;
+        while (k < child->atoms.size() && i + k < atoms.size() &&
+               child->atoms[k] == atoms[i + k])
+            size += child->atoms[k++].ctx_used();
+        child->last_used = tick_;
+        spans->push_back({ child->seq, child->pos, size });
+        i += k;
+        if (k < child->atoms.size())
+            break;
+        node = child;
+    }
+    return i;
+}
+
+// adds atoms to cache
+//
+// if some suffix of atoms isn't in the cache yet, then true is returned
+// and span is set to the positions the caller must copy from the kv of
+// the sequence that evaluated atoms into span->seq.
+bool
+PrefixCache::insert(const std::vector<Atom>& atoms, KvSpan* span)
+{
+    ++tick_;
+    int i = 0;
+    int pos = 0;
+    Node* node = root_;
+    while (i < atoms.size()) {
+        auto it = node->children.find(atoms[i]);
+        if (it == node->children.end())
+            break;
+        Node* child = it->second.get();
+        int k = 0;
+        int size = 0;
+        while (k < child->atoms.size() && i + k < atoms.size() &&
+               child->atoms[k] == atoms[i + k])
+            size += child->atoms[k++].ctx_used();
+        child->last_used = tick_;
+        if (k < child->atoms.size()) {
+            // split edge so the part we have in common becomes its own node
+            Node* mid = new Node;
+            mid->parent = node;
+            mid->atoms.assign(child->atoms.begin(), child->atoms.begin() + k);
+            mid->seq = child->seq;
+            mid->pos = child->pos;
+            mid->size = size;
+            mid->last_used = tick_;
+            ++seq_refs_[child->seq];
+            std::unique_ptr<Node> owned = std::move(it->second);
+            child->atoms.erase(child->atoms.begin(), child->atoms.begin() + k);
+            child->pos += size;
+            child->size -= size;
+            child->parent = mid;
+            mid->children[child->atoms[0]] = std::move(owned);
+            it->second.reset(mid);
+            ++nodes_;
+            child = mid;
+        }
+        i += k;
+        pos += size;
+        node = child;
+    }
+    if (i == atoms.size())
+        return false;
+    Node* leaf = new Node;
+    leaf->parent = node;
+    leaf->atoms.assign(atoms.begin() + i, atoms.end());
+    leaf->seq = alloc_seq();
+    leaf->pos = pos;
+    for (const Atom& atom : leaf->atoms)
+        leaf->size += atom.ctx_used();
+    leaf->last_used = tick_;
+    node->children[leaf->atoms[0]].reset(leaf);
+    used_ += leaf->size;
+    ++nodes_;
+    *span = { leaf->seq, leaf->pos, leaf->size };
+    return true;
+}
+
+// removes least recently used leaf
+//
+// returns false if cache is empty. otherwise span is set to the kv
+// positions the caller needs to remove from span->seq.
+bool
+PrefixCache::evict(KvSpan* span)
+{
+    Node* lru = nullptr;
+    std::vector<Node*> stack = { root_ };
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        for (auto& [atom, child] : node->children) {
+            if (!child->children.empty()) {
+                stack.push_back(child.get());
+            } else if (!lru || child->last_used < lru->last_used) {
+                lru = child.get();
+            }
+        }
+    }
+    if (!lru)
+        return false;
+    *span = { lru->seq, lru->pos, lru->size };
+    used_ -= lru->size;
+    --nodes_;
+    free_seq(lru->seq);
+    Atom key = lru->atoms[0];
+    lru->parent->children.erase(key);
+    return true;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,61 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+class Atom;
+
+// range of kv cache positions held by a sequence
+struct KvSpan
+{
+    int seq;
+    int pos;
+    int size;
+};
+
+class PrefixCache
+{
+  public:
+    explicit PrefixCache(int);
+    ~PrefixCache();
+    int used() const;
+    int nodes() const;
+    int lookup(const std::vector<Atom>&, std::vector<KvSpan>*);
+    bool insert(const std::vector<Atom>&, KvSpan*);
+    bool evict(KvSpan*);
+
+  private:
+    struct Node;
+    Node* root_;
+    int used_ = 0;
+    int nodes_ = 0;
+    int next_seq_;
+    unsigned long tick_ = 0;
+    std::vector<int> free_seqs_;
+    std::map<int, int> seq_refs_;
+    int alloc_seq();
+    void free_seq(int);
+};
+
+} // namespace server
+} // namespace lf
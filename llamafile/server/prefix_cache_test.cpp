@@ -0,0 +1,181 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "prefix_cache.h"
+#include "atom.h"
+#include "image.h"
+#include <cstdlib>
+
+namespace lf {
+namespace server {
+namespace {
+
+std::vector<Atom>
+make(std::initializer_list<int> tokens)
+{
+    std::vector<Atom> atoms;
+    for (int token : tokens)
+        atoms.emplace_back(token);
+    return atoms;
+}
+
+bool
+same(const KvSpan& span, int seq, int pos, int size)
+{
+    return span.seq == seq && span.pos == pos && span.size == size;
+}
+
+void
+test_lookup_empty()
+{
+    PrefixCache cache(10);
+    std::vector<KvSpan> spans;
+    if (cache.lookup(make({ 1, 2, 3 }), &spans) != 0)
+        exit(1);
+    if (!spans.empty())
+        exit(2);
+    KvSpan span;
+    if (cache.evict(&span))
+        exit(3);
+}
+
+void
+test_insert_then_lookup()
+{
+    KvSpan span;
+    PrefixCache cache(10);
+    if (!cache.insert(make({ 1, 2, 3, 4 }), &span))
+        exit(4);
+    if (!same(span, 10, 0, 4))
+        exit(5);
+    if (cache.used() != 4)
+        exit(6);
+    if (cache.insert(make({ 1, 2, 3 }), &span))
+        exit(7);
+    std::vector<KvSpan> spans;
+    if (cache.lookup(make({ 1, 2, 3, 9 }), &spans) != 3)
+        exit(8);
+    if (spans.size() != 1 || !same(spans[0], 10, 0, 3))
+        exit(9);
+}
+
+void
+test_split()
+{
+    KvSpan span;
+    PrefixCache cache(10);
+    cache.insert(make({ 1, 2, 3, 4 }), &span);
+    if (!cache.insert(make({ 1, 2, 5 }), &span))
+        exit(10);
+    if (!same(span, 11, 2, 1))
+        exit(11);
+    if (cache.used() != 5)
+        exit(12);
+    if (cache.nodes() != 3)
+        exit(13);
+    std::vector<KvSpan> spans;
+    if (cache.lookup(make({ 1, 2, 5, 6 }), &spans) != 3)
+        exit(14);
+    if (spans.size() != 2)
+        exit(15);
+    if (!same(spans[0], 10, 0, 2) || !same(spans[1], 11, 2, 1))
+        exit(16);
+    spans.clear();
+    if (cache.lookup(make({ 1, 2, 3, 4 }), &spans) != 4)
+        exit(17);
+    if (!same(spans[0], 10, 0, 2) || !same(spans[1], 10, 2, 2))
+        exit(18);
+}
+
+void
+test_evict_lru()
+{
+    KvSpan span;
+    PrefixCache cache(10);
+    cache.insert(make({ 1, 2, 3, 4 }), &span);
+    cache.insert(make({ 1, 2, 5 }), &span);
+    std::vector<KvSpan> spans;
+    cache.lookup(make({ 1, 2, 3 }), &spans);
+    if (!cache.evict(&span))
+        exit(19);
+    if (!same(span, 11, 2, 1))
+        exit(20);
+    if (!cache.evict(&span))
+        exit(21);
+    if (!same(span, 10, 2, 2))
+        exit(22);
+    if (!cache.evict(&span))
+        exit(23);
+    if (!same(span, 10, 0, 2))
+        exit(24);
+    if (cache.used() || cache.nodes())
+        exit(25);
+    if (cache.evict(&span))
+        exit(26);
+
+    // sequence ids get recycled
+    if (!cache.insert(make({ 7 }), &span))
+        exit(27);
+    if (span.seq != 10 && span.seq != 11)
+        exit(28);
+}
+
+void
+test_images()
+{
+    KvSpan span;
+    PrefixCache cache(0);
+    std::vector<Atom> atoms = make({ 1 });
+    atoms.emplace_back(new Image("hello", 100));
+    atoms.emplace_back(2);
+    if (!cache.insert(atoms, &span))
+        exit(29);
+    if (!same(span, 0, 0, 102))
+        exit(30);
+    std::vector<Atom> other = make({ 1 });
+    other.emplace_back(new Image("there", 100));
+    std::vector<KvSpan> spans;
+    if (cache.lookup(other, &spans) != 1)
+        exit(31);
+    if (!same(spans[0], 0, 0, 1))
+        exit(32);
+    atoms.back() = Atom(3);
+    if (!cache.insert(atoms, &span))
+        exit(33);
+    if (!same(span, 1, 101, 1))
+        exit(34);
+}
+
+void
+prefix_cache_test()
+{
+    test_lookup_empty();
+    test_insert_then_lookup();
+    test_split();
+    test_evict_lru();
+    test_images();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::prefix_cache_test();
+}
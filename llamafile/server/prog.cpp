@@ -18,7 +18,10 @@
 #include "llama.cpp/llama.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/pool.h"
+#include "llamafile/server/assets.h"
+#include "llamafile/server/embedder.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/signals.h"
 #include "llamafile/server/slots.h"
@@ -68,6 +71,10 @@ main(int argc, char* argv[])
     if (!llamafile_has(argv, "--verbose"))
         FLAG_log_disable = true;
 
+    // must happen before the model is loaded
+    if (FLAG_numa)
+        llama_numa_init((enum ggml_numa_strategy)FLAG_numa);
+
     // load model
     llama_model_params mparams = {
         .n_gpu_layers = FLAG_n_gpu_layers,
@@ -89,21 +96,41 @@ main(int argc, char* argv[])
         exit(1);
     }
 
+    // load draft model for speculative decoding
+    llama_model* draft_model = nullptr;
+    if (FLAG_draft_model) {
+        draft_model = llama_load_model_from_file(FLAG_draft_model, mparams);
+        if (!draft_model) {
+            fprintf(stderr, "%s: failed to load model\n", FLAG_draft_model);
+            exit(1);
+        }
+    }
+
     // create slots
-    Slots* slots = new Slots(model);
+    Slots* slots = new Slots(model, draft_model);
     if (!slots->start(FLAG_slots)) {
         SLOG("no slots could be created");
         exit(1);
     }
 
+    // create embedding context pool
+    Embedder* embedder = new Embedder(model);
+
     // create server
     if (FLAG_workers <= 0)
         FLAG_workers = __get_cpu_count() + 4;
     if (FLAG_workers <= 0)
         FLAG_workers = 16;
     set_thread_name("server");
-    g_server =
-      new Server(create_listening_socket(FLAG_listen, 0, 0), slots, model);
+    g_server = new Server(
+      create_listening_socket(FLAG_listen, 0, 0), slots, embedder, model);
+    Poller* poller = new Poller(g_server);
+    if (poller->start()) {
+        g_server->poller_ = poller;
+    } else {
+        SLOG("epoll unavailable; idle connections will hold a worker each");
+        delete poller;
+    }
     for (int i = 0; i < FLAG_workers; ++i)
         npassert(!g_server->spawn());
 
@@ -119,8 +146,13 @@ main(int argc, char* argv[])
     g_server->shutdown();
     g_server->close();
     delete g_server;
+    slots->save();
     delete slots;
+    if (draft_model)
+        llama_free_model(draft_model);
+    delete embedder;
     llama_free_model(model);
+    assets_destroy();
     tokenbucket_destroy();
     time_destroy();
     SLOG("exit");
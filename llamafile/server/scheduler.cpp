@@ -0,0 +1,533 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scheduler.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include "llamafile/version.h"
+#include <cassert>
+#include <cosmo.h>
+#include <cstring>
+#include <signal.h>
+
+namespace lf {
+namespace server {
+
+struct Waiter
+{
+    Scheduler* scheduler;
+    Job* const* jobs;
+    int count;
+    bool locked;
+};
+
+static int
+choose_ctx_size(llama_model* model)
+{
+    int n_ctx_train = llama_n_ctx_train(model);
+    if (FLAG_ctx_size <= 0 || FLAG_ctx_size > n_ctx_train)
+        return n_ctx_train;
+    return FLAG_ctx_size;
+}
+
+static std::string
+generate_system_fingerprint(const llama_context_params* cparams)
+{
+    uint64_t h = 0;
+    h ^= __fnv(LLAMAFILE_VERSION_STRING, sizeof(LLAMAFILE_VERSION_STRING));
+    h ^= __fnv(cparams, sizeof(*cparams));
+    std::string b = "fp_";
+    for (int j = 0; j < 64 / 5; ++j) {
+        b += "abcdefghijklmnopqrstuvwxyz012345"[h & 31];
+        h >>= 5;
+    }
+    return b;
+}
+
+static void*
+scheduler_thread(void* arg)
+{
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGHUP);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGQUIT);
+    sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGUSR1);
+    sigaddset(&ss, SIGALRM);
+    pthread_sigmask(SIG_SETMASK, &ss, 0);
+    set_thread_name("scheduler");
+    ((Scheduler*)arg)->run();
+    return nullptr;
+}
+
+// runs if a client thread is cancelled while it waits on the decoder
+//
+// if a job has already been put into a batch, then the scheduler
+// thread might still be reading its tokens or writing to its logits
+// buffer, both of which live in memory owned by the client, so we'll
+// need to wait for that to finish before unwinding the stack.
+static void
+abandon_job(void* arg)
+{
+    Waiter* w = (Waiter*)arg;
+    if (!w->locked)
+        pthread_mutex_lock(&w->scheduler->lock_);
+    for (int i = 0; i < w->count; ++i) {
+        Job* job = w->jobs[i];
+        while (job->in_flight)
+            pthread_cond_wait(&w->scheduler->done_, &w->scheduler->lock_);
+        if (!job->done)
+            dll_remove(&w->scheduler->jobs_, &job->elem_);
+    }
+    pthread_mutex_unlock(&w->scheduler->lock_);
+}
+
+Scheduler::Scheduler(llama_model* model) : model_(model)
+{
+}
+
+Scheduler::~Scheduler()
+{
+    shutdown();
+    if (ctx_)
+        llama_free(ctx_);
+    pthread_mutex_destroy(&ctx_lock_);
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&done_);
+    pthread_cond_destroy(&cond_);
+}
+
+// creates shared context
+//
+// each of the n_seq sequences gets its own ctx_size_ worth of the kv
+// cache, and then an extra number of cells are added on top, e.g. for
+// the prefix cache. if ctx_size isn't specified, then it's chosen via
+// the model and flags.
+bool
+Scheduler::start(int n_seq, int extra, int ctx_size)
+{
+    unassert(!ctx_);
+    unassert(n_seq > 0);
+    ctx_size_ = ctx_size > 0 ? ctx_size : choose_ctx_size(model_);
+    llama_context_params cparams = {};
+    cparams.embeddings = false;
+    cparams.embeddings_only = false;
+    cparams.logits_all = false;
+    cparams.seed = 12345;
+    cparams.n_ctx = ctx_size_ * n_seq + extra;
+    cparams.n_batch = FLAG_batch;
+    cparams.n_ubatch = FLAG_ubatch;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = MIN(FLAG_threads, 20);
+    cparams.n_threads_batch = FLAG_threads;
+    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
+    cparams.rope_freq_base = 0;
+    cparams.yarn_ext_factor = -1;
+    cparams.yarn_attn_factor = 1;
+    cparams.yarn_beta_fast = 32;
+    cparams.yarn_beta_slow = 1;
+    cparams.yarn_orig_ctx = 0;
+    cparams.defrag_thold = n_seq > 1 ? .1 : -1;
+    cparams.offload_kqv = true;
+    cparams.type_k = (ggml_type)FLAG_cache_type_k;
+    cparams.type_v = (ggml_type)FLAG_cache_type_v;
+    cparams.flash_attn = FLAG_flash_attn;
+    system_fingerprint_ = generate_system_fingerprint(&cparams);
+    if (!(ctx_ = llama_new_context_with_model(model_, cparams)))
+        return false;
+    n_vocab_ = llama_n_vocab(model_);
+    n_embd_ = llama_n_embd(model_);
+    n_batch_ = llama_n_batch(ctx_);
+    kv_size_ = llama_n_ctx(ctx_);
+    can_shift_ = !ggml_is_quantized(cparams.type_k);
+    if (pthread_create(&thread_, 0, scheduler_thread, this))
+        return false;
+    started_ = true;
+    return true;
+}
+
+void
+Scheduler::shutdown()
+{
+    if (!started_)
+        return;
+    pthread_mutex_lock(&lock_);
+    terminated_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    if (pthread_join(thread_, 0))
+        __builtin_trap();
+    started_ = false;
+}
+
+bool
+Scheduler::seq_rm(int seq, int p0, int p1)
+{
+    pthread_mutex_lock(&ctx_lock_);
+    bool ok = llama_kv_cache_seq_rm(ctx_, seq, p0, p1);
+    kv_used_ = llama_get_kv_cache_used_cells(ctx_);
+    pthread_mutex_unlock(&ctx_lock_);
+    return ok;
+}
+
+void
+Scheduler::seq_add(int seq, int p0, int p1, int delta)
+{
+    pthread_mutex_lock(&ctx_lock_);
+    llama_kv_cache_seq_add(ctx_, seq, p0, p1, delta);
+    kv_used_ = llama_get_kv_cache_used_cells(ctx_);
+    pthread_mutex_unlock(&ctx_lock_);
+}
+
+void
+Scheduler::seq_cp(int src, int dst, int p0, int p1)
+{
+    pthread_mutex_lock(&ctx_lock_);
+    llama_kv_cache_seq_cp(ctx_, src, dst, p0, p1);
+    kv_used_ = llama_get_kv_cache_used_cells(ctx_);
+    pthread_mutex_unlock(&ctx_lock_);
+}
+
+bool
+Scheduler::seq_save(int seq, const char* path, const std::vector<int>& tokens)
+{
+    pthread_mutex_lock(&ctx_lock_);
+    size_t rc = llama_state_seq_save_file(
+      ctx_, path, seq, tokens.data(), tokens.size());
+    pthread_mutex_unlock(&ctx_lock_);
+    return rc > 0;
+}
+
+bool
+Scheduler::seq_load(int seq, const unsigned char* data, size_t size)
+{
+    pthread_mutex_lock(&ctx_lock_);
+    size_t rc = llama_state_seq_set_data(ctx_, data, size, seq);
+    kv_used_ = llama_get_kv_cache_used_cells(ctx_);
+    pthread_mutex_unlock(&ctx_lock_);
+    return rc > 0;
+}
+
+// submits job to scheduler and blocks until it's been decoded
+//
+// prefill jobs may be of any length, since they'll be decoded across
+// as many steps as needed, and progress is reported after each step.
+// other jobs must fit in a single batch. if the job asks for logits,
+// then n_vocab_ floats for each of its final n_logits tokens will be
+// copied there. the llama_decode() result is returned. on error, the
+// tokens of the failed step are removed from the kv cache, so that
+// job->processed tells how many tokens it holds.
+int
+Scheduler::decode(Job* job, const ProgressCallback& progress)
+{
+    unassert(job->n > 0);
+    unassert(job->prefill || job->embd || job->n <= n_batch_);
+    Waiter w = { this, &job, 1, true };
+    job->rc = 0;
+    job->processed = 0;
+    job->taken = 0;
+    job->done = false;
+    job->in_flight = false;
+    dll_init(&job->elem_);
+    pthread_mutex_lock(&lock_);
+    if (terminated_) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+    }
+    dll_make_last(&jobs_, &job->elem_);
+    pthread_cond_signal(&cond_);
+    pthread_cleanup_push(abandon_job, &w);
+    int reported = 0;
+    for (;;) {
+        if (progress && job->processed != reported) {
+            reported = job->processed;
+            w.locked = false;
+            pthread_mutex_unlock(&lock_);
+            progress(reported, job->n);
+            pthread_mutex_lock(&lock_);
+            w.locked = true;
+            continue;
+        }
+        if (job->done)
+            break;
+        pthread_cond_wait(&done_, &lock_);
+    }
+    pthread_cleanup_pop(false);
+    pthread_mutex_unlock(&lock_);
+    return job->rc;
+}
+
+// submits several jobs at once and blocks until all are decoded
+//
+// this is used to advance forked sequences in lockstep. the jobs are
+// queued together, so they'll end up in the same batch as long as the
+// sum of their tokens fits. returns nonzero if any job failed.
+int
+Scheduler::decode(const std::vector<Job*>& jobs)
+{
+    Waiter w = { this, jobs.data(), (int)jobs.size(), true };
+    for (Job* job : jobs) {
+        unassert(job->n > 0);
+        unassert(!job->prefill && !job->embd && job->n <= n_batch_);
+        job->rc = 0;
+        job->processed = 0;
+        job->taken = 0;
+        job->done = false;
+        job->in_flight = false;
+        dll_init(&job->elem_);
+    }
+    pthread_mutex_lock(&lock_);
+    if (terminated_) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+    }
+    for (Job* job : jobs)
+        dll_make_last(&jobs_, &job->elem_);
+    pthread_cond_signal(&cond_);
+    pthread_cleanup_push(abandon_job, &w);
+    for (;;) {
+        bool finished = true;
+        for (Job* job : jobs)
+            finished &= job->done;
+        if (finished)
+            break;
+        pthread_cond_wait(&done_, &lock_);
+    }
+    pthread_cleanup_pop(false);
+    pthread_mutex_unlock(&lock_);
+    int rc = 0;
+    for (Job* job : jobs)
+        rc |= job->rc;
+    return rc;
+}
+
+// chooses what to decode in the next step
+void
+Scheduler::pick()
+{
+    picked_.clear();
+
+    // clients waiting on their next token go first
+    int n_tokens = 0;
+    for (Dll* e = dll_first(jobs_); e; e = dll_next(jobs_, e)) {
+        Job* job = JOB(e);
+        if (job->prefill || job->embd)
+            continue;
+        if (n_tokens + job->n > n_batch_)
+            continue;
+        job->taken = job->n;
+        job->in_flight = true;
+        n_tokens += job->n;
+        picked_.push_back(job);
+    }
+
+    // prompts get the rest, in turns
+    //
+    // if nobody is waiting to generate a token then prompts may use
+    // the whole batch. jobs holding image embeddings can't be mixed
+    // with tokens in a llama_batch, so step() decodes them separately
+    // and we only allow one of them per step.
+    int budget = n_batch_ - n_tokens;
+    if (n_tokens && FLAG_prefill_budget > 0)
+        budget = MIN(budget, FLAG_prefill_budget);
+    bool have_embd = false;
+    for (Dll* e = dll_first(jobs_); e && budget > 0; e = dll_next(jobs_, e)) {
+        Job* job = JOB(e);
+        if (!job->prefill && !job->embd)
+            continue;
+        if (job->embd && have_embd)
+            continue;
+        have_embd |= !!job->embd;
+        job->taken = MIN(job->n - job->processed, budget);
+        job->in_flight = true;
+        budget -= job->taken;
+        picked_.push_back(job);
+    }
+}
+
+void
+Scheduler::run()
+{
+    llama_batch batch = llama_batch_init(n_batch_, 0, 1);
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (!terminated_ && dll_is_empty(jobs_))
+            pthread_cond_wait(&cond_, &lock_);
+        if (terminated_)
+            break;
+        pick();
+        pthread_mutex_unlock(&lock_);
+        step(&batch);
+        pthread_mutex_lock(&lock_);
+        for (Job* job : picked_) {
+            job->in_flight = false;
+            if (!job->rc)
+                job->processed += job->taken;
+            if (job->rc || job->processed == job->n) {
+                dll_remove(&jobs_, &job->elem_);
+                job->done = true;
+            } else {
+                // unfinished prompts go to the back of the line
+                dll_remove(&jobs_, &job->elem_);
+                dll_make_last(&jobs_, &job->elem_);
+            }
+        }
+        pthread_cond_broadcast(&done_);
+    }
+
+    // wake up anyone still waiting
+    for (Dll* e; (e = dll_first(jobs_));) {
+        dll_remove(&jobs_, e);
+        JOB(e)->rc = -1;
+        JOB(e)->done = true;
+    }
+    pthread_cond_broadcast(&done_);
+    pthread_mutex_unlock(&lock_);
+    llama_batch_free(batch);
+}
+
+// removes tokens [i,i+n) of batch from the kv cache
+//
+// llama_decode() splits a batch into ubatches, and the ones that came
+// before a failure have already been committed to the kv cache.
+void
+Scheduler::unwind(const llama_batch* batch, int i, int n)
+{
+    for (int j = i; j < i + n;) {
+        int k = j + 1;
+        while (k < i + n && batch->seq_id[k][0] == batch->seq_id[j][0] &&
+               batch->pos[k] == batch->pos[k - 1] + 1)
+            ++k;
+        llama_kv_cache_seq_rm(
+          ctx_, batch->seq_id[j][0], batch->pos[j], batch->pos[k - 1] + 1);
+        j = k;
+    }
+}
+
+// decodes the jobs chosen by pick()
+void
+Scheduler::step(llama_batch* batch)
+{
+    // lay out the tokens
+    int n_tokens = 0;
+    Job* embd_job = nullptr;
+    starts_.clear();
+    for (Job* job : picked_) {
+        starts_.push_back(n_tokens);
+        if (job->embd) {
+            embd_job = job;
+            continue;
+        }
+        for (int j = 0; j < job->taken; ++j, ++n_tokens) {
+            int k = job->processed + j;
+            batch->token[n_tokens] = job->tokens[k];
+            batch->pos[n_tokens] = job->pos + k;
+            batch->n_seq_id[n_tokens] = 1;
+            batch->seq_id[n_tokens][0] = job->seq;
+            batch->logits[n_tokens] =
+              job->logits && k >= job->n - job->n_logits;
+        }
+    }
+
+    // run the model on the tokens
+    //
+    // when llama_decode() returns 1, the kv cache had no room for the
+    // batch, which is recoverable. like upstream's server, we take back
+    // what got in, and retry with half as many tokens. if there's no
+    // room for a single token, then only the job owning it fails.
+    pthread_mutex_lock(&ctx_lock_);
+    for (int i = 0, n = n_tokens; i < n_tokens;) {
+        n = MIN(n, n_tokens - i);
+        llama_batch b = *batch;
+        b.n_tokens = n;
+        b.token += i;
+        b.pos += i;
+        b.n_seq_id += i;
+        b.seq_id += i;
+        b.logits += i;
+        int rc = llama_decode(ctx_, b);
+        if (rc == 1 && n > 1) {
+            unwind(batch, i, n);
+            n /= 2;
+            continue;
+        }
+        if (rc)
+            SLOG("llama_decode of %d tokens failed with %d", n, rc);
+        int end = i + n;
+        for (size_t x = 0; x < picked_.size(); ++x) {
+            Job* job = picked_[x];
+            int start = starts_[x];
+            if (job->embd || start + job->taken <= i || start >= i + n)
+                continue;
+            if (rc) {
+                // skip the rest of its tokens too
+                job->rc = rc;
+                unwind(batch, start, job->taken);
+                end = MAX(end, start + job->taken);
+                continue;
+            }
+            int lo = MAX(start, i);
+            int hi = MIN(start + job->taken, i + n);
+            for (int k = lo; job->logits && k < hi; ++k) {
+                int row = job->processed + (k - start) -
+                          (job->n - job->n_logits);
+                if (row >= 0)
+                    memcpy(job->logits + (size_t)row * n_vocab_,
+                           llama_get_logits_ith(ctx_, k - i),
+                           n_vocab_ * sizeof(float));
+            }
+        }
+        i = end;
+    }
+
+    // run the model on the image
+    if (embd_job) {
+        Job* job = embd_job;
+        for (int j = 0; j < job->taken; ++j) {
+            int k = job->processed + j;
+            batch->pos[j] = job->pos + k;
+            batch->n_seq_id[j] = 1;
+            batch->seq_id[j][0] = job->seq;
+            batch->logits[j] = job->logits && k == job->n - 1;
+        }
+        llama_batch b = *batch;
+        b.n_tokens = job->taken;
+        b.token = nullptr;
+        b.embd = (float*)job->embd + (size_t)job->processed * n_embd_;
+        job->rc = llama_decode(ctx_, b);
+        if (job->rc) {
+            SLOG("llama_decode of %d embeddings failed with %d",
+                 job->taken,
+                 job->rc);
+            unwind(batch, 0, job->taken);
+        } else if (job->logits && job->processed + job->taken == job->n)
+            memcpy(job->logits,
+                   llama_get_logits_ith(ctx_, job->taken - 1),
+                   n_vocab_ * sizeof(float));
+    }
+    kv_used_ = llama_get_kv_cache_used_cells(ctx_);
+    pthread_mutex_unlock(&ctx_lock_);
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,114 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <atomic>
+#include <cosmo.h>
+#include <functional>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define JOB(e) DLL_CONTAINER(Job, elem_, e)
+
+struct llama_batch;
+struct llama_context;
+struct llama_model;
+
+namespace lf {
+namespace server {
+
+using ProgressCallback = std::function<void(int processed, int total)>;
+
+// request to decode tokens or embeddings into a single kv sequence
+struct Job
+{
+    Dll elem_;
+    int seq;
+    int pos;
+    int n;
+    const int* tokens = nullptr;
+    const float* embd = nullptr;
+    float* logits = nullptr;
+    int n_logits = 1;
+    bool prefill = false;
+    int processed = 0;
+    int taken = 0;
+    int rc = 0;
+    bool done = false;
+    bool in_flight = false;
+};
+
+// decodes all active slots using one shared llama_context
+//
+// each slot owns a sequence id in the shared kv cache. rather than
+// calling llama_decode() on its own context, a slot submits a job
+// to the scheduler and sleeps. the scheduler thread gathers all the
+// pending jobs into a single llama_batch, so if twenty clients each
+// want their next token, the model weights only need to be streamed
+// through memory once instead of twenty times.
+//
+// prompts are split up so they can't hog the batch. each step first
+// takes the pending decode jobs, which are usually a single token for
+// a client that's waiting on its next token, and then fills up what's
+// left with up to FLAG_prefill_budget prompt tokens. prompts take turns
+// so a 30,000 token document won't starve another user's short prompt.
+struct Scheduler
+{
+    llama_model* model_;
+    llama_context* ctx_ = nullptr;
+    int ctx_size_ = 0;
+    int n_vocab_ = 0;
+    int n_embd_ = 0;
+    int n_batch_ = 0;
+    bool can_shift_ = true; // kv cells may be moved by seq_add
+    int kv_size_ = 0;
+    std::atomic_int kv_used_ = 0; // updated whenever kv cache changes
+    std::string system_fingerprint_;
+
+    pthread_t thread_;
+    bool started_ = false;
+    bool terminated_ = false;
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t done_ = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t ctx_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    Dll* jobs_ = nullptr;
+    std::vector<Job*> picked_;
+    std::vector<int> starts_; // where each picked job begins in batch
+
+    explicit Scheduler(llama_model*);
+    ~Scheduler();
+    bool start(int, int, int = 0);
+    void shutdown();
+    int decode(Job*, const ProgressCallback& = nullptr);
+    int decode(const std::vector<Job*>&);
+    bool seq_rm(int, int, int);
+    void seq_add(int, int, int, int);
+    void seq_cp(int, int, int, int);
+    bool seq_save(int, const char*, const std::vector<int>&);
+    bool seq_load(int, const unsigned char*, size_t);
+    void run();
+
+  private:
+    void pick();
+    void step(llama_batch*);
+    void unwind(const llama_batch*, int, int);
+};
+
+} // namespace server
+} // namespace lf
@@ -19,6 +19,7 @@
 #include "llamafile/crash.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/slots.h"
 #include "llamafile/server/worker.h"
@@ -33,8 +34,8 @@
 namespace lf {
 namespace server {
 
-Server::Server(int fd, Slots* slots, llama_model* model)
-  : fd(fd), slots_(slots), model_(model)
+Server::Server(int fd, Slots* slots, Embedder* embedder, llama_model* model)
+  : fd(fd), slots_(slots), embedder_(embedder), model_(model)
 {
 }
 
@@ -44,6 +45,7 @@ Server::~Server()
     npassert(!worker_count.load(std::memory_order_relaxed));
     npassert(dll_is_empty(active_workers));
     npassert(dll_is_empty(idle_workers));
+    delete poller_;
     pthread_mutex_destroy(&lock_);
     pthread_cond_destroy(&cond_);
 }
@@ -184,6 +186,10 @@ Server::shutdown()
     if (IsWindows())
         close();
 
+    // stop accepting connections
+    if (poller_)
+        poller_->shutdown();
+
     // kill workers
     lock();
     for (Dll* e = dll_first(idle_workers); e; e = dll_next(idle_workers, e))
@@ -25,11 +25,13 @@ struct llama_model;
 namespace lf {
 namespace server {
 
+struct Embedder;
+struct Poller;
 struct Slots;
 
 struct Server
 {
-    Server(int, Slots*, llama_model*);
+    Server(int, Slots*, Embedder*, llama_model*);
     ~Server();
 
     int accept(unsigned*);
@@ -45,12 +47,15 @@ struct Server
 
     int fd;
     Slots* slots_;
+    Embedder* embedder_;
     llama_model* model_;
+    Poller* poller_ = nullptr;
     Dll* idle_workers = nullptr;
     Dll* active_workers = nullptr;
     pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
     pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
     std::atomic_int worker_count = ATOMIC_VAR_INIT(0);
+    std::atomic_int busy_workers = ATOMIC_VAR_INIT(0);
     std::atomic_bool terminated = ATOMIC_VAR_INIT(false);
 };
 
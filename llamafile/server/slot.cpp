@@ -18,46 +18,27 @@
 #include "slot.h"
 #include "llama.cpp/llava/clip.h"
 #include "llama.cpp/llava/llava.h"
+#include "llama.cpp/sampling.h"
 #include "llamafile/image.h"
 #include "llamafile/llama.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
 #include "llamafile/server/image.h"
+#include "llamafile/server/image_cache.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/scheduler.h"
 #include "llamafile/server/utils.h"
 #include "llamafile/vector.h"
-#include "llamafile/version.h"
 #include <algorithm>
 #include <cassert>
 #include <cosmo.h>
+#include <cstring>
 
 namespace lf {
 namespace server {
 
-static int
-choose_ctx_size(llama_model* model)
-{
-    int n_ctx_train = llama_n_ctx_train(model);
-    if (FLAG_ctx_size <= 0 || FLAG_ctx_size > n_ctx_train)
-        return n_ctx_train;
-    return FLAG_ctx_size;
-}
-
-static std::string
-generate_system_fingerprint(const llama_context_params* cparams)
-{
-    uint64_t h = 0;
-    h ^= __fnv(LLAMAFILE_VERSION_STRING, sizeof(LLAMAFILE_VERSION_STRING));
-    h ^= __fnv(cparams, sizeof(*cparams));
-    std::string b = "fp_";
-    for (int j = 0; j < 64 / 5; ++j) {
-        b += "abcdefghijklmnopqrstuvwxyz012345"[h & 31];
-        h >>= 5;
-    }
-    return b;
-}
-
 const char*
 Slot::describe_error(int err)
 {
@@ -79,7 +60,8 @@ Slot::describe_error(int err)
     }
 }
 
-Slot::Slot(int id, llama_model* model) : id_(id), model_(model)
+Slot::Slot(int id, Scheduler* scheduler, Scheduler* draft)
+  : id_(id), model_(scheduler->model_), scheduler_(scheduler), draft_(draft)
 {
     dll_init(&elem_);
     last_used_ = time(0);
@@ -87,8 +69,6 @@ Slot::Slot(int id, llama_model* model) : id_(id), model_(model)
 
 Slot::~Slot()
 {
-    if (ctx_)
-        llama_free(ctx_);
     if (clip_ctx_)
         clip_free(clip_ctx_);
 }
@@ -97,34 +77,12 @@ bool
 Slot::start()
 {
     unassert(!ctx_);
-    llama_context_params cparams = {};
-    cparams.embeddings = false;
-    cparams.embeddings_only = false;
-    cparams.logits_all = false;
-    cparams.seed = 12345;
-    cparams.n_ctx = choose_ctx_size(model_);
-    cparams.n_batch = FLAG_batch;
-    cparams.n_ubatch = FLAG_ubatch;
-    cparams.n_seq_max = 1;
-    cparams.n_threads = MIN(FLAG_threads, 20);
-    cparams.n_threads_batch = FLAG_threads;
-    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
-    cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
-    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
-    cparams.rope_freq_base = 0;
-    cparams.yarn_ext_factor = -1;
-    cparams.yarn_attn_factor = 1;
-    cparams.yarn_beta_fast = 32;
-    cparams.yarn_beta_slow = 1;
-    cparams.yarn_orig_ctx = 0;
-    cparams.defrag_thold = -1;
-    cparams.offload_kqv = true;
-    cparams.type_k = GGML_TYPE_F16;
-    cparams.type_v = GGML_TYPE_F16;
-    cparams.flash_attn = FLAG_flash_attn;
-    system_fingerprint_ = generate_system_fingerprint(&cparams);
-    if (!(ctx_ = llama_new_context_with_model(model_, cparams)))
+    if (!(ctx_ = scheduler_->ctx_))
         return false;
+    logits_.resize(scheduler_->n_vocab_);
+    if (draft_)
+        draft_logits_.resize(draft_->n_vocab_);
+    system_fingerprint_ = scheduler_->system_fingerprint_;
     if (FLAG_mmproj)
         if (!(clip_ctx_ = clip_model_load(FLAG_mmproj, FLAG_verbose)))
             return false;
@@ -134,7 +92,7 @@ Slot::start()
 int
 Slot::ctx_size() const
 {
-    return llama_n_ctx(ctx_);
+    return scheduler_->ctx_size_;
 }
 
 int
@@ -164,70 +122,78 @@ Slot::eval_tokens(const std::vector<int>& tokens,
     int used = ctx_used();
     if (used + N > ctx_size())
         return out_of_context;
-    std::vector<int> toks(tokens);
-    int processed = 0;
-    for (int i = 0; i < N; i += FLAG_batch) {
-        int n_eval = N - i;
-        if (n_eval > FLAG_batch)
-            n_eval = FLAG_batch;
-        if (llama_decode(ctx_,
-                         { .n_tokens = n_eval,
-                           .token = &toks[i],
-                           .all_pos_0 = used,
-                           .all_pos_1 = 1 }))
-            return decode_token_failed;
-        for (int j = 0; j < n_eval; ++j)
-            history_.emplace_back(toks[i + j]);
-        used += n_eval;
-        processed += n_eval;
-        if (progress)
-            progress(processed, N);
-    }
+    Job job;
+    job.seq = id_;
+    job.pos = used;
+    job.n = N;
+    job.tokens = tokens.data();
+    job.logits = logits_.data();
+    job.prefill = N > 1;
+    int rc = scheduler_->decode(&job, progress);
+    for (int i = 0; i < job.processed; ++i)
+        history_.emplace_back(tokens[i]);
+    if (rc)
+        return decode_token_failed;
     return N;
 }
 
+// returns clip embedding of image, or null on error
+//
+// the image cache is consulted before encoding. the embedding is held
+// in embeds_ until eval_atoms() is done, so callers get a borrowed
+// pointer, which can't be leaked if the thread is cancelled.
+llava_image_embed*
+Slot::encode_image(const Image& image)
+{
+    for (const auto& e : embeds_)
+        if (e.first == image)
+            return e.second.get();
+    std::shared_ptr<llava_image_embed> embed;
+    if (image_cache_)
+        embed = image_cache_->lookup(image);
+    if (!embed) {
+        llava_image_embed* image_embed = llava_image_embed_make_with_bytes(
+          clip_ctx_,
+          FLAG_threads_batch,
+          (const unsigned char*)image.bytes().data(),
+          image.bytes().size());
+        if (!image_embed)
+            return nullptr;
+        embed.reset(image_embed, llava_image_embed_free);
+        if (image_cache_)
+            image_cache_->insert(image,
+                                 embed,
+                                 (size_t)image_embed->n_image_pos *
+                                   clip_n_mmproj_embd(clip_ctx_) *
+                                   sizeof(float));
+    }
+    embeds_.emplace_back(image, embed);
+    return embed.get();
+}
+
 int
-Slot::eval_image(const std::string_view& bytes,
-                 const ProgressCallback& progress)
+Slot::eval_image(const Image& image, const ProgressCallback& progress)
 {
     if (!ctx_)
         return uninitialized;
     if (!clip_ctx_)
         return no_vision_model;
-    llava_image_embed* image_embed =
-      llava_image_embed_make_with_bytes(clip_ctx_,
-                                        FLAG_threads_batch,
-                                        (const unsigned char*)bytes.data(),
-                                        bytes.size());
-    if (!image_embed)
+    llava_image_embed* image_embed;
+    if (!(image_embed = encode_image(image)))
         return encode_image_failed;
     int used = ctx_used();
     int N = image_embed->n_image_pos;
-    if (used + N > ctx_size()) {
-        llava_image_embed_free(image_embed);
+    if (used + N > ctx_size())
         return out_of_context;
-    }
-    int processed = 0;
-    int n_embd = llama_n_embd(llama_get_model(ctx_));
-    for (int i = 0; i < N; i += FLAG_batch) {
-        int n_eval = N - i;
-        if (n_eval > FLAG_batch)
-            n_eval = FLAG_batch;
-        if (llama_decode(ctx_,
-                         { .n_tokens = n_eval,
-                           .embd = image_embed->embed + i * n_embd,
-                           .all_pos_0 = used,
-                           .all_pos_1 = 1 })) {
-            llava_image_embed_free(image_embed);
-            return decode_image_failed;
-        }
-        used += n_eval;
-        processed += n_eval;
-        if (progress)
-            progress(processed, N);
-    }
-    llava_image_embed_free(image_embed);
-    history_.emplace_back(new Image(bytes, N));
+    Job job;
+    job.seq = id_;
+    job.pos = used;
+    job.n = N;
+    job.embd = image_embed->embed;
+    job.logits = logits_.data();
+    if (scheduler_->decode(&job, progress))
+        return decode_image_failed;
+    history_.emplace_back(new Image(image, N));
     return N;
 }
 
@@ -236,6 +202,7 @@ Slot::eval_atoms(const std::vector<Atom>& atoms,
                  const ProgressCallback& progress)
 {
     int total_work = 0;
+    embeds_.clear();
     if (progress) {
         for (const Atom& atom : atoms) {
             if (atom.is_token()) {
@@ -243,16 +210,9 @@ Slot::eval_atoms(const std::vector<Atom>& atoms,
             } else if (atom.is_image()) {
                 if (!clip_ctx_)
                     return no_vision_model;
-                llava_image_embed* image_embed =
-                  llava_image_embed_make_with_bytes(
-                    clip_ctx_,
-                    FLAG_threads_batch,
-                    (const unsigned char*)atom.image().bytes().data(),
-                    atom.image().bytes().size());
-                if (image_embed) {
+                llava_image_embed* image_embed;
+                if ((image_embed = encode_image(atom.image())))
                     total_work += image_embed->n_image_pos;
-                    llava_image_embed_free(image_embed);
-                }
             }
         }
         if (total_work > FLAG_batch)
@@ -275,7 +235,7 @@ Slot::eval_atoms(const std::vector<Atom>& atoms,
             token_count += rc;
             processed += rc;
             tokens.clear();
-            if ((rc = eval_image(atom.image().bytes(), wrap_progress)) < 0)
+            if ((rc = eval_image(atom.image(), wrap_progress)) < 0)
                 return rc;
             token_count += rc;
             processed += rc;
@@ -284,6 +244,7 @@ Slot::eval_atoms(const std::vector<Atom>& atoms,
     if ((rc = eval_tokens(tokens, wrap_progress)) < 0)
         return rc;
     token_count += rc;
+    embeds_.clear();
     return token_count;
 }
 
@@ -293,10 +254,16 @@ Slot::prefill(const std::vector<Atom>& atoms, const ProgressCallback& progress)
     if (!ctx_)
         return uninitialized;
 
+    // reset speculative decoding state
+    pending_ = -1;
+    drafted_ = 0;
+    accepted_ = 0;
+
     // handle special case of empty prefill
     if (atoms.empty()) {
-        llama_kv_cache_clear(ctx_);
+        scheduler_->seq_rm(id_, -1, -1);
         history_.clear();
+        shared_ = 0;
         return 0;
     }
 
@@ -334,12 +301,19 @@ Slot::prefill(const std::vector<Atom>& atoms, const ProgressCallback& progress)
     int relocate_p0 = -1;
     int relocate_p1 = -1;
     int skipped = keep;
-    for (int i = keep + 1; i < history_.size(); ++i) {
+    // quantized keys can't be rotated to their new position
+    for (int i = keep + 1; scheduler_->can_shift_ && i < history_.size(); ++i) {
         if (history_.size() - i > atoms.size() - keep)
             continue;
         if (std::equal(history_.begin() + i, //
                        history_.end(),
                        atoms.begin() + keep)) {
+            // cells shared with the prefix cache mustn't be moved
+            int pos = 0;
+            for (int j = 0; j < i; ++j)
+                pos += history_[j].ctx_used();
+            if (pos < shared_)
+                break;
             relocate_p0 = i;
             relocate_p1 = history_.size();
             skipped += history_.size() - i;
@@ -380,7 +354,8 @@ Slot::prefill(const std::vector<Atom>& atoms, const ProgressCallback& progress)
     // discard tokens from kv cache
     int discarded_tokens;
     int relocated_tokens = 0;
-    if (llama_kv_cache_seq_rm(ctx_, 0, keep_tokens, relocate_p0_tokens)) {
+    if (scheduler_->seq_rm(id_, keep_tokens, relocate_p0_tokens)) {
+        shared_ = std::min(shared_, keep_tokens);
         if (relocate_p0 == -1) {
             discarded_tokens = history_tokens - keep_tokens;
             history_.resize(keep);
@@ -392,27 +367,35 @@ Slot::prefill(const std::vector<Atom>& atoms, const ProgressCallback& progress)
             history_.erase(history_.begin() + keep,
                            history_.begin() + relocate_p0);
             // memmove relocated tokens in kv cache
-            llama_kv_cache_seq_add(ctx_,
-                                   0,
-                                   relocate_p0_tokens,
-                                   relocate_p1_tokens,
-                                   -(relocate_p0_tokens - keep_tokens));
+            scheduler_->seq_add(id_,
+                                relocate_p0_tokens,
+                                relocate_p1_tokens,
+                                -(relocate_p0_tokens - keep_tokens));
         }
     } else {
         // models like Mamba can't be partially erased
         SLOG("failed to remove tokens from KV cache");
         discarded_tokens = history_tokens;
-        llama_kv_cache_clear(ctx_);
+        scheduler_->seq_rm(id_, -1, -1);
         history_.clear();
+        shared_ = 0;
         skipped = 0;
     }
 
     // evaluate tokens
     std::vector<Atom> new_atoms(atoms.begin() + skipped, atoms.end());
     int rc;
+    timespec started = timespec_real();
     if ((rc = eval_atoms(new_atoms, progress)) < 0)
         return rc;
+    double elapsed =
+      timespec_tonanos(timespec_sub(timespec_real(), started)) * 1e-9;
     int total_tokens = keep_tokens + relocated_tokens + rc;
+    g_metrics.prompt_tokens.fetch_add(total_tokens, std::memory_order_relaxed);
+    g_metrics.cached_tokens.fetch_add(keep_tokens + relocated_tokens,
+                                      std::memory_order_relaxed);
+    if (rc && elapsed > 0)
+        g_metrics.prefill_speed.observe(rc / elapsed);
     SLOG("prefilled %d tokens (after keeping %d, discarding %d, "
          "relocating %d, and evaluating %d)",
          total_tokens,
@@ -423,6 +406,278 @@ Slot::prefill(const std::vector<Atom>& atoms, const ProgressCallback& progress)
     return total_tokens;
 }
 
+// makes this slot a copy of parent
+//
+// the kv cells aren't duplicated. they're simply tagged as belonging
+// to our sequence too, so both slots need to treat them as shared.
+void
+Slot::fork(Slot* parent)
+{
+    unassert(parent != this);
+    int used = parent->ctx_used();
+    scheduler_->seq_rm(id_, -1, -1);
+    scheduler_->seq_cp(parent->id_, id_, 0, used);
+    history_ = parent->history_;
+    logits_ = parent->logits_;
+    shared_ = used;
+    parent->shared_ = used;
+    pending_ = -1;
+    drafted_ = 0;
+    accepted_ = 0;
+}
+
+// removes last n tokens from history and kv cache
+//
+// logits_ won't describe the new end of history until something else
+// gets evaluated.
+void
+Slot::forget(int n)
+{
+    unassert(0 <= n && n <= history_.size());
+    pending_ = -1;
+    if (!n)
+        return;
+    history_.resize(history_.size() - n);
+    int used = ctx_used();
+    scheduler_->seq_rm(id_, used, -1);
+    shared_ = std::min(shared_, used);
+}
+
+// asks draft model to guess the k tokens that'll follow history + id
+//
+// the draft model has its own kv cache, which is synced with history
+// on each call. nothing is guessed if history holds images.
+void
+Slot::guess(int id, int k, std::vector<int>* out)
+{
+    std::vector<int> want;
+    for (const Atom& atom : history_) {
+        if (!atom.is_token())
+            return;
+        want.push_back(atom.token());
+    }
+    want.push_back(id);
+
+    // discard whatever the draft model saw that's no longer true
+    int keep = 0;
+    int n = std::min(draft_tokens_.size(), want.size() - 1);
+    while (keep < n && draft_tokens_[keep] == want[keep])
+        ++keep;
+    if (!draft_->seq_rm(id_, keep, -1)) {
+        draft_->seq_rm(id_, -1, -1);
+        keep = 0;
+    }
+    draft_tokens_.resize(keep);
+
+    // catch up on what's new
+    Job job;
+    job.seq = id_;
+    job.pos = keep;
+    job.n = want.size() - keep;
+    job.tokens = want.data() + keep;
+    job.logits = draft_logits_.data();
+    job.prefill = job.n > 1;
+    int rc = draft_->decode(&job);
+    draft_tokens_.insert(draft_tokens_.end(),
+                         want.begin() + keep,
+                         want.begin() + keep + job.processed);
+    if (rc)
+        return;
+
+    // greedily predict what comes next
+    for (int i = 0; i < k; ++i) {
+        int best = 0;
+        for (int j = 1; j < draft_logits_.size(); ++j)
+            if (draft_logits_[j] > draft_logits_[best])
+                best = j;
+        out->push_back(best);
+        if (i + 1 == k)
+            break;
+        Job job;
+        job.seq = id_;
+        job.pos = draft_tokens_.size();
+        job.n = 1;
+        job.tokens = &out->back();
+        job.logits = draft_logits_.data();
+        if (draft_->decode(&job))
+            break;
+        draft_tokens_.push_back(best);
+    }
+}
+
+// guesses tokens that follow history by looking for n-grams in it
+//
+// draft must initially hold the token that was just sampled, and up
+// to k guesses are appended. since it only costs a few hash lookups,
+// this works well for requests that copy long spans of the prompt,
+// e.g. code editing. the n-gram index is updated incrementally, as
+// long as history is only appended to.
+void
+Slot::guess_ngrams(int k, std::vector<int>* draft)
+{
+    std::vector<int> inp;
+    for (const Atom& atom : history_) {
+        if (!atom.is_token())
+            return;
+        inp.push_back(atom.token());
+    }
+    int nnew = inp.size() - ngram_tokens_.size();
+    if (nnew < 0 ||
+        !std::equal(ngram_tokens_.begin(), ngram_tokens_.end(), inp.begin())) {
+        ngram_context_.clear();
+        nnew = inp.size();
+    }
+    llama_ngram_cache_update(
+      ngram_context_, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, nnew, false);
+    llama_ngram_cache_draft(inp,
+                            *draft,
+                            k,
+                            LLAMA_NGRAM_MIN,
+                            LLAMA_NGRAM_MAX,
+                            ngram_context_,
+                            ngram_dynamic_,
+                            ngram_static_);
+    ngram_tokens_ = std::move(inp);
+}
+
+// returns true if speculate() would be able to guess ahead
+bool
+Slot::can_guess(int how) const
+{
+    switch (how) {
+        case SPECULATE_DRAFT:
+            return draft_;
+        case SPECULATE_NGRAM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// generates one or more tokens using speculative decoding
+//
+// a token is sampled from logits_, and then either the draft model or
+// the n-gram index guesses which tokens will follow it, depending on
+// how. all of them are then decoded by this slot's model in a single
+// batch, which gives us its logits at each of those positions. we
+// sample from the model at each position and keep the guesses for as
+// long as they're what got sampled. so the output has the same
+// distribution it'd have without speculation. the token that was
+// sampled last isn't in the kv cache yet, so it's held in pending_ and
+// gets decoded at the start of the next call.
+//
+// tokens that were added to history are appended to out. the number
+// of tokens added is returned, or a negative error code.
+int
+Slot::speculate(llama_sampling_context* sampler,
+                bool apply_grammar,
+                int how,
+                std::vector<int>* out)
+{
+    if (!ctx_)
+        return uninitialized;
+    int used = ctx_used();
+    if (used + 1 > ctx_size())
+        return out_of_context;
+    int id = pending_;
+    pending_ = -1;
+    if (id == -1) {
+        id = llama_sampling_sample_logits(sampler, ctx_, logits_.data());
+        llama_sampling_accept(sampler, ctx_, id, apply_grammar);
+    }
+
+    // guess what comes next
+    std::vector<int> tokens = { id };
+    int room = std::min(ctx_size() - used, scheduler_->n_batch_) - 1;
+    if (room > 0) {
+        if (how == SPECULATE_DRAFT && draft_)
+            guess(id, std::min(FLAG_draft, room), &tokens);
+        else if (how == SPECULATE_NGRAM)
+            guess_ngrams(std::min(FLAG_draft, room), &tokens);
+    }
+
+    // decode sampled token along with the guesses
+    int n_vocab = scheduler_->n_vocab_;
+    verify_logits_.resize((size_t)tokens.size() * n_vocab);
+    Job job;
+    job.seq = id_;
+    job.pos = used;
+    job.n = tokens.size();
+    job.tokens = tokens.data();
+    job.logits = verify_logits_.data();
+    job.n_logits = tokens.size();
+    if (scheduler_->decode(&job))
+        return decode_token_failed;
+    history_.emplace_back(id);
+    out->push_back(id);
+
+    // keep the guesses that the model agrees with
+    int accepted = 0;
+    int guessed = tokens.size() - 1;
+    for (;;) {
+        memcpy(logits_.data(),
+               verify_logits_.data() + (size_t)accepted * n_vocab,
+               n_vocab * sizeof(float));
+        int next = llama_sampling_sample_logits(sampler, ctx_, logits_.data());
+        llama_sampling_accept(sampler, ctx_, next, apply_grammar);
+        if (accepted == guessed || next != tokens[1 + accepted]) {
+            pending_ = next;
+            break;
+        }
+        history_.emplace_back(next);
+        out->push_back(next);
+        ++accepted;
+    }
+    if (accepted < guessed)
+        scheduler_->seq_rm(id_, used + 1 + accepted, -1);
+    drafted_ += guessed;
+    accepted_ += accepted;
+    return 1 + accepted;
+}
+
+// evaluates one token in each slot using a single batch
+//
+// the result for each slot is appended to results, which is the same
+// thing eval_token() would have returned.
+void
+Slot::eval_each(const std::vector<Slot*>& slots,
+                const std::vector<int>& tokens,
+                std::vector<int>* results)
+{
+    unassert(slots.size() == tokens.size());
+    size_t start = results->size();
+    std::vector<Job> jobs(slots.size());
+    std::vector<Job*> submit;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        Slot* slot = slots[i];
+        if (!slot->ctx_) {
+            results->push_back(uninitialized);
+        } else if (slot->ctx_used() + 1 > slot->ctx_size()) {
+            results->push_back(out_of_context);
+        } else {
+            jobs[i].seq = slot->id_;
+            jobs[i].pos = slot->ctx_used();
+            jobs[i].n = 1;
+            jobs[i].tokens = &tokens[i];
+            jobs[i].logits = slot->logits_.data();
+            submit.push_back(&jobs[i]);
+            results->push_back(1);
+        }
+    }
+    if (submit.empty())
+        return;
+    slots[0]->scheduler_->decode(submit);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if ((*results)[start + i] != 1)
+            continue;
+        if (jobs[i].rc || !jobs[i].processed) {
+            (*results)[start + i] = decode_token_failed;
+        } else {
+            slots[i]->history_.emplace_back(tokens[i]);
+        }
+    }
+}
+
 void
 Slot::dump(std::string* result)
 {
@@ -16,25 +16,37 @@
 // limitations under the License.
 
 #pragma once
+#include "image.h"
+#include "llama.cpp/ngram-cache.h"
+#include "scheduler.h"
 #include <cosmo.h>
 #include <ctime>
-#include <functional>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define SLOT(e) DLL_CONTAINER(Slot, elem_, e)
 
 struct llama_context;
 struct llama_model;
+struct llama_sampling_context;
 struct clip_ctx;
+struct llava_image_embed;
 
 namespace lf {
 namespace server {
 
-using ProgressCallback = std::function<void(int processed, int total)>;
-
 struct Atom;
-struct Image;
+class ImageCache;
+
+// ways of guessing tokens ahead for speculative decoding
+enum Speculation
+{
+    SPECULATE_NONE,
+    SPECULATE_DRAFT, // ask the draft model
+    SPECULATE_NGRAM, // look for n-grams in history
+};
 
 struct Slot
 {
@@ -54,21 +66,49 @@ struct Slot
     Dll elem_;
     time_t last_used_;
     llama_model* model_;
+    Scheduler* scheduler_;
+    Scheduler* draft_; // may be null
     clip_ctx* clip_ctx_ = nullptr;
-    llama_context* ctx_ = nullptr;
+    ImageCache* image_cache_ = nullptr; // shared with other slots
+    llama_context* ctx_ = nullptr; // shared with other slots
     std::vector<Atom> history_;
+    std::vector<float> logits_;
+    int shared_ = 0; // kv positions possibly shared with prefix cache
     std::string system_fingerprint_;
+    std::vector<std::pair<Image, std::shared_ptr<llava_image_embed>>> embeds_;
+
+    // speculative decoding state
+    int pending_ = -1; // sampled token that's not in kv cache yet
+    int drafted_ = 0;
+    int accepted_ = 0;
+    std::vector<int> draft_tokens_; // what's in the draft model's kv
+    std::vector<float> draft_logits_;
+    std::vector<float> verify_logits_;
+    std::vector<int> ngram_tokens_; // what's in ngram_context_
+    llama_ngram_cache ngram_context_;
+    llama_ngram_cache ngram_dynamic_;
+    llama_ngram_cache ngram_static_;
 
     ~Slot();
-    Slot(int, llama_model*);
+    Slot(int, Scheduler*, Scheduler* = nullptr);
     int ctx_size() const;
     int ctx_used() const;
     bool start();
     int eval_token(int);
     int eval_tokens(const std::vector<int>&, const ProgressCallback& = nullptr);
-    int eval_image(const std::string_view&, const ProgressCallback& = nullptr);
+    llava_image_embed* encode_image(const Image&);
+    int eval_image(const Image&, const ProgressCallback& = nullptr);
     int eval_atoms(const std::vector<Atom>&, const ProgressCallback& = nullptr);
     int prefill(const std::vector<Atom>&, const ProgressCallback& = nullptr);
+    void fork(Slot*);
+    void forget(int);
+    bool can_guess(int) const;
+    void guess(int, int, std::vector<int>*);
+    void guess_ngrams(int, std::vector<int>*);
+    int speculate(llama_sampling_context*, bool, int, std::vector<int>*);
+    static void eval_each(const std::vector<Slot*>&,
+                          const std::vector<int>&,
+                          std::vector<int>*);
     void tokenize(std::vector<Atom>*, std::string_view, bool);
     void dump(std::string*);
 };
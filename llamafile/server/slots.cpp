@@ -16,31 +16,69 @@
 // limitations under the License.
 
 #include "slots.h"
+#include "llama.cpp/llama.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
+#include "llamafile/server/image_cache.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/prefix_cache.h"
+#include "llamafile/server/scheduler.h"
 #include "llamafile/server/slot.h"
 #include "llamafile/server/slot_entry.h"
+#include "llamafile/server/snapshot.h"
+#include "llamafile/server/token_cache.h"
+#include "llamafile/server/utils.h"
 #include "llamafile/vector.h"
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <climits>
 #include <cmath>
+#include <cosmo.h>
+#include <cstring>
+#include <unistd.h>
+
+#define WAITER(e) DLL_CONTAINER(Waiter, elem_, e)
 
 namespace lf {
 namespace server {
 
-Slots::Slots(llama_model* model) : model_(model)
+// client standing in line for a slot
+struct Waiter
+{
+    Dll elem_;
+    Slots* slots;
+    int priority;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+};
+
+static bool
+is_recurrent(llama_model* model)
+{
+    char arch[32];
+    return llama_model_meta_val_str(
+             model, "general.architecture", arch, sizeof(arch)) > 0 &&
+           !strcmp(arch, "mamba");
+}
+
+Slots::Slots(llama_model* model, llama_model* draft_model)
+  : model_(model), draft_model_(draft_model)
 {
-    pthread_cond_init(&cond_, 0);
     pthread_mutex_init(&lock_, 0);
 }
 
 Slots::~Slots()
 {
+    slots_.clear();
+    delete image_cache_;
+    delete token_cache_;
+    delete draft_scheduler_;
+    delete scheduler_;
+    delete prefix_cache_;
+    pthread_mutex_destroy(&prefix_lock_);
     pthread_mutex_destroy(&lock_);
-    pthread_cond_destroy(&cond_);
 }
 
 size_t
@@ -53,9 +91,52 @@ int
 Slots::start(int count)
 {
     int made = 0;
+    unassert(!scheduler_);
+    int extra = 0;
+    if (FLAG_prefix_cache > 0) {
+        if (is_recurrent(model_)) {
+            SLOG("prefix cache isn't supported by recurrent models");
+        } else {
+            extra = FLAG_prefix_cache;
+        }
+    }
+    scheduler_ = new Scheduler(model_);
+    if (!scheduler_->start(count, extra)) {
+        SLOG("failed to create llama context for %d slots", count);
+        return 0;
+    }
+    if (draft_model_) {
+        // the draft model's kv cache mirrors the main one position for
+        // position, and rejected guesses need to be erased from both.
+        if (llama_n_vocab(draft_model_) != llama_n_vocab(model_)) {
+            SLOG("draft model vocabulary doesn't match main model");
+        } else if (is_recurrent(model_) || is_recurrent(draft_model_)) {
+            SLOG("speculative decoding isn't supported by recurrent models");
+        } else {
+            draft_scheduler_ = new Scheduler(draft_model_);
+            if (!draft_scheduler_->start(count, 0, scheduler_->ctx_size_)) {
+                SLOG("failed to create llama context for draft model");
+                delete draft_scheduler_;
+                draft_scheduler_ = nullptr;
+            }
+        }
+    }
+    if (extra)
+        prefix_cache_ = new PrefixCache(count);
+    if (FLAG_mmproj && FLAG_image_cache > 0)
+        image_cache_ = new ImageCache((size_t)FLAG_image_cache * 1024 * 1024);
+    if (FLAG_token_cache > 0)
+        token_cache_ = new TokenCache(get_chat_delimiters(model_),
+                                      (size_t)FLAG_token_cache * 1024 * 1024);
+    if (FLAG_slot_cache)
+        snapshot_open_all(FLAG_slot_cache,
+                          model_,
+                          (size_t)FLAG_slot_cache_size * 1024 * 1024,
+                          &snapshots_);
     pthread_mutex_lock(&lock_);
     for (int i = 0; i < count; ++i) {
-        Slot* slot = new Slot(i, model_);
+        Slot* slot = new Slot(i, scheduler_, draft_scheduler_);
+        slot->image_cache_ = image_cache_;
         if (slot->start()) {
             ++made;
             slots_.emplace_back(slot);
@@ -64,79 +145,171 @@ Slots::start(int count)
             delete slot;
         }
     }
-    if (made)
-        pthread_cond_broadcast(&cond_);
+    wake();
     pthread_mutex_unlock(&lock_);
     if (made < count)
         SLOG("could only make %d out of %d slots", made);
     return made;
 }
 
+// lets first client in line know if there's a slot for it
+//
+// the caller must hold lock_.
+void
+Slots::wake()
+{
+    if (dll_is_empty(free_slots_))
+        return;
+    for (int i = 0; i < PRIORITIES; ++i) {
+        if (!dll_is_empty(waiters_[i])) {
+            pthread_cond_signal(&WAITER(dll_first(waiters_[i]))->cond);
+            return;
+        }
+    }
+}
+
+static bool
+is_first_in_line(Waiter* waiter)
+{
+    for (int i = 0; i < waiter->priority; ++i)
+        if (!dll_is_empty(waiter->slots->waiters_[i]))
+            return false;
+    return dll_first(waiter->slots->waiters_[waiter->priority]) ==
+           &waiter->elem_;
+}
+
+static void
+leave_line(void* arg)
+{
+    Waiter* waiter = (Waiter*)arg;
+    Slots* slots = waiter->slots;
+    dll_remove(&slots->waiters_[waiter->priority], &waiter->elem_);
+    slots->queued_[waiter->priority].fetch_sub(1, std::memory_order_relaxed);
+    slots->wake();
+    pthread_mutex_unlock(&slots->lock_);
+    pthread_cond_destroy(&waiter->cond);
+}
+
+// waits in line for slot that's best suited to atoms
+//
+// clients are served in order of priority, and first come first served
+// within the same priority. if --queue-timeout elapses before it's our
+// turn, then null is returned, so the client can be told to try again.
 Slot*
-Slots::take(const std::vector<Atom>& atoms)
+Slots::take(const std::vector<Atom>& atoms, int priority)
 {
+    unassert(0 <= priority && priority < PRIORITIES);
+    timespec started = timespec_real();
+    timespec deadline =
+      timespec_add(started, timespec_frommillis(FLAG_queue_timeout * 1000L));
+    Waiter waiter;
+    waiter.slots = this;
+    waiter.priority = priority;
+    dll_init(&waiter.elem_);
     pthread_mutex_lock(&lock_);
-    for (;;) {
-
-        // find best slot
-        // iteration order favors lru
-        time_t now = time(0);
-        Dll* best_slot = nullptr;
-        double best_score = INT_MIN;
-        for (Dll* e = dll_first(free_slots_); e; e = dll_next(free_slots_, e)) {
-
-            // least recently used is good
-            int age = now - SLOT(e)->last_used_;
-            double decay =
-              age + exp(FLAG_decay_growth * (age - FLAG_decay_delay));
-
-            // common prefix length is good
-            int cpl = vector_common_prefix_length(SLOT(e)->history_, atoms);
-
-            // common suffix length is good
-            int csl = 0;
-            int size = SLOT(e)->history_.size();
-            for (int i = cpl + 1; i < size; ++i) {
-                if (size - i > atoms.size() - cpl)
-                    continue;
-                if (std::equal(SLOT(e)->history_.begin() + i,
-                               SLOT(e)->history_.end(),
-                               atoms.begin() + cpl)) {
-                    csl = size - i;
-                    break;
-                }
-            }
+    dll_make_last(&waiters_[priority], &waiter.elem_);
+    queued_[priority].fetch_add(1, std::memory_order_relaxed);
+    bool timed_out = false;
+    pthread_cleanup_push(leave_line, &waiter);
+    if (!is_first_in_line(&waiter) || dll_is_empty(free_slots_))
+        SLOG("waiting for slot to be relinquished...");
+    while (!timed_out &&
+           (!is_first_in_line(&waiter) || dll_is_empty(free_slots_))) {
+        if (FLAG_queue_timeout > 0) {
+            timed_out = pthread_cond_timedwait(
+                          &waiter.cond, &lock_, &deadline) == ETIMEDOUT;
+        } else {
+            pthread_cond_wait(&waiter.cond, &lock_);
+        }
+    }
+    pthread_cleanup_pop(false);
+    if (!is_first_in_line(&waiter) || dll_is_empty(free_slots_)) {
+        leave_line(&waiter);
+        g_metrics.shed.fetch_add(1, std::memory_order_relaxed);
+        SLOG("gave up waiting for slot after %d seconds", FLAG_queue_timeout);
+        return nullptr;
+    }
 
-            // discarded atoms is bad
-            int discard;
-            if (csl) {
-                discard = 0;
-            } else {
-                discard = size - cpl;
-            }
+    // find best slot
+    // iteration order favors lru
+    time_t now = time(0);
+    Dll* best_slot = nullptr;
+    double best_score = INT_MIN;
+    for (Dll* e = dll_first(free_slots_); e; e = dll_next(free_slots_, e)) {
 
-            // tally up score to determine best
-            double score = cpl + csl + decay - discard;
-            if (score >= best_score) {
-                best_score = score;
-                best_slot = e;
+        // least recently used is good
+        int age = now - SLOT(e)->last_used_;
+        double decay = age + exp(FLAG_decay_growth * (age - FLAG_decay_delay));
+
+        // common prefix length is good
+        int cpl = vector_common_prefix_length(SLOT(e)->history_, atoms);
+
+        // common suffix length is good
+        int csl = 0;
+        int size = SLOT(e)->history_.size();
+        for (int i = cpl + 1; i < size; ++i) {
+            if (size - i > atoms.size() - cpl)
+                continue;
+            if (std::equal(SLOT(e)->history_.begin() + i,
+                           SLOT(e)->history_.end(),
+                           atoms.begin() + cpl)) {
+                csl = size - i;
+                break;
             }
         }
 
-        // return borrowed pointer to best slot
-        if (best_slot) {
-            dll_remove(&free_slots_, best_slot);
-            pthread_mutex_unlock(&lock_);
-            SLOG("acquired slot #%d with score %d",
-                 SLOT(best_slot)->id_,
-                 (int)MIN(INT_MAX, best_score));
-            return SLOT(best_slot);
+        // discarded atoms is bad
+        int discard;
+        if (csl) {
+            discard = 0;
+        } else {
+            discard = size - cpl;
         }
 
-        // all slots are being used
-        SLOG("waiting for slot to be relinquished...");
-        pthread_cond_wait(&cond_, &lock_);
+        // tally up score to determine best
+        double score = cpl + csl + decay - discard;
+        if (score >= best_score) {
+            best_score = score;
+            best_slot = e;
+        }
+    }
+
+    // return borrowed pointer to best slot
+    dll_remove(&free_slots_, best_slot);
+    leave_line(&waiter);
+    g_metrics.queue_wait.observe(
+      timespec_tonanos(timespec_sub(timespec_real(), started)) * 1e-9);
+    if (prefix_cache_)
+        restore_prefix(SLOT(best_slot), atoms);
+    if (!snapshots_.empty())
+        restore_snapshot(SLOT(best_slot), atoms);
+    SLOG("acquired slot #%d with score %d",
+         SLOT(best_slot)->id_,
+         (int)MIN(INT_MAX, best_score));
+    return SLOT(best_slot);
+}
+
+// takes up to n idle slots without waiting
+//
+// this is used to fork a request into several sequences. the least
+// recently used slots are taken first, since their kv caches are the
+// least likely to be worth keeping. returns the number of slots.
+int
+Slots::take_free(int n, std::vector<Slot*>* out)
+{
+    int taken = 0;
+    pthread_mutex_lock(&lock_);
+    for (int i = 0; i < PRIORITIES; ++i)
+        if (!dll_is_empty(waiters_[i]))
+            n = 0; // don't cut in line
+    for (Dll* e; taken < n && (e = dll_last(free_slots_)); ++taken) {
+        dll_remove(&free_slots_, e);
+        out->push_back(SLOT(e));
     }
+    pthread_mutex_unlock(&lock_);
+    if (taken)
+        SLOG("acquired %d extra slots for forking", taken);
+    return taken;
 }
 
 void
@@ -145,11 +318,133 @@ Slots::give(Slot* slot)
     unassert(slot);
     SLOG("relinquishing slot #%d", slot->id_);
     slot->last_used_ = time(0);
+    if (prefix_cache_)
+        cache_prefix(slot);
     pthread_mutex_lock(&lock_);
     dll_make_first(&free_slots_, &slot->elem_);
-    pthread_cond_signal(&cond_);
+    wake();
     pthread_mutex_unlock(&lock_);
 }
 
+// loads longest cached prefix of atoms into slot
+//
+// this only happens if the cache has more in common with atoms than
+// the slot already does. the kv cells are shared rather than copied.
+void
+Slots::restore_prefix(Slot* slot, const std::vector<Atom>& atoms)
+{
+    int restored = 0;
+    std::vector<KvSpan> spans;
+    pthread_mutex_lock(&prefix_lock_);
+    int n = prefix_cache_->lookup(atoms, &spans);
+    if (n > vector_common_prefix_length(slot->history_, atoms)) {
+        scheduler_->seq_rm(slot->id_, -1, -1);
+        for (const KvSpan& span : spans) {
+            scheduler_->seq_cp(
+              span.seq, slot->id_, span.pos, span.pos + span.size);
+            restored = span.pos + span.size;
+        }
+        slot->history_.assign(atoms.begin(), atoms.begin() + n);
+        slot->shared_ = restored;
+    }
+    pthread_mutex_unlock(&prefix_lock_);
+    if (restored)
+        SLOG("restored %d tokens from prefix cache into slot #%d",
+             restored,
+             slot->id_);
+}
+
+// adds what's in slot's context window to the prefix cache
+void
+Slots::cache_prefix(Slot* slot)
+{
+    KvSpan span;
+    int used = slot->ctx_used();
+    if (!used || used > FLAG_prefix_cache)
+        return;
+    pthread_mutex_lock(&prefix_lock_);
+    if (prefix_cache_->insert(slot->history_, &span)) {
+        scheduler_->seq_cp(slot->id_, span.seq, span.pos, span.pos + span.size);
+        slot->shared_ = used;
+    }
+    while (prefix_cache_->used() > FLAG_prefix_cache &&
+           prefix_cache_->evict(&span))
+        scheduler_->seq_rm(span.seq, span.pos, span.pos + span.size);
+    pthread_mutex_unlock(&prefix_lock_);
+}
+
+// loads snapshot from disk into slot if it's the best prefix match
+void
+Slots::restore_snapshot(Slot* slot, const std::vector<Atom>& atoms)
+{
+    Snapshot* best = nullptr;
+    int best_cpl = vector_common_prefix_length(slot->history_, atoms);
+    for (const auto& snap : snapshots_) {
+        if (snap->atoms.size() > slot->ctx_size())
+            continue;
+        int cpl = vector_common_prefix_length(snap->atoms, atoms);
+        if (cpl > best_cpl) {
+            best_cpl = cpl;
+            best = snap.get();
+        }
+    }
+    if (!best)
+        return;
+    slot->history_.clear();
+    slot->shared_ = 0;
+    if (!scheduler_->seq_load(slot->id_, best->state, best->state_size)) {
+        SLOG("%s: failed to restore snapshot", best->path.c_str());
+        scheduler_->seq_rm(slot->id_, -1, -1);
+        return;
+    }
+    slot->history_ = best->atoms;
+    SLOG("restored %d tokens from %s into slot #%d",
+         slot->ctx_used(),
+         best->path.c_str(),
+         slot->id_);
+}
+
+// writes slot kv caches to disk
+//
+// only slots that hold nothing but tokens can be saved, since that's
+// all llama_state_seq_save_file() knows how to describe. the files are
+// named after a hash of the model and tokens, so a snapshot that's
+// already on disk doesn't need to be saved again. afterwards the oldest
+// snapshots are deleted until the directory fits in --slot-cache-size.
+void
+Slots::save()
+{
+    if (!FLAG_slot_cache)
+        return;
+    int saved = 0;
+    for (const auto& slot : slots_) {
+        std::vector<int> tokens;
+        for (const Atom& atom : slot->history_) {
+            if (!atom.is_token()) {
+                tokens.clear();
+                break;
+            }
+            tokens.push_back(atom.token());
+        }
+        if (tokens.empty())
+            continue;
+        std::string path = snapshot_path(FLAG_slot_cache, model_, tokens);
+        if (!access(path.c_str(), F_OK))
+            continue;
+        std::string temp = path + ".tmp";
+        if (!scheduler_->seq_save(slot->id_, temp.c_str(), tokens) ||
+            rename(temp.c_str(), path.c_str())) {
+            SLOG("%s: failed to save snapshot", path.c_str());
+            unlink(temp.c_str());
+            continue;
+        }
+        ++saved;
+    }
+    SLOG("saved %d snapshots to %s", saved, FLAG_slot_cache);
+    snapshot_prune(FLAG_slot_cache,
+                   model_,
+                   (size_t)FLAG_slot_cache_size * 1024 * 1024);
+}
+
 } // namespace server
 } // namespace lf
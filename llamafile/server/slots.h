@@ -16,10 +16,13 @@
 // limitations under the License.
 
 #pragma once
+#include <atomic>
 #include <memory>
 #include <pthread.h>
 #include <vector>
 
+#define PRIORITIES 3
+
 struct llama_model;
 struct Dll;
 
@@ -27,13 +30,33 @@ namespace lf {
 namespace server {
 
 class Atom;
+class ImageCache;
+class PrefixCache;
 class SlotEntry;
+class TokenCache;
+struct Scheduler;
 struct Slot;
+struct Snapshot;
+
+// order in which clients waiting for a slot are served
+enum Priority
+{
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_BATCH,
+};
 
 struct Slots
 {
     llama_model* model_;
-    pthread_cond_t cond_;
+    llama_model* draft_model_;
+    Scheduler* scheduler_ = nullptr;
+    Scheduler* draft_scheduler_ = nullptr;
+    ImageCache* image_cache_ = nullptr;
+    PrefixCache* prefix_cache_ = nullptr;
+    TokenCache* token_cache_ = nullptr;
+    pthread_mutex_t prefix_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<Snapshot>> snapshots_;
     pthread_mutex_t lock_;
     std::vector<std::unique_ptr<Slot>> slots_;
 
@@ -41,13 +64,23 @@ struct Slots
     // last elements are least recently used
     Dll* free_slots_ = nullptr;
 
-    explicit Slots(llama_model*);
+    // clients waiting for a slot, first come first served per priority
+    Dll* waiters_[PRIORITIES] = {};
+    std::atomic_int queued_[PRIORITIES] = {};
+
+    explicit Slots(llama_model*, llama_model* = nullptr);
     ~Slots();
     size_t size();
     int start(int);
     void tokenize(std::vector<Atom>*, std::string_view, bool);
-    Slot* take(const std::vector<Atom>&);
+    Slot* take(const std::vector<Atom>&, int = PRIORITY_NORMAL);
+    int take_free(int, std::vector<Slot*>*);
     void give(Slot*);
+    void wake();
+    void restore_prefix(Slot*, const std::vector<Atom>&);
+    void cache_prefix(Slot*);
+    void restore_snapshot(Slot*, const std::vector<Atom>&);
+    void save();
 };
 
 } // namespace server
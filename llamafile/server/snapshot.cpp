@@ -0,0 +1,283 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "snapshot.h"
+#include "llama.cpp/ggml-backend.h"
+#include "llama.cpp/ggml.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/server/atom.h"
+#include "llamafile/server/log.h"
+#include <algorithm>
+#include <cosmo.h>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Slot kv cache persistence.
+ *
+ * Snapshots are written by llama_state_seq_save_file(), which lays out
+ * the file as a small header, the tokens that were evaluated, and then
+ * the serialized kv cells of the sequence. We map these files into
+ * memory on startup, so they cost nothing until a request comes in
+ * whose prompt shares a prefix with one, at which point its kv state
+ * is handed directly to llama_state_seq_set_data().
+ */
+
+static uint64_t
+hash_bytes(uint64_t h, const void* data, size_t size)
+{
+    return (h ^ __fnv(data, size)) * 0x100000001b3;
+}
+
+// folds some weights of tensor into hash if model has it
+static uint64_t
+hash_tensor(uint64_t h, llama_model* model, const char* name)
+{
+    ggml_tensor* t;
+    if (!(t = llama_get_model_tensor(model, name)))
+        return h;
+    char buf[4096];
+    size_t size = ggml_nbytes(t);
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    ggml_backend_tensor_get(t, buf, (size - n) / 2, n);
+    h = hash_bytes(h, name, strlen(name));
+    return hash_bytes(h, buf, n);
+}
+
+// returns hash that identifies the weights of model
+//
+// two finetunes of the same architecture have identical descriptions
+// and sizes, so we also hash the gguf metadata and a sample of bytes
+// from the middle of the embeddings and a few layers. we don't hash
+// the file path or inode, since snapshots should stay valid when the
+// cache directory is shipped to another machine along with weights.
+static uint64_t
+hash_model(llama_model* model)
+{
+    char buf[256];
+    uint64_t h = 0xcbf29ce484222325;
+    llama_model_desc(model, buf, sizeof(buf));
+    h = hash_bytes(h, buf, strlen(buf));
+    uint64_t n_params = llama_model_n_params(model);
+    uint64_t n_bytes = llama_model_size(model);
+    h = hash_bytes(h, &n_params, sizeof(n_params));
+    h = hash_bytes(h, &n_bytes, sizeof(n_bytes));
+    int n_meta = llama_model_meta_count(model);
+    for (int i = 0; i < n_meta; ++i) {
+        int n;
+        n = llama_model_meta_key_by_index(model, i, buf, sizeof(buf));
+        if (n > 0)
+            h = hash_bytes(h, buf, std::min(n, (int)sizeof(buf) - 1));
+        n = llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf));
+        if (n > 0)
+            h = hash_bytes(h, buf, std::min(n, (int)sizeof(buf) - 1));
+    }
+    h = hash_tensor(h, model, "token_embd.weight");
+    h = hash_tensor(h, model, "output.weight");
+    int n_layer = llama_n_layer(model);
+    int layers[] = { 0, n_layer / 2, n_layer - 1 };
+    for (int layer : layers) {
+        static const char* const kTensors[] = {
+            "attn_q",
+            "attn_qkv",
+            "attn_output",
+            "ffn_down",
+        };
+        for (const char* tensor : kTensors) {
+            snprintf(buf, sizeof(buf), "blk.%d.%s.weight", layer, tensor);
+            h = hash_tensor(h, model, buf);
+        }
+    }
+    return h;
+}
+
+static std::string
+model_prefix(llama_model* model)
+{
+    static llama_model* hashed;
+    static unsigned long long h;
+    char buf[32];
+    if (hashed != model) {
+        h = hash_model(model);
+        hashed = model;
+    }
+    snprintf(buf, sizeof(buf), "%016llx-", h);
+    return buf;
+}
+
+// returns file name that snapshot of tokens would have
+std::string
+snapshot_path(const char* dir,
+              llama_model* model,
+              const std::vector<int>& tokens)
+{
+    char buf[32];
+    uint64_t h = __fnv(tokens.data(), tokens.size() * sizeof(int));
+    snprintf(buf, sizeof(buf), "%016llx.kv", (unsigned long long)h);
+    std::string path = dir;
+    if (!path.empty() && path.back() != '/')
+        path += '/';
+    path += model_prefix(model);
+    path += buf;
+    return path;
+}
+
+Snapshot::~Snapshot()
+{
+    if (map)
+        munmap(map, mapsize);
+}
+
+// maps snapshot file into memory
+Snapshot*
+Snapshot::load(const char* path)
+{
+    int fd;
+    struct stat st;
+    if ((fd = ::open(path, O_RDONLY)) == -1)
+        return nullptr;
+    if (fstat(fd, &st) || st.st_size < 3 * sizeof(uint32_t)) {
+        ::close(fd);
+        return nullptr;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return nullptr;
+    const uint32_t* hdr = (const uint32_t*)map;
+    size_t offset = 3 * sizeof(uint32_t) + (size_t)hdr[2] * sizeof(int);
+    if (hdr[0] != LLAMA_STATE_SEQ_MAGIC ||
+        hdr[1] != LLAMA_STATE_SEQ_VERSION || offset >= st.st_size) {
+        munmap(map, st.st_size);
+        return nullptr;
+    }
+    Snapshot* snap = new Snapshot;
+    snap->path = path;
+    snap->map = map;
+    snap->mapsize = st.st_size;
+    snap->state = (const unsigned char*)map + offset;
+    snap->state_size = st.st_size - offset;
+    const int* tokens = (const int*)(hdr + 3);
+    for (uint32_t i = 0; i < hdr[2]; ++i)
+        snap->atoms.emplace_back(tokens[i]);
+    return snap;
+}
+
+struct SnapshotFile
+{
+    std::string path;
+    size_t size;
+    struct timespec mtime;
+};
+
+// lists snapshots in dir that were made with model, newest first
+static std::vector<SnapshotFile>
+list_snapshots(const char* dir, llama_model* model)
+{
+    DIR* d;
+    struct dirent* ent;
+    std::vector<SnapshotFile> files;
+    if (!(d = opendir(dir)))
+        return files;
+    std::string prefix = model_prefix(model);
+    while ((ent = readdir(d))) {
+        if (!startswith(ent->d_name, prefix.c_str()))
+            continue;
+        if (!endswith(ent->d_name, ".kv"))
+            continue;
+        std::string path = dir;
+        if (path.back() != '/')
+            path += '/';
+        path += ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            continue;
+        files.push_back({ path, (size_t)st.st_size, st.st_mtim });
+    }
+    closedir(d);
+    std::sort(files.begin(),
+              files.end(),
+              [](const SnapshotFile& a, const SnapshotFile& b) {
+                  if (a.mtime.tv_sec != b.mtime.tv_sec)
+                      return a.mtime.tv_sec > b.mtime.tv_sec;
+                  return a.mtime.tv_nsec > b.mtime.tv_nsec;
+              });
+    return files;
+}
+
+// maps the newest snapshots in dir that were made with model
+//
+// at most max_bytes worth of files are mapped. the rest are left for
+// snapshot_prune() to delete the next time the server saves.
+void
+snapshot_open_all(const char* dir,
+                  llama_model* model,
+                  size_t max_bytes,
+                  std::vector<std::unique_ptr<Snapshot>>* out)
+{
+    struct stat st;
+    if (stat(dir, &st)) {
+        if (mkdir(dir, 0755))
+            SLOG("%s: %m", dir);
+        return;
+    }
+    size_t total = 0;
+    int skipped = 0;
+    for (const SnapshotFile& file : list_snapshots(dir, model)) {
+        if (total + file.size > max_bytes) {
+            ++skipped;
+            continue;
+        }
+        Snapshot* snap;
+        if ((snap = Snapshot::load(file.path.c_str()))) {
+            out->emplace_back(snap);
+            total += file.size;
+        } else {
+            SLOG("%s: bad snapshot", file.path.c_str());
+        }
+    }
+    SLOG("found %zu snapshots in %s", out->size(), dir);
+    if (skipped)
+        SLOG("skipped %d snapshots exceeding --slot-cache-size", skipped);
+}
+
+// deletes the oldest snapshots in dir until they fit in max_bytes
+void
+snapshot_prune(const char* dir, llama_model* model, size_t max_bytes)
+{
+    size_t total = 0;
+    for (const SnapshotFile& file : list_snapshots(dir, model)) {
+        if (total + file.size <= max_bytes) {
+            total += file.size;
+            continue;
+        }
+        if (unlink(file.path.c_str()))
+            SLOG("%s: %m", file.path.c_str());
+        else
+            SLOG("pruned snapshot %s", file.path.c_str());
+    }
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,57 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+struct llama_model;
+
+namespace lf {
+namespace server {
+
+class Atom;
+
+// kv cache of a slot that was saved to disk
+struct Snapshot
+{
+    std::string path;
+    std::vector<Atom> atoms;
+    void* map = nullptr;
+    size_t mapsize = 0;
+    const unsigned char* state = nullptr;
+    size_t state_size = 0;
+
+    ~Snapshot();
+    static Snapshot* load(const char*);
+};
+
+std::string
+snapshot_path(const char*, llama_model*, const std::vector<int>&);
+
+void
+snapshot_open_all(const char*,
+                  llama_model*,
+                  size_t,
+                  std::vector<std::unique_ptr<Snapshot>>*);
+
+void
+snapshot_prune(const char*, llama_model*, size_t);
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,190 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_cache.h"
+#include <cctype>
+#include <cosmo.h>
+
+namespace lf {
+namespace server {
+
+struct TokenCache::Entry
+{
+    uint64_t hash;
+    std::string text;
+    std::vector<int> tokens;
+    size_t size;
+};
+
+static std::string_view
+trim(std::string_view s)
+{
+    while (!s.empty() && isspace(s.front() & 255))
+        s.remove_prefix(1);
+    while (!s.empty() && isspace(s.back() & 255))
+        s.remove_suffix(1);
+    return s;
+}
+
+// creates cache
+//
+// @param delimiters are texts of the control tokens it's safe to split
+//     a prompt before, i.e. the ones that don't strip whitespace
+// @param capacity is memory budget in bytes
+TokenCache::TokenCache(const std::vector<std::string>& delimiters,
+                       size_t capacity)
+  : delimiters_(delimiters), capacity_(capacity)
+{
+}
+
+TokenCache::~TokenCache()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+// returns number of bytes held by cache
+size_t
+TokenCache::used() const
+{
+    pthread_mutex_lock(&lock_);
+    size_t res = used_;
+    pthread_mutex_unlock(&lock_);
+    return res;
+}
+
+// returns true if no delimiter straddles position `i` of `s`
+//
+// if one did, the tokenizer might turn it into a control token when
+// it sees the whole prompt, whereas the two chunks would only contain
+// pieces of it.
+bool
+TokenCache::is_cut_safe(std::string_view s, size_t i) const
+{
+    for (const std::string& d : delimiters_)
+        for (size_t k = 1; k < d.size() && k <= i; ++k)
+            if (s.substr(i - k, d.size()) == d)
+                return false;
+    return true;
+}
+
+// returns position of last delimiter in s[lo,hi), or npos
+size_t
+TokenCache::find_cut(std::string_view s, size_t lo, size_t hi) const
+{
+    for (size_t i = hi; i-- > lo;)
+        for (const std::string& d : delimiters_)
+            if (s[i] == d[0] && s.substr(i, d.size()) == d &&
+                is_cut_safe(s, i))
+                return i;
+    return std::string_view::npos;
+}
+
+// splits rendered chat prompt into chunks that tokenize independently
+//
+// the chunks are cut at the last delimiter that appears between each
+// message's content and the next. this makes a message's chunk stable
+// from one turn to the next: the chunk that ended a prompt with the
+// start of the assistant's turn reappears once that turn is filled in.
+// any text that can't be attributed to messages ends up in one chunk.
+//
+// @param prompt is output of the chat template
+// @param contents is content of each message in the chat
+std::vector<std::string_view>
+TokenCache::split(std::string_view prompt,
+                  const std::vector<std::string_view>& contents) const
+{
+    std::vector<std::string_view> chunks;
+    size_t start = 0;
+    size_t pos = 0;
+    bool seen = false;
+    for (std::string_view content : contents) {
+        content = trim(content);
+        if (content.empty())
+            continue;
+        size_t at = prompt.find(content, pos);
+        if (at == std::string_view::npos)
+            break;
+        if (seen) {
+            size_t cut = find_cut(prompt, pos, at);
+            if (cut != std::string_view::npos && cut > start) {
+                chunks.push_back(prompt.substr(start, cut - start));
+                start = cut;
+            }
+        }
+        pos = at + content.size();
+        seen = true;
+    }
+    if (seen) {
+        size_t cut = find_cut(prompt, pos, prompt.size());
+        if (cut != std::string_view::npos && cut > start) {
+            chunks.push_back(prompt.substr(start, cut - start));
+            start = cut;
+        }
+    }
+    if (start < prompt.size())
+        chunks.push_back(prompt.substr(start));
+    return chunks;
+}
+
+// gets tokens of text, returning false if it isn't cached
+bool
+TokenCache::lookup(std::string_view text, std::vector<int>* tokens)
+{
+    bool res = false;
+    uint64_t hash = __fnv(text.data(), text.size());
+    pthread_mutex_lock(&lock_);
+    auto it = map_.find(hash);
+    if (it != map_.end() && it->second->text == text) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        *tokens = it->second->tokens;
+        res = true;
+    }
+    pthread_mutex_unlock(&lock_);
+    return res;
+}
+
+// adds tokens of text to cache
+//
+// the least recently used chunks are evicted until the cache fits in
+// its memory budget.
+void
+TokenCache::insert(std::string_view text, const std::vector<int>& tokens)
+{
+    size_t size = sizeof(Entry) + text.size() + tokens.size() * sizeof(int);
+    if (size > capacity_)
+        return;
+    uint64_t hash = __fnv(text.data(), text.size());
+    pthread_mutex_lock(&lock_);
+    auto it = map_.find(hash);
+    if (it != map_.end()) {
+        used_ -= it->second->size;
+        lru_.erase(it->second);
+        map_.erase(it);
+    }
+    while (used_ + size > capacity_) {
+        used_ -= lru_.back().size;
+        map_.erase(lru_.back().hash);
+        lru_.pop_back();
+    }
+    lru_.push_front(Entry{ hash, std::string(text), tokens, size });
+    map_[hash] = lru_.begin();
+    used_ += size;
+    pthread_mutex_unlock(&lock_);
+}
+
+} // namespace server
+} // namespace lf
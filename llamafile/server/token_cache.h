@@ -0,0 +1,64 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <list>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+// least recently used cache of tokenized chat prompt chunks
+//
+// chat clients send the entire conversation on every turn, so without
+// this, each request would tokenize the whole history again, even
+// though only the newest message changed. the prompt is split into one
+// chunk per message, at control tokens like <|im_start|> since that's
+// where the tokenizer already splits text, so tokenizing each chunk
+// on its own gives the same tokens as tokenizing the whole prompt.
+class TokenCache
+{
+  public:
+    TokenCache(const std::vector<std::string>&, size_t);
+    ~TokenCache();
+    size_t used() const;
+    std::vector<std::string_view> split(
+      std::string_view,
+      const std::vector<std::string_view>&) const;
+    bool lookup(std::string_view, std::vector<int>*);
+    void insert(std::string_view, const std::vector<int>&);
+
+  private:
+    struct Entry;
+    size_t find_cut(std::string_view, size_t, size_t) const;
+    bool is_cut_safe(std::string_view, size_t) const;
+
+    std::vector<std::string> delimiters_;
+    size_t capacity_;
+    size_t used_ = 0;
+    std::list<Entry> lru_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> map_;
+    mutable pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,113 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_cache.h"
+#include <cosmo.h>
+#include <cstdlib>
+
+namespace lf {
+namespace server {
+namespace {
+
+void
+token_cache_test()
+{
+    {
+        TokenCache cache({ "<|im_start|>", "<|im_end|>" }, 1000);
+
+        // one chunk per message, and the assistant's turn on its own
+        std::string prompt = "<|im_start|>system\nbe nice<|im_end|>\n"
+                             "<|im_start|>user\nhi<|im_end|>\n"
+                             "<|im_start|>assistant\n";
+        std::vector<std::string_view> chunks =
+          cache.split(prompt, { "be nice", " hi\n" });
+        if (chunks.size() != 3 ||
+            chunks[0] != "<|im_start|>system\nbe nice<|im_end|>\n" ||
+            chunks[1] != "<|im_start|>user\nhi<|im_end|>\n" ||
+            chunks[2] != "<|im_start|>assistant\n")
+            exit(1);
+
+        // chunks stay the same once the assistant responds
+        prompt = "<|im_start|>system\nbe nice<|im_end|>\n"
+                 "<|im_start|>user\nhi<|im_end|>\n"
+                 "<|im_start|>assistant\nhello<|im_end|>\n"
+                 "<|im_start|>user\nbye<|im_end|>\n"
+                 "<|im_start|>assistant\n";
+        chunks = cache.split(prompt, { "be nice", "hi", "hello", "bye" });
+        if (chunks.size() != 5 ||
+            chunks[1] != "<|im_start|>user\nhi<|im_end|>\n" ||
+            chunks[2] != "<|im_start|>assistant\nhello<|im_end|>\n" ||
+            chunks[4] != "<|im_start|>assistant\n")
+            exit(2);
+
+        // text is kept whole if messages can't be found
+        chunks = cache.split(prompt, { "nope" });
+        if (chunks.size() != 1 || chunks[0] != prompt)
+            exit(3);
+        if (!cache.split("", {}).empty())
+            exit(4);
+    }
+    {
+        // never cut inside a longer delimiter
+        TokenCache cache({ "<x>", "<<x>>" }, 1000);
+        std::vector<std::string_view> chunks =
+          cache.split("a<<x>>b<x>c", { "a", "b", "c" });
+        if (chunks.size() != 3 || chunks[0] != "a" ||
+            chunks[1] != "<<x>>b" || chunks[2] != "<x>c")
+            exit(5);
+    }
+    {
+        TokenCache cache({}, 300);
+        std::vector<int> tokens;
+        if (cache.lookup("hello", &tokens))
+            exit(6);
+        cache.insert("hello", { 1, 2 });
+        if (!cache.lookup("hello", &tokens) || tokens != std::vector{ 1, 2 })
+            exit(7);
+        if (cache.lookup("hellp", &tokens))
+            exit(8);
+
+        // least recently used chunks get evicted
+        size_t one = cache.used();
+        std::string big(300 - one - one / 2, 'x');
+        cache.insert("world", { 3 });
+        if (!cache.lookup("hello", &tokens))
+            exit(9);
+        cache.insert(big, {});
+        if (!cache.lookup(big, &tokens) || cache.lookup("world", &tokens))
+            exit(10);
+        if (cache.used() > 300)
+            exit(11);
+
+        // things too big for the cache are ignored
+        cache.insert(std::string(1000, 'y'), {});
+        if (cache.lookup(std::string(1000, 'y'), &tokens) ||
+            !cache.lookup(big, &tokens))
+            exit(12);
+    }
+    CheckForMemoryLeaks();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::token_cache_test();
+}
@@ -20,6 +20,7 @@
 #include "llamafile/json.h"
 #include "llamafile/server/cleanup.h"
 #include "llamafile/server/fastjson.h"
+#include "llamafile/server/json_view.h"
 #include "llamafile/server/log.h"
 #include "llamafile/server/signals.h"
 #include "llamafile/server/utils.h"
@@ -63,15 +64,16 @@ Client::get_tokenize_params(TokenizeParams* params)
         } else if (IsMimeType(HeaderData(kHttpContentType),
                               HeaderLength(kHttpContentType),
                               "application/json")) {
-            auto [status, json] = Json::parse(std::string(payload_));
-            if (status != Json::success)
+            JsonDocument doc;
+            Json::Status status;
+            if ((status = doc.parse(payload_)) != Json::success)
                 return send_error(400, Json::StatusToString(status));
+            JsonView json = doc.root();
             if (!json.isObject())
                 return send_error(400, "JSON body must be an object");
             if (!json["prompt"].isString())
                 return send_error(400, "JSON missing \"prompt\" key");
-            params->content = std::move(json["prompt"].getString());
-            params->prompt = params->content;
+            params->prompt = json["prompt"].getString(&params->content);
             if (json["add_special"].isBool())
                 params->add_special = json["add_special"].getBool();
             if (json["parse_special"].isBool())
@@ -23,11 +23,13 @@
 #include <sys/uio.h>
 
 struct llama_model;
+struct llama_chat_msg;
 
 namespace lf {
 namespace server {
 
 class Atom;
+class TokenCache;
 
 ssize_t
 safe_writev(int, const iovec*, int);
@@ -44,6 +46,16 @@ atomize(const llama_model* model,
         std::string_view s,
         bool parse_special);
 
+void
+atomize_chat(const llama_model* model,
+             TokenCache* cache,
+             std::vector<Atom>* result,
+             std::string_view prompt,
+             const std::vector<llama_chat_msg>& messages);
+
+std::vector<std::string>
+get_chat_delimiters(const llama_model*);
+
 std::vector<Atom>
 remove_old_image_atoms(const std::vector<Atom>&);
 
@@ -23,8 +23,11 @@
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/event.h"
 #include "llamafile/server/fastjson.h"
+#include "llamafile/server/json_view.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/slot.h"
 #include "llamafile/server/slots.h"
@@ -38,6 +41,8 @@
 #include <sys/resource.h>
 #include <vector>
 
+#define MAX_CHOICES 128
+
 using jt::Json;
 
 namespace lf {
@@ -49,6 +54,8 @@ struct V1ChatCompletionParams
     bool stream_include_usage = false;
     long max_tokens = -1;
     long seed = _rand64();
+    int n = 1;
+    int speculation = SPECULATE_DRAFT;
     double top_p = 1;
     double temperature = 1;
     double presence_penalty = 0;
@@ -65,26 +72,47 @@ struct V1ChatCompletionParams
         atomize(model, &stop.back(), text, DONT_PARSE_SPECIAL);
     }
 
-    bool should_stop(const std::vector<Atom>& history)
+    // returns true if the first `end` atoms of history end with a stop
+    bool should_stop(const std::vector<Atom>& history, size_t end)
     {
         for (const auto& suffix : stop)
-            if (vector_ends_with(history, suffix))
+            if (vector_ends_with(history, suffix, end))
                 return true;
         return false;
     }
 };
 
+struct V1ChatCompletionChoice
+{
+    Slot* slot = nullptr;
+    llama_sampling_context* sampler = nullptr;
+    std::string piece = "";
+    std::string content = "";
+    int completion_tokens = 0;
+    const char* finish_reason = nullptr;
+};
+
 struct V1ChatCompletionState
 {
+    Slots* slots;
     std::string prompt;
     std::vector<Atom> atoms;
-    std::string piece = "";
+    std::vector<Slot*> forks;
+    std::vector<V1ChatCompletionChoice> choices;
+
+    // reused by each step of generation, so it doesn't allocate
+    std::vector<int> going;
+    std::vector<int> rcs;
+    std::vector<int> ids;
+    std::vector<Slot*> batch;
+    std::vector<std::vector<int>> outs;
 };
 
 struct V1ChatCompletionResponse
 {
     std::string content;
     Json json;
+    Event event; // for streaming tokens
 };
 
 static void
@@ -94,21 +122,28 @@ cleanup_params(void* arg)
 }
 
 static void
-cleanup_state(void* arg)
+release_forks(V1ChatCompletionState* state)
 {
-    delete (V1ChatCompletionState*)arg;
+    for (Slot* slot : state->forks)
+        state->slots->give(slot);
+    state->forks.clear();
 }
 
 static void
-cleanup_response(void* arg)
+cleanup_state(void* arg)
 {
-    delete (V1ChatCompletionResponse*)arg;
+    V1ChatCompletionState* state = (V1ChatCompletionState*)arg;
+    release_forks(state);
+    for (V1ChatCompletionChoice& choice : state->choices)
+        if (choice.sampler)
+            llama_sampling_free(choice.sampler);
+    delete state;
 }
 
 static void
-cleanup_sampler(void* arg)
+cleanup_response(void* arg)
 {
-    llama_sampling_free((llama_sampling_context*)arg);
+    delete (V1ChatCompletionResponse*)arg;
 }
 
 static void
@@ -144,14 +179,14 @@ generate_id()
 }
 
 static llama_sampling_context*
-create_sampler(const V1ChatCompletionParams* params)
+create_sampler(const V1ChatCompletionParams* params, int index)
 {
     llama_sampling_params sparams;
     sparams.temp = params->temperature;
     sparams.top_p = params->top_p;
     sparams.penalty_freq = params->frequency_penalty;
     sparams.penalty_present = params->presence_penalty;
-    sparams.seed = params->seed;
+    sparams.seed = params->seed + index;
     sparams.grammar = params->grammar;
     return llama_sampling_init(sparams);
 }
@@ -199,9 +234,11 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         return false;
 
     // object<model, messages, ...>
-    auto [status, json] = Json::parse(std::string(payload_));
-    if (status != Json::success)
+    JsonDocument doc;
+    Json::Status status;
+    if ((status = doc.parse(payload_)) != Json::success)
         return send_error(400, Json::StatusToString(status));
+    JsonView json = doc.root();
     if (!json.isObject())
         return send_error(400, "JSON body must be an object");
 
@@ -226,7 +263,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         return send_error(400, "parallel_tool_calls field not supported yet");
 
     // model: string
-    Json& model = json["model"];
+    JsonView model = json["model"];
     if (!model.isString())
         return send_error(400, "JSON missing model string");
     params->model = model.getString();
@@ -234,10 +271,10 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // messages: array<object<role:string, content:string>>
     if (!json["messages"].isArray())
         return send_error(400, "JSON missing messages array");
-    std::vector<Json>& messages = json["messages"].getArray();
-    if (messages.empty())
+    JsonView messages = json["messages"];
+    if (!messages.size())
         return send_error(400, "JSON messages array is empty");
-    for (Json& message : messages) {
+    for (JsonView message : messages) {
         if (!message.isObject())
             return send_error(400, "messages array must hold objects");
         if (!message["role"].isString())
@@ -253,10 +290,10 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
                                           message["content"].getString());
         } else if (message["content"].isArray()) {
             std::string combined_content;
-            std::vector<Json>& content_array = message["content"].getArray();
-            if (content_array.empty())
+            JsonView content_array = message["content"];
+            if (!content_array.size())
                 return send_error(400, "message content array must not be empty");
-            for (Json& part : content_array) {
+            for (JsonView part : content_array) {
                 if (!part.isObject() || !part["type"].isString())
                     return send_error(400, "content array items must be objects with type");
                 std::string type = part["type"].getString();
@@ -287,12 +324,47 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // message. Note that you will be charged based on the number of
     // generated tokens across all of the choices. Keep n as 1 to
     // minimize costs.
-    Json& n = json["n"];
+    //
+    // The prompt is only prefilled once. Its kv cache is then shared
+    // with other slots, so all the choices can be decoded together.
+    JsonView n = json["n"];
     if (!n.isNull()) {
         if (!n.isLong())
             return send_error(400, "n field must be integer");
-        if (n.getLong() != 1)
-            return send_error(400, "n field must be 1 if specified");
+        if (!(1 <= n.getLong() && n.getLong() <= MAX_CHOICES))
+            return send_error(400, "n field must be between 1 and 128");
+        params->n = n.getLong();
+    }
+
+    // speculation: string|null
+    //
+    // How to guess tokens ahead, so that several of them can be
+    // verified by the model at once. This has no effect on what gets
+    // generated, only on how quickly. May be "draft" to use the model
+    // passed via --draft-model, "ngram" to look for repeated spans in
+    // the prompt and completion so far, or "none". The default "auto"
+    // uses the draft model if there is one.
+    //
+    // This is a llamafile extension to the OpenAI API.
+    JsonView speculation = json["speculation"];
+    if (!speculation.isNull()) {
+        if (!speculation.isString())
+            return send_error(400, "speculation field must be string");
+        std::string how = speculation.getString();
+        if (how == "auto") {
+            params->speculation = SPECULATE_DRAFT;
+        } else if (how == "none") {
+            params->speculation = SPECULATE_NONE;
+        } else if (how == "ngram") {
+            params->speculation = SPECULATE_NGRAM;
+        } else if (how == "draft") {
+            if (!worker_->server_->slots_->draft_scheduler_)
+                return send_error(400, "server has no draft model");
+            params->speculation = SPECULATE_DRAFT;
+        } else {
+            return send_error(400, "speculation field must be auto, none, "
+                                   "draft, or ngram");
+        }
     }
 
     // stream: bool|null
@@ -301,7 +373,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // Tokens will be sent as data-only server-sent events as they
     // become available, with the stream terminated by a data: [DONE]
     // message.
-    Json& stream = json["stream"];
+    JsonView stream = json["stream"];
     if (!stream.isNull()) {
         if (!stream.isBool())
             return send_error(400, "stream field must be boolean");
@@ -310,7 +382,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         // stream_options: object|null
         //
         // Options for the streaming response.
-        Json& stream_options = json["stream_options"];
+        JsonView stream_options = json["stream_options"];
         if (!stream_options.isNull()) {
             if (!stream_options.isObject())
                 return send_error(400, "stream_options field must be object");
@@ -319,7 +391,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
             //
             // Include usage also for streaming responses. The actual usage will be reported before
             // the [DONE] message, but all chunks contain an empty usage field.
-            Json& include_usage = stream_options["include_usage"];
+            JsonView include_usage = stream_options["include_usage"];
             if (!include_usage.isNull()) {
                 if (!include_usage.isBool())
                     return send_error(400, "include_usage field must be boolean");
@@ -332,13 +404,13 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     //
     // An upper bound for the number of tokens that can be generated for
     // a completion. This can be used to control compute costs.
-    Json& max_tokens = json["max_tokens"];
+    JsonView max_tokens = json["max_tokens"];
     if (!max_tokens.isNull()) {
         if (!max_tokens.isLong())
             return send_error(400, "max_tokens must be integer");
         params->max_tokens = max_tokens.getLong();
     }
-    Json& max_completion_tokens = json["max_completion_tokens"];
+    JsonView max_completion_tokens = json["max_completion_tokens"];
     if (!max_completion_tokens.isNull()) {
         if (!max_completion_tokens.isLong())
             return send_error(400, "max_completion_tokens must be integer");
@@ -353,7 +425,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // comprising the top 10% probability mass are considered.
     //
     // We generally recommend altering this or temperature but not both.
-    Json& top_p = json["top_p"];
+    JsonView top_p = json["top_p"];
     if (!top_p.isNull()) {
         if (!top_p.isNumber())
             return send_error(400, "top_p must be number");
@@ -369,7 +441,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // like 0.2 will make it more focused and deterministic.
     //
     // We generally recommend altering this or top_p but not both.
-    Json& temperature = json["temperature"];
+    JsonView temperature = json["temperature"];
     if (!temperature.isNull()) {
         if (!temperature.isNumber())
             return send_error(400, "temperature must be number");
@@ -385,7 +457,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // and parameters should return the same result. Determinism is not
     // guaranteed, and you should refer to the system_fingerprint
     // response parameter to monitor changes in the backend.
-    Json& seed = json["seed"];
+    JsonView seed = json["seed"];
     if (!seed.isNull()) {
         if (!seed.isLong())
             return send_error(400, "seed must be integer");
@@ -397,7 +469,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // Number between -2.0 and 2.0. Positive values penalize new tokens
     // based on whether they appear in the text so far, increasing the
     // model's likelihood to talk about new topics.
-    Json& presence_penalty = json["presence_penalty"];
+    JsonView presence_penalty = json["presence_penalty"];
     if (!presence_penalty.isNull()) {
         if (!presence_penalty.isNumber())
             return send_error(400, "presence_penalty must be number");
@@ -411,7 +483,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // Number between -2.0 and 2.0. Positive values penalize new tokens
     // based on their existing frequency in the text so far, decreasing
     // the model's likelihood to repeat the same line verbatim.
-    Json& frequency_penalty = json["frequency_penalty"];
+    JsonView frequency_penalty = json["frequency_penalty"];
     if (!frequency_penalty.isNull()) {
         if (!frequency_penalty.isNumber())
             return send_error(400, "frequency_penalty must be number");
@@ -425,7 +497,7 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     //
     // A unique identifier representing your end-user, which can help
     // llamafiler to monitor and detect abuse.
-    Json& user = json["user"];
+    JsonView user = json["user"];
     if (!user.isNull()) {
         if (!user.isString())
             return send_error(400, "JSON missing user string");
@@ -435,15 +507,15 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // stop: string|array<string>|null
     //
     // Up to 4 sequences where the API will stop generating further tokens.
-    Json& stop = json["stop"];
+    JsonView stop = json["stop"];
     if (!stop.isNull()) {
         if (stop.isString()) {
             params->add_stop(model_, stop.getString());
         } else if (stop.isArray()) {
-            std::vector<Json>& stops = stop.getArray();
+            JsonView stops = stop;
             if (stops.size() > 4)
                 return send_error(400, "stop array must have 4 items or fewer");
-            for (Json& stop2 : stops) {
+            for (JsonView stop2 : stops) {
                 if (!stop2.isString())
                     return send_error(400, "stop array item must be string");
                 if (stop2.getString().size() > 50)
@@ -477,26 +549,26 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     // may be partially cut off if finish_reason = "length", which
     // indicates the generation exceeded max_tokens or the conversation
     // exceeded the max context length.
-    Json& response_format = json["response_format"];
+    JsonView response_format = json["response_format"];
     if (!response_format.isNull()) {
         if (response_format.isString()) {
             if (response_format.getString() != "auto")
                 return send_error(400, "response_format not supported");
         } else if (response_format.isObject()) {
-            Json& type = response_format.getObject()["type"];
+            JsonView type = response_format["type"];
             if (!type.isString())
                 return send_error(400, "response_format.type must be string");
             if (type.getString() == "json_object") {
                 params->grammar =
                   json_schema_string_to_grammar("{\"type\": \"object\"}");
             } else if (type.getString() == "json_schema") {
-                Json& json_schema = response_format.getObject()["json_schema"];
+                JsonView json_schema = response_format["json_schema"];
                 if (!json_schema.isObject())
                     return send_error(
                       400, "response_format.json_schema must be object");
                 try {
-                    params->grammar =
-                      json_schema_string_to_grammar(json_schema.toString());
+                    params->grammar = json_schema_string_to_grammar(
+                      std::string(json_schema.raw()));
                 } catch (const std::exception& e) {
                     SLOG("error: couldn't compile json schema: %s", e.what());
                     return send_error(400, "bad json schema");
@@ -523,6 +595,7 @@ Client::v1_chat_completions()
 
     // create state and response objects
     V1ChatCompletionState* state = new V1ChatCompletionState;
+    state->slots = worker_->server_->slots_;
     defer_cleanup(cleanup_state, state);
     V1ChatCompletionResponse* response = new V1ChatCompletionResponse;
     defer_cleanup(cleanup_response, response);
@@ -536,14 +609,19 @@ Client::v1_chat_completions()
         // turn text into tokens
         state->prompt = llama_chat_apply_template(
           model_, FLAG_chat_template, params->messages, ADD_ASSISTANT);
-        atomize(model_, &state->atoms, state->prompt, PARSE_SPECIAL);
+        atomize_chat(model_,
+                     state->slots->token_cache_,
+                     &state->atoms,
+                     state->prompt,
+                     params->messages);
 
         // we don't support multiple images yet
         state->atoms = remove_old_image_atoms(state->atoms);
 
         // acquire best slot
         if (!slot_) {
-            slot_ = worker_->server_->slots_->take(state->atoms);
+            if (!(slot_ = state->slots->take(state->atoms, priority_)))
+                return send_retry_later();
             defer_cleanup(cleanup_slot, this);
         }
 
@@ -596,10 +674,10 @@ Client::v1_chat_completions()
     }
 
     // init sampling
-    llama_sampling_context* sampler = create_sampler(params);
-    if (!sampler)
-        return send_error(500, "failed to create sampler");
-    defer_cleanup(cleanup_sampler, sampler);
+    state->choices.resize(params->n);
+    for (int i = 0; i < params->n; ++i)
+        if (!(state->choices[i].sampler = create_sampler(params, i)))
+            return send_error(500, "failed to create sampler");
 
     // setup response json
     response->json["id"] = generate_id();
@@ -657,76 +735,197 @@ Client::v1_chat_completions()
     if (params->stream) {
         response->json.getObject().erase("x_prefill_progress");
         response->content = make_event(response->json);
-        choice.getObject().erase("delta");
         if (!send_response_chunk(response->content))
             return false;
+        choice.getObject().erase("delta");
+        choice["index"] = EVENT_INDEX;
+        choice["delta"]["content"] = EVENT_TEXT;
+        response->json["created"] = EVENT_CREATED;
+        response->event.compile(make_event(response->json));
+        choice.getObject().erase("delta");
     }
 
+    // borrow idle slots for the other choices
+    //
+    // if there aren't enough, the choices get generated in rounds, and
+    // the kv cache of the prompt gets forked again for each round.
+    if (params->n > 1)
+        state->slots->take_free(params->n - 1, &state->forks);
+
     // prediction time
-    int completion_tokens = 0;
-    const char* finish_reason = "length";
-    for (;;) {
-        if (params->max_tokens >= 0 &&
-            completion_tokens >= params->max_tokens) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            break;
-        }
-        llama_token id = llama_sampling_sample(sampler, slot_->ctx_, NULL);
-        llama_sampling_accept(sampler, slot_->ctx_, id, APPLY_GRAMMAR);
-        ++completion_tokens;
-        if (slot_->eval_token(id) < 0) {
-            SLOG("ran out of context window");
-            break;
-        }
-        if (llama_token_is_eog(model_, id)) {
-            finish_reason = "stop";
-            break;
+    TokenTimer timer(message_started_);
+    int group = 1 + state->forks.size();
+    for (int base = 0; base < params->n; base += group) {
+        int count = MIN(group, params->n - base);
+        if (base) {
+            int rc;
+            if ((rc = slot_->prefill(state->atoms)) < 0) {
+                SLOG("slot prefill failed: %s", Slot::describe_error(rc));
+                close_connection_ = true;
+                return false;
+            }
         }
-        if (params->should_stop(slot_->history_)) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            finish_reason = "stop";
-            break;
+        for (int j = 0; j < count; ++j) {
+            Slot* slot = j ? state->forks[j - 1] : slot_;
+            if (j)
+                slot->fork(slot_);
+            state->choices[base + j].slot = slot;
         }
-        state->piece +=
-          llamafile_token_to_piece(slot_->ctx_, id, DONT_RENDER_SPECIAL_TOKENS);
-        if (!state->piece.empty()) {
-            if (params->stream) {
-                if (!ends_with_incomplete_utf8(state->piece)) {
-                    char* p = append_http_response_message(obuf_.p, 200);
-                    choice["delta"]["content"] = state->piece;
-                    response->json["created"] = timespec_real().tv_sec;
-                    response->content = make_event(response->json);
-                    choice.getObject().erase("delta");
-                    if (!send_response_chunk(response->content))
-                        return false;
-                    state->piece.clear();
+        std::vector<int>& going = state->going;
+        std::vector<int>& rcs = state->rcs;
+        std::vector<std::vector<int>>& outs = state->outs;
+        for (;;) {
+            going.clear();
+            for (int j = base; j < base + count; ++j) {
+                V1ChatCompletionChoice& c = state->choices[j];
+                if (c.finish_reason)
+                    continue;
+                if (params->max_tokens >= 0 &&
+                    c.completion_tokens >= params->max_tokens) {
+                    c.slot->eval_token(llamafile_token_eot(model_));
+                    c.finish_reason = "length";
+                    continue;
                 }
+                going.push_back(j);
+            }
+            if (going.empty())
+                break;
+
+            // stop if nobody is listening anymore
+            //
+            // otherwise a client that times out and retries would
+            // leave this slot generating tokens that get thrown away.
+            if (hung_up()) {
+                unsigned long wasted = 0;
+                for (const V1ChatCompletionChoice& c : state->choices)
+                    wasted += c.completion_tokens;
+                g_metrics.abandoned.fetch_add(1, std::memory_order_relaxed);
+                g_metrics.abandoned_tokens.fetch_add(
+                  wasted, std::memory_order_relaxed);
+                SLOG("client hung up after %lu tokens", wasted);
+                return false;
+            }
+
+            // generate next tokens
+            //
+            // a single choice can guess ahead to generate several
+            // tokens at once. otherwise all the choices get
+            // their next token decoded together in one batch.
+            rcs.clear();
+            outs.resize(going.size());
+            for (std::vector<int>& out : outs)
+                out.clear();
+            if (going.size() == 1 &&
+                state->choices[going[0]].slot->can_guess(
+                  params->speculation)) {
+                V1ChatCompletionChoice& c = state->choices[going[0]];
+                rcs.push_back(c.slot->speculate(
+                  c.sampler, APPLY_GRAMMAR, params->speculation, &outs[0]));
             } else {
-                response->content += state->piece;
-                state->piece.clear();
+                state->ids.clear();
+                state->batch.clear();
+                for (size_t k = 0; k < going.size(); ++k) {
+                    V1ChatCompletionChoice& c = state->choices[going[k]];
+                    llama_token id = llama_sampling_sample_logits(
+                      c.sampler, c.slot->ctx_, c.slot->logits_.data());
+                    llama_sampling_accept(
+                      c.sampler, c.slot->ctx_, id, APPLY_GRAMMAR);
+                    state->ids.push_back(id);
+                    state->batch.push_back(c.slot);
+                    outs[k].push_back(id);
+                }
+                Slot::eval_each(state->batch, state->ids, &rcs);
+            }
+            timer.step(outs);
+
+            for (size_t k = 0; k < going.size(); ++k) {
+                V1ChatCompletionChoice& c = state->choices[going[k]];
+                if (rcs[k] < 0) {
+                    SLOG("ran out of context window");
+                    c.finish_reason = "length";
+                    continue;
+                }
+                for (size_t t = 0; t < outs[k].size(); ++t) {
+                    llama_token id = outs[k][t];
+                    int extra = outs[k].size() - 1 - t;
+                    ++c.completion_tokens;
+                    if (llama_token_is_eog(model_, id)) {
+                        c.slot->forget(extra);
+                        c.finish_reason = "stop";
+                        break;
+                    }
+                    if (params->should_stop(c.slot->history_,
+                                          c.slot->history_.size() - extra)) {
+                        c.slot->forget(extra);
+                        c.slot->eval_token(llamafile_token_eot(model_));
+                        c.finish_reason = "stop";
+                        break;
+                    }
+                    llamafile_token_to_piece(c.slot->ctx_,
+                                             id,
+                                             DONT_RENDER_SPECIAL_TOKENS,
+                                             &c.piece);
+                    if (!c.piece.empty()) {
+                        if (params->stream) {
+                            if (!ends_with_incomplete_utf8(c.piece)) {
+                                if (!send_event(
+                                      response->event, c.piece, going[k]))
+                                    return false;
+                                c.piece.clear();
+                            }
+                        } else {
+                            c.content += c.piece;
+                            c.piece.clear();
+                        }
+                    }
+                    if (extra && params->max_tokens >= 0 &&
+                        c.completion_tokens >= params->max_tokens) {
+                        c.slot->forget(extra);
+                        c.slot->eval_token(llamafile_token_eot(model_));
+                        c.finish_reason = "length";
+                        break;
+                    }
+                }
             }
         }
+        for (int j = base; j < base + count; ++j) {
+            Slot* slot = state->choices[j].slot;
+            if (slot->drafted_)
+                SLOG("accepted %d out of %d drafted tokens (%d%%)",
+                     slot->accepted_,
+                     slot->drafted_,
+                     slot->accepted_ * 100 / slot->drafted_);
+        }
+    }
+    timer.finish();
+    int completion_tokens = 0;
+    for (const V1ChatCompletionChoice& c : state->choices) {
+        completion_tokens += c.completion_tokens;
+        SLOG("predicted %d tokens finished on %s", //
+             c.completion_tokens,
+             c.finish_reason);
     }
-    choice["finish_reason"] = finish_reason;
-    SLOG("predicted %d tokens finished on %s", //
-         completion_tokens,
-         finish_reason);
 
     // finalize response
+    release_forks(state);
     cleanup_slot(this);
     if (params->stream) {
-        choice["delta"]["content"] = "";
-        response->json["created"] = timespec_real().tv_sec;
-        if (params->stream_include_usage) {
-            Json& usage = response->json["usage"];
-            usage["prompt_tokens"] = prompt_tokens;
-            usage["completion_tokens"] = completion_tokens;
-            usage["total_tokens"] = completion_tokens + prompt_tokens;
+        for (int i = 0; i < params->n; ++i) {
+            choice["index"] = i;
+            choice["delta"]["content"] = "";
+            choice["finish_reason"] = state->choices[i].finish_reason;
+            response->json["created"] = timespec_real().tv_sec;
+            if (params->stream_include_usage && i == params->n - 1) {
+                Json& usage = response->json["usage"];
+                usage["prompt_tokens"] = prompt_tokens;
+                usage["completion_tokens"] = completion_tokens;
+                usage["total_tokens"] = completion_tokens + prompt_tokens;
+            }
+            response->content = make_event(response->json);
+            choice.getObject().erase("delta");
+            if (!send_response_chunk(response->content))
+                return false;
         }
-        response->content = make_event(response->json);
-        choice.getObject().erase("delta");
-        if (!send_response_chunk(response->content))
-            return false;
         if (!send_response_chunk("data: [DONE]\n\n"))
             return false;
         return send_response_finish();
@@ -735,8 +934,15 @@ Client::v1_chat_completions()
         usage["prompt_tokens"] = prompt_tokens;
         usage["completion_tokens"] = completion_tokens;
         usage["total_tokens"] = completion_tokens + prompt_tokens;
-        choice["message"]["role"] = "assistant";
-        choice["message"]["content"] = std::move(response->content);
+        for (int i = 0; i < params->n; ++i) {
+            Json& choice = response->json["choices"][i];
+            choice["index"] = i;
+            choice["logprobs"] = nullptr;
+            choice["finish_reason"] = state->choices[i].finish_reason;
+            choice["message"]["role"] = "assistant";
+            choice["message"]["content"] =
+              std::move(state->choices[i].content);
+        }
         response->json["created"] = timespec_real().tv_sec;
         char* p = append_http_response_message(obuf_.p, 200);
         p = stpcpy(p, "Content-Type: application/json\r\n");
@@ -19,6 +19,7 @@
 #include "llamafile/llamafile.h"
 #include "llamafile/server/client.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/signals.h"
 #include "llamafile/server/tokenbucket.h"
@@ -56,7 +57,7 @@ Worker::begin()
         tokens = tokenbucket_acquire(client_.client_ip_);
     server_->lock();
     dll_remove(&server_->idle_workers, &elem_);
-    if (dll_is_empty(server_->idle_workers)) {
+    if (!server_->poller_ && dll_is_empty(server_->idle_workers)) {
         Dll* slowbro;
         if ((slowbro = dll_last(server_->active_workers))) {
             SLOG("all threads active! dropping oldest client");
@@ -64,6 +65,7 @@ Worker::begin()
         }
     }
     working_ = true;
+    server_->busy_workers.fetch_add(1, std::memory_order_relaxed);
     if (tokens > FLAG_token_burst) {
         dll_make_last(&server_->active_workers, &elem_);
     } else {
@@ -79,6 +81,7 @@ Worker::end()
     server_->lock();
     dll_remove(&server_->active_workers, &elem_);
     working_ = false;
+    server_->busy_workers.fetch_sub(1, std::memory_order_relaxed);
     dll_make_first(&server_->idle_workers, &elem_);
     server_->unlock();
 }
@@ -97,19 +100,64 @@ void
 Worker::retire()
 {
     server_->lock();
-    if (working_)
+    if (working_) {
         dll_remove(&server_->active_workers, &elem_);
-    else
+        server_->busy_workers.fetch_sub(1, std::memory_order_relaxed);
+    } else {
         dll_remove(&server_->idle_workers, &elem_);
+    }
     server_->worker_count.fetch_sub(1, std::memory_order_acq_rel);
     server_->signal();
     server_->unlock();
     delete this;
 }
 
+// serves connection that the poller says has a request ready
+//
+// the client gets run until it runs out of complete messages, and then
+// the connection is handed back to the poller to wait for more.
+void
+Worker::handle_ready()
+{
+    conn_ = server_->poller_->take();
+    set_thread_name(conn_->name);
+    client_.fd_ = conn_->fd;
+    client_.client_ip_ = conn_->ip;
+    memcpy(client_.ibuf_.p, conn_->buf.data(), conn_->buf.size());
+    client_.ibuf_.n = conn_->buf.size();
+    std::string().swap(conn_->buf);
+
+    begin();
+
+    try {
+        client_.run();
+    } catch (const std::exception& e) {
+        SLOG("caught %s", e.what());
+    } catch (...) {
+        SLOG("caught unknown exception");
+    }
+
+    Connection* conn = conn_;
+    if (client_.parked_) {
+        conn->buf.assign(client_.ibuf_.p, client_.ibuf_.n);
+        client_.fd_ = -1;
+        client_.close();
+        conn_ = nullptr;
+        server_->poller_->park(conn);
+    } else {
+        client_.close();
+        conn_ = nullptr;
+        delete conn;
+    }
+    end();
+}
+
 void
 Worker::handle()
 {
+    if (server_->poller_)
+        return handle_ready();
+
     if ((client_.fd_ = server_->accept(&client_.client_ip_)) == -1) {
         if (IsWindows() && errno == ENOTSOCK) {
             // Server::shutdown() calls close() on the listening socket
@@ -119,6 +167,7 @@ Worker::handle()
         return;
     }
 
+    client_.ibuf_.n = 0;
     begin();
 
     try {
@@ -143,7 +192,9 @@ Worker::run()
                 SLOG("warning: gpu mode disables pledge security");
         } else {
             const char* promises;
-            if (FLAG_www_root && !startswith(FLAG_www_root, "/zip/")) {
+            if (FLAG_slot_cache) {
+                promises = "stdio anet rpath wpath cpath";
+            } else if (FLAG_www_root && !startswith(FLAG_www_root, "/zip/")) {
                 promises = "stdio anet rpath";
             } else {
                 promises = "stdio anet";
@@ -167,7 +218,10 @@ Worker::run()
         if (worker->working_) {
             worker->client_.close();
             worker->end();
+        } else if (worker->conn_) {
+            close(worker->conn_->fd);
         }
+        delete worker->conn_;
         worker->retire();
     });
     cleanup.set(this);
@@ -27,6 +27,7 @@ struct llama_model;
 namespace lf {
 namespace server {
 
+struct Connection;
 struct Server;
 
 struct Worker
@@ -35,12 +36,14 @@ struct Worker
     Dll elem_;
     pthread_t th_ = 0;
     bool working_ = false;
+    Connection* conn_ = nullptr; // owned or null
     Client client_;
 
     explicit Worker(Server*, llama_model*);
     void run();
     void begin();
     void handle();
+    void handle_ready();
     void end();
     void deprioritize();
     void retire();
@@ -28,11 +28,14 @@ bool vector_starts_with(const std::vector<T> &sequence, const std::vector<T> &pr
     return std::equal(prefix.begin(), prefix.end(), sequence.begin());
 }
 
+// returns true if the first `end` elements of sequence end with suffix
 template <typename T>
-bool vector_ends_with(const std::vector<T> &sequence, const std::vector<T> &suffix) {
-    if (suffix.size() > sequence.size())
+bool vector_ends_with(const std::vector<T> &sequence, const std::vector<T> &suffix,
+                      size_t end = -1) {
+    end = std::min(end, sequence.size());
+    if (suffix.size() > end)
         return false;
-    return std::equal(sequence.rbegin(), sequence.rend(), suffix.rbegin());
+    return std::equal(suffix.begin(), suffix.end(), sequence.begin() + (end - suffix.size()));
 }
 
 template <typename T>